@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cfloat>
+#include <utility>
+#include "vector3.h"
+#include "ray.h"
+
+// axis aligned bounding box, default constructed box is empty so it can be grown with expand()
+class AABB
+{
+public:
+	AABB() = default;
+	AABB(const vector3& a, const vector3& b) : _min(a), _max(b) {}
+
+	inline const vector3& min() const { return _min; }
+	inline const vector3& max() const { return _max; }
+
+	inline bool empty() const { return _min.x() > _max.x() || _min.y() > _max.y() || _min.z() > _max.z(); }
+
+	inline void expand(const vector3& p) {
+		_min = vmin(_min, p);
+		_max = vmax(_max, p);
+	}
+
+	inline void expand(const AABB& box) {
+		_min = vmin(_min, box._min);
+		_max = vmax(_max, box._max);
+	}
+
+	inline vector3 centroid() const { return 0.5f * (_min + _max); }
+	inline vector3 extent() const { return _max - _min; }
+
+	inline float surface_area() const {
+		if (empty())
+			return 0.0f;
+		vector3 d = extent();
+		return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+
+	inline int largest_axis() const {
+		vector3 d = extent();
+		if (d.x() > d.y() && d.x() > d.z())
+			return 0;
+		return d.y() > d.z() ? 1 : 2;
+	}
+
+	// slab test, inv_dir is the per component reciprocal of the ray direction
+	inline bool hit(const ray& r, const vector3& inv_dir, float t_min, float t_max) const {
+		for (int a = 0; a < 3; a++) {
+			float t0 = (_min[a] - r.origin()[a]) * inv_dir[a];
+			float t1 = (_max[a] - r.origin()[a]) * inv_dir[a];
+			if (inv_dir[a] < 0.0f)
+				std::swap(t0, t1);
+			t_min = t0 > t_min ? t0 : t_min;
+			t_max = t1 < t_max ? t1 : t_max;
+			if (t_max < t_min)
+				return false;
+		}
+		return true;
+	}
+
+private:
+	vector3 _min = vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+	vector3 _max = vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+};
+
+inline AABB surrounding_box(const AABB& a, const AABB& b) {
+	return AABB(vmin(a.min(), b.min()), vmax(a.max(), b.max()));
+}
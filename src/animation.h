@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "vector3.h"
+#include "objects.h"
+
+struct CameraKey
+{
+	float	_time;		// seconds
+	vector3	_lookfrom;
+	vector3	_lookat;
+};
+
+struct SphereKey
+{
+	float		_time;
+	uint32_t	_sphere;	// id returned by World::add_sphere, the order of the spheres in a scene file
+	vector3		_center;
+};
+
+// keyframed camera path and sphere motion. values are interpolated linearly between keys and held
+// before the first and after the last key of a track
+class Animation
+{
+public:
+	void add_camera_key(const CameraKey& key);
+	void add_sphere_key(const SphereKey& key);
+
+	inline bool empty() const { return _camera.empty() && _spheres.empty(); }
+	inline const std::vector<CameraKey>& camera_keys() const { return _camera; }
+	inline const std::vector<SphereKey>& sphere_keys() const { return _spheres; }
+
+	// leaves lookfrom and lookat alone when there is no camera track
+	void camera_at(float time, vector3& lookfrom, vector3& lookat) const;
+
+	// moves every animated sphere of world to where it is at time, call World::update() afterwards
+	void apply(float time, World& world) const;
+
+	// camera keys that swing lookfrom around lookat about the vup axis by degrees over duration,
+	// one key per step so the path stays on the circle
+	void add_orbit(const vector3& lookfrom, const vector3& lookat, const vector3& vup, float degrees, float duration, int32_t steps);
+
+private:
+	std::vector<CameraKey> _camera;		// sorted by time
+	std::vector<SphereKey> _spheres;	// sorted by sphere, then time
+};
+
+void Animation::add_camera_key(const CameraKey& key)
+{
+	auto itr = std::upper_bound(_camera.begin(), _camera.end(), key,
+		[](const CameraKey& a, const CameraKey& b) { return a._time < b._time; });
+	_camera.insert(itr, key);
+}
+
+void Animation::add_sphere_key(const SphereKey& key)
+{
+	auto itr = std::upper_bound(_spheres.begin(), _spheres.end(), key, [](const SphereKey& a, const SphereKey& b) {
+		return a._sphere < b._sphere || (a._sphere == b._sphere && a._time < b._time);
+	});
+	_spheres.insert(itr, key);
+}
+
+// index of the key before time in keys [first, last) and the blend towards the one after it
+template <typename Key>
+static size_t find_keys(const std::vector<Key>& keys, size_t first, size_t last, float time, float& blend)
+{
+	size_t i = first;
+	while (i + 1 < last && keys[i + 1]._time <= time)
+		i++;
+	blend = 0.0f;
+	if (i + 1 < last && time > keys[i]._time)
+		blend = (time - keys[i]._time) / (keys[i + 1]._time - keys[i]._time);
+	return i;
+}
+
+void Animation::camera_at(float time, vector3& lookfrom, vector3& lookat) const
+{
+	if (_camera.empty())
+		return;
+	float blend;
+	size_t i = find_keys(_camera, 0, _camera.size(), time, blend);
+	lookfrom = _camera[i]._lookfrom;
+	lookat = _camera[i]._lookat;
+	if (blend > 0.0f) {
+		lookfrom += blend * (_camera[i + 1]._lookfrom - lookfrom);
+		lookat += blend * (_camera[i + 1]._lookat - lookat);
+	}
+}
+
+void Animation::apply(float time, World& world) const
+{
+	for (size_t first = 0; first < _spheres.size(); )
+	{
+		size_t last = first + 1;
+		while (last < _spheres.size() && _spheres[last]._sphere == _spheres[first]._sphere)
+			last++;
+
+		float blend;
+		size_t i = find_keys(_spheres, first, last, time, blend);
+		vector3 center = _spheres[i]._center;
+		if (blend > 0.0f)
+			center += blend * (_spheres[i + 1]._center - center);
+		world.move_sphere(_spheres[first]._sphere, center);
+		first = last;
+	}
+}
+
+void Animation::add_orbit(const vector3& lookfrom, const vector3& lookat, const vector3& vup, float degrees, float duration, int32_t steps)
+{
+	// rodrigues rotation of the offset from lookat around the unit up axis
+	vector3 k = unit_vector(vup);
+	vector3 offset = lookfrom - lookat;
+	steps = std::max(1, steps);
+	for (int32_t s = 0; s <= steps; s++)
+	{
+		float f = (float)s / (float)steps;
+		float angle = f * degrees * (float)M_PI / 180.0f;
+		float c = cosf(angle);
+		float sn = sinf(angle);
+		vector3 rotated = c * offset + sn * cross(k, offset) + (1.0f - c) * dot(k, offset) * k;
+		add_camera_key(CameraKey{ f * duration, lookat + rotated, lookat });
+	}
+}
+
+// output path of one frame of a sequence. a run of '#' in pattern is replaced by the zero padded
+// frame number, without one the number goes in front of the extension: out.ppm -> out_0007.ppm
+std::string frame_path(const std::string& pattern, int32_t frame)
+{
+	size_t hashes = pattern.find('#');
+	if (hashes != std::string::npos) {
+		size_t end = pattern.find_first_not_of('#', hashes);
+		size_t width = (end == std::string::npos ? pattern.size() : end) - hashes;
+		std::string number = std::to_string(frame);
+		if (number.size() < width)
+			number.insert(0, width - number.size(), '0');
+		return pattern.substr(0, hashes) + number + (end == std::string::npos ? "" : pattern.substr(end));
+	}
+
+	char number[16];
+	snprintf(number, sizeof(number), "_%04d", frame);
+	size_t dot = pattern.find_last_of('.');
+	size_t slash = pattern.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return pattern + number;
+	return pattern.substr(0, dot) + number + pattern.substr(dot);
+}
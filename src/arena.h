@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// bump allocator for scene objects. objects are packed into large blocks in creation order and
+// are all destroyed and freed together by reset() or the destructor, there is no per object free
+class Arena
+{
+public:
+	explicit Arena(size_t block_size = 64 * 1024) : _block_size(block_size) {}
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	~Arena() { reset(); }
+
+	void* allocate(size_t size, size_t alignment) {
+		uintptr_t p = (_cursor + alignment - 1) & ~(uintptr_t)(alignment - 1);
+		if (_blocks.empty() || p + size > _end) {
+			// oversized requests get a block of their own
+			size_t block = std::max(_block_size, size + alignment);
+			_blocks.emplace_back(new uint8_t[block]);
+			_cursor = (uintptr_t)_blocks.back().get();
+			_end = _cursor + block;
+			p = (_cursor + alignment - 1) & ~(uintptr_t)(alignment - 1);
+		}
+		_cursor = p + size;
+		return (void*)p;
+	}
+
+	template <typename T, typename... Args>
+	T* make(Args&&... args) {
+		T* obj = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+			_destructors.push_back({ obj, [](void* p) { static_cast<T*>(p)->~T(); } });
+		return obj;
+	}
+
+	// destroys everything in reverse creation order and releases the memory in one go
+	void reset() {
+		for (auto itr = _destructors.rbegin(); itr != _destructors.rend(); ++itr)
+			itr->_destroy(itr->_object);
+		_destructors.clear();
+		_blocks.clear();
+		_cursor = 0;
+		_end = 0;
+	}
+
+private:
+	struct Destructor
+	{
+		void* _object;
+		void (*_destroy)(void*);
+	};
+
+	size_t _block_size;
+	std::vector<std::unique_ptr<uint8_t[]>> _blocks;
+	std::vector<Destructor> _destructors;
+	uintptr_t _cursor = 0;
+	uintptr_t _end = 0;
+};
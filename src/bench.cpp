@@ -0,0 +1,605 @@
+// bench.cpp : renders the standard scenes with fixed seeds over a matrix of resolutions, sample counts
+// and thread counts, prints a summary and writes the results as JSON so runs can be compared per commit.
+// --save-images DIR keeps the rendered frames, --compare DIR measures how far another build's frames are
+// from them (SPUD_FAST_MATH against the exact math, say) and --max-error fails the run above a bound.
+// --kernels times a few of the hot vector kernels on their own, once per vector layout
+//
+
+#include "objects.h"
+#include "camera.h"
+#include "integrator.h"
+
+#include <stdlib.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "threadqueue.h"
+#include "image_io.h"
+#include "film.h"
+#include "render.h"
+#include "wavefront.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "vector3_batch.h"
+
+struct BenchResult
+{
+	std::string	_scene;
+	size_t	_spheres;
+	int32_t	_width;
+	int32_t	_height;
+	int32_t	_samples;
+	int32_t	_threads;
+	double	_scene_time;	// seconds, filling the world
+	double	_bvh_time;		// seconds, World::build
+	double	_render_time;	// seconds, best of the repeats
+	double	_output_time;	// seconds, resolving the film and encoding it to 8 bit PPM in memory
+	uint64_t	_rays;
+	double	_rays_per_second;
+	double	_samples_per_second;
+	double	_scaling;		// speedup over the single thread run divided by the thread count, 0 if there was none before it
+	double	_image_error;	// rms difference to the --compare image, -1 without one
+};
+
+struct KernelResult
+{
+	std::string	_kernel;
+	std::string	_layout;
+	size_t	_items;
+	double	_ns_per_item;	// best pass
+	double	_checksum;		// sum of the outputs, equal across layouts up to rounding
+};
+
+static double seconds_since(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// "1,2,8" -> {1, 2, 8}, returns false on anything that isn't a positive number
+static bool parse_int_list(const char* text, std::vector<int32_t>& values)
+{
+	values.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		int32_t v = atoi(item.c_str());
+		if (v <= 0)
+			return false;
+		values.push_back(v);
+	}
+	return !values.empty();
+}
+
+// "320x180,1280x720"
+static bool parse_resolutions(const char* text, std::vector<std::pair<int32_t, int32_t>>& values)
+{
+	values.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		int32_t w = 0, h = 0;
+		if (!parse_resolution(item.c_str(), w, h))
+			return false;
+		values.push_back(std::make_pair(w, h));
+	}
+	return !values.empty();
+}
+
+// where --save-images and --compare keep the image of one scene, resolution and sample count
+static std::string image_path(const std::string& dir, const std::string& scene, int32_t width, int32_t height, int32_t samples)
+{
+	return dir + "/" + scene + "_" + std::to_string(width) + "x" + std::to_string(height) + "_" + std::to_string(samples) + ".pfm";
+}
+
+// root mean square difference over all channels of two linear images
+static double image_rms_error(const std::vector<vector3>& a, const std::vector<vector3>& b)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); i++) {
+		vector3 d = a[i] - b[i];
+		sum += (double)d.x() * d.x() + (double)d.y() * d.y() + (double)d.z() * d.z();
+	}
+	return sqrt(sum / (3.0 * a.size()));
+}
+
+// the kernel inputs and vector outputs, both as vector3 array and as columns
+struct KernelColumns
+{
+	std::vector<vector3> _aos;
+	std::vector<float> _x, _y, _z;
+
+	void resize(size_t n) {
+		_aos.resize(n);
+		_x.resize(n);
+		_y.resize(n);
+		_z.resize(n);
+	}
+
+	void set(size_t i, const vector3& v) {
+		_aos[i] = v;
+		_x[i] = v.x();
+		_y[i] = v.y();
+		_z[i] = v.z();
+	}
+};
+
+// how a kernel reads and writes its data, for a single vector3 and for batches
+template <typename V>
+struct KernelBatch;
+
+template <>
+struct KernelBatch<vector3>
+{
+	typedef float Float;
+	static const int WIDTH = 1;
+	static inline vector3 load(const KernelColumns& c, size_t i) { return c._aos[i]; }
+	static inline void store(KernelColumns& c, size_t i, const vector3& v) { c._aos[i] = v; }
+	static inline void store(float* f, size_t i, float v) { f[i] = v; }
+	static inline float choose(bool mask, float a, float b) { return mask ? a : b; }
+};
+
+template <typename F>
+struct KernelBatch<vector3xN<F>>
+{
+	typedef F Float;
+	static const int WIDTH = F::WIDTH;
+	static inline vector3xN<F> load(const KernelColumns& c, size_t i) { return vector3xN<F>::load(&c._x[i], &c._y[i], &c._z[i]); }
+	static inline void store(KernelColumns& c, size_t i, const vector3xN<F>& v) { v.store(&c._x[i], &c._y[i], &c._z[i]); }
+	static inline void store(float* f, size_t i, const F& v) { v.store(f + i); }
+	static inline F choose(const F& mask, const F& a, const F& b) { return select(mask, a, b); }
+};
+
+// nearest root of the sphere quadratic, -1 on a miss
+template <typename V>
+static inline typename KernelBatch<V>::Float kernel_sphere(const V& origin, const V& direction, const V& center, float radius)
+{
+	typedef typename KernelBatch<V>::Float F;
+	using std::sqrt;
+	V oc = origin - center;
+	F a = dot(direction, direction);
+	F b = dot(oc, direction);
+	F c = dot(oc, oc) - F(radius * radius);
+	F discriminant = b * b - a * c;
+	return KernelBatch<V>::choose(discriminant > F(0.0f), (-b - sqrt(discriminant)) / a, F(-1.0f));
+}
+
+// normalize and blend, as sky_color
+template <typename V>
+static inline V kernel_sky(const V& direction)
+{
+	typedef typename KernelBatch<V>::Float F;
+	V unit = unit_vector(direction);
+	F t = F(0.5f) * (unit.y() + F(1.0f));
+	return (F(1.0f) - t) * V(vector3::ONE) + t * V(vector3(0.5f, 0.7f, 1.0f));
+}
+
+template <typename V>
+static inline V kernel_reflect(const V& v, const V& n)
+{
+	typedef typename KernelBatch<V>::Float F;
+	return v - F(2.0f) * dot(v, n) * n;
+}
+
+enum class Kernel { Sphere, Sky, Reflect, Count };
+static const char* KERNEL_NAMES[] = { "sphere", "sky", "reflect" };
+
+// one pass of a kernel over all items
+template <typename V>
+static void kernel_pass(Kernel kernel, const KernelColumns& a, const KernelColumns& b, KernelColumns& out, std::vector<float>& out_t)
+{
+	typedef KernelBatch<V> B;
+	size_t n = a._aos.size();
+	const V center(vector3(0.0f, 0.0f, -1.0f));
+	switch (kernel) {
+	case Kernel::Sphere:
+		for (size_t i = 0; i < n; i += B::WIDTH)
+			B::store(out_t.data(), i, kernel_sphere(B::load(a, i), B::load(b, i), center, 0.5f));
+		break;
+	case Kernel::Sky:
+		for (size_t i = 0; i < n; i += B::WIDTH)
+			B::store(out, i, kernel_sky(B::load(b, i)));
+		break;
+	default:
+		for (size_t i = 0; i < n; i += B::WIDTH)
+			B::store(out, i, kernel_reflect(B::load(a, i), B::load(b, i)));
+		break;
+	}
+}
+
+template <typename V>
+static KernelResult time_kernel(Kernel kernel, const char* layout, int32_t passes,
+	const KernelColumns& a, const KernelColumns& b, KernelColumns& out, std::vector<float>& out_t)
+{
+	KernelResult r;
+	r._kernel = KERNEL_NAMES[(int)kernel];
+	r._layout = layout;
+	r._items = a._aos.size();
+	double best = 0.0;
+	for (int32_t pass = 0; pass < passes; pass++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		kernel_pass<V>(kernel, a, b, out, out_t);
+		double t = seconds_since(start);
+		if (pass == 0 || t < best)
+			best = t;
+	}
+	r._ns_per_item = best * 1e9 / r._items;
+
+	r._checksum = 0.0;
+	bool aos = KernelBatch<V>::WIDTH == 1;
+	for (size_t i = 0; i < r._items; i++) {
+		if (kernel == Kernel::Sphere)
+			r._checksum += out_t[i];
+		else if (aos)
+			r._checksum += (double)out._aos[i].x() + out._aos[i].y() + out._aos[i].z();
+		else
+			r._checksum += (double)out._x[i] + out._y[i] + out._z[i];
+	}
+	return r;
+}
+
+// the kernels over random rays in every layout. the loops are the same code for all of them, only
+// the type changes: vector3 walks an array of vectors (one SSE register each with SPUD_SSE_VECTOR3),
+// vector3x4 and vector3x8 walk columns of floats 4 and 8 at a time
+static void bench_kernels(size_t items, int32_t passes, uint64_t seed, std::vector<KernelResult>& results)
+{
+	items = (items + 7) / 8 * 8;
+	KernelColumns origins, directions, out;
+	origins.resize(items);
+	directions.resize(items);
+	out.resize(items);
+	std::vector<float> out_t(items);
+
+	Rng rng(seed);
+	for (size_t i = 0; i < items; i++) {
+		origins.set(i, vector3(rng.next_float(), rng.next_float(), rng.next_float()) * 2.0f - vector3::ONE);
+		directions.set(i, vector3(rng.next_float() - 0.5f, rng.next_float() - 0.5f, -rng.next_float() - 0.1f));
+	}
+
+	std::cout << "kernels: " << items << " item(s), best of " << passes << " pass(es)\n";
+	for (int k = 0; k < (int)Kernel::Count; k++) {
+		Kernel kernel = (Kernel)k;
+		KernelResult r[3] = {
+			time_kernel<vector3>(kernel, "vector3", passes, origins, directions, out, out_t),
+			time_kernel<vector3x4>(kernel, "vector3x4", passes, origins, directions, out, out_t),
+			time_kernel<vector3x8>(kernel, "vector3x8", passes, origins, directions, out, out_t) };
+		for (const KernelResult& result : r) {
+			std::cout << "  " << result._kernel << " " << result._layout << ": " << result._ns_per_item << " ns/item, checksum "
+				<< result._checksum << "\n";
+			results.push_back(result);
+		}
+	}
+}
+
+static const char* simd_name()
+{
+#if defined(SPUD_SIMD_AVX)
+	return "avx";
+#elif defined(SPUD_SIMD_SSE)
+	return "sse2";
+#else
+	return "scalar";
+#endif
+}
+
+static const char* vector3_layout_name()
+{
+#if defined(SPUD_SSE_VECTOR3)
+	return "sse";
+#else
+	return "scalar";
+#endif
+}
+
+// s as the contents of a JSON string literal
+static std::string json_escape(const std::string& s)
+{
+	std::string out;
+	out.reserve(s.size());
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}
+		else if ((unsigned char)c < 0x20) {
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", (unsigned)(unsigned char)c);
+			out += code;
+		}
+		else
+			out += c;
+	}
+	return out;
+}
+
+static bool write_json(const char* path, const char* label, bool wavefront, int32_t packet_size, SamplerKind sampler, const std::vector<BenchResult>& results,
+	const std::vector<KernelResult>& kernels)
+{
+	std::ofstream file;
+	std::ostream* stream = &std::cout;
+	if (strcmp(path, "-") != 0) {
+		file.open(path, std::ios::out | std::ios::trunc);
+		if (!file.is_open())
+			return false;
+		stream = &file;
+	}
+	std::ostream& out = *stream;
+	out.precision(9);
+
+	out << "{\n";
+	out << "  \"label\": \"" << json_escape(label) << "\",\n";
+	out << "  \"renderer\": \"" << (wavefront ? "wavefront" : "path") << "\",\n";
+	out << "  \"packet\": " << (wavefront ? 0 : packet_size) << ",\n";
+	out << "  \"simd\": \"" << simd_name() << "\",\n";
+	out << "  \"sampler\": \"" << sampler_name(sampler) << "\",\n";
+	out << "  \"math\": \"" << math_precision_name() << "\",\n";
+	out << "  \"vector3\": \"" << vector3_layout_name() << "\",\n";
+	out << "  \"hardware_threads\": " << ThreadPool::default_thread_count() << ",\n";
+	out << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		out << "    { \"scene\": \"" << json_escape(r._scene) << "\", \"spheres\": " << r._spheres
+			<< ", \"width\": " << r._width << ", \"height\": " << r._height
+			<< ", \"spp\": " << r._samples << ", \"threads\": " << r._threads
+			<< ", \"scene_seconds\": " << r._scene_time << ", \"bvh_seconds\": " << r._bvh_time
+			<< ", \"render_seconds\": " << r._render_time << ", \"output_seconds\": " << r._output_time
+			<< ", \"rays\": " << r._rays << ", \"rays_per_second\": " << r._rays_per_second
+			<< ", \"samples_per_second\": " << r._samples_per_second;
+		// without a single thread run ahead of it in the sweep there is nothing to scale against
+		if (r._scaling > 0.0)
+			out << ", \"scaling_efficiency\": " << r._scaling;
+		if (r._image_error >= 0.0)
+			out << ", \"image_rms_error\": " << r._image_error;
+		out << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]";
+	if (!kernels.empty()) {
+		out << ",\n  \"kernels\": [\n";
+		for (size_t i = 0; i < kernels.size(); i++) {
+			const KernelResult& k = kernels[i];
+			out << "    { \"kernel\": \"" << k._kernel << "\", \"layout\": \"" << k._layout << "\", \"items\": " << k._items
+				<< ", \"ns_per_item\": " << k._ns_per_item << ", \"checksum\": " << k._checksum << " }"
+				<< (i + 1 < kernels.size() ? "," : "") << "\n";
+		}
+		out << "  ]";
+	}
+	out << "\n}\n";
+	return out.good();
+}
+
+int main(int argc, char** argv)
+{
+	const int32_t tile_size = 32;
+	uint64_t seed = 0;
+	int32_t max_depth = 50;
+	int32_t rr_depth = 3;
+	int32_t repeat = 1;
+	int32_t stress_spheres = 100000;
+	bool wavefront = false;
+	int32_t packet_size = RayPacket::MAX_EDGE;
+	SamplerKind sampler = SamplerKind::Sobol;
+	const char* json_path = "bench.json";
+	const char* label = "";
+	// images of an exact build saved with --save-images, compared against by a fast math build
+	const char* save_images_dir = nullptr;
+	const char* compare_dir = nullptr;
+	double max_error = -1.0;
+	bool kernels = false;
+	int32_t kernel_items = 1 << 16;
+	std::vector<std::string> scene_names = { "sample", "book_cover", "stress" };
+	std::vector<std::pair<int32_t, int32_t>> resolutions = { { 320, 180 }, { 640, 360 } };
+	std::vector<int32_t> spp = { 4, 16 };
+	std::vector<int32_t> threads = { 1 };
+	if (ThreadPool::default_thread_count() > 1)
+		threads.push_back(ThreadPool::default_thread_count());
+
+	for (int a = 1; a < argc; a++) {
+		bool ok = true;
+		if (strcmp(argv[a], "--scenes") == 0 && a + 1 < argc) {
+			scene_names.clear();
+			std::stringstream stream(argv[++a]);
+			std::string item;
+			while (std::getline(stream, item, ','))
+				scene_names.push_back(item);
+		}
+		else if (strcmp(argv[a], "--resolutions") == 0 && a + 1 < argc)
+			ok = parse_resolutions(argv[++a], resolutions);
+		else if (strcmp(argv[a], "--spp") == 0 && a + 1 < argc)
+			ok = parse_int_list(argv[++a], spp);
+		else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+			ok = parse_int_list(argv[++a], threads);
+		else if (strcmp(argv[a], "--repeat") == 0 && a + 1 < argc)
+			repeat = std::max(1, atoi(argv[++a]));
+		else if (strcmp(argv[a], "--stress-spheres") == 0 && a + 1 < argc)
+			stress_spheres = std::max(1, atoi(argv[++a]));
+		else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc)
+			seed = strtoull(argv[++a], nullptr, 10);
+		else if (strcmp(argv[a], "--max-depth") == 0 && a + 1 < argc)
+			max_depth = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--rr-depth") == 0 && a + 1 < argc)
+			rr_depth = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--wavefront") == 0)
+			wavefront = true;
+		else if (strcmp(argv[a], "--packet") == 0 && a + 1 < argc) {
+			packet_size = atoi(argv[++a]);
+			ok = packet_size >= 0 && packet_size <= RayPacket::MAX_EDGE;
+		}
+		else if (strcmp(argv[a], "--sampler") == 0 && a + 1 < argc)
+			ok = parse_sampler(argv[++a], sampler);
+		else if (strcmp(argv[a], "--json") == 0 && a + 1 < argc)
+			json_path = argv[++a];
+		else if (strcmp(argv[a], "--label") == 0 && a + 1 < argc)
+			label = argv[++a];
+		else if (strcmp(argv[a], "--save-images") == 0 && a + 1 < argc)
+			save_images_dir = argv[++a];
+		else if (strcmp(argv[a], "--compare") == 0 && a + 1 < argc)
+			compare_dir = argv[++a];
+		else if (strcmp(argv[a], "--max-error") == 0 && a + 1 < argc)
+			max_error = atof(argv[++a]);
+		else if (strcmp(argv[a], "--kernels") == 0)
+			kernels = true;
+		else if (strcmp(argv[a], "--kernel-items") == 0 && a + 1 < argc)
+			kernel_items = std::max(1, atoi(argv[++a]));
+		else
+			ok = false;
+		if (!ok) {
+			std::cerr << "Bad argument " << argv[a] << "\n";
+			return 1;
+		}
+	}
+
+	// the same limits as scene files, before any film is allocated
+	for (const auto& resolution : resolutions) {
+		for (int32_t samples : spp) {
+			SceneSettings limits;
+			limits._width = resolution.first;
+			limits._height = resolution.second;
+			limits._samples = samples;
+			limits._max_depth = max_depth;
+			std::string error;
+			if (!check_settings(limits, error)) {
+				std::cerr << "Bad render settings: " << error << "\n";
+				return 1;
+			}
+		}
+	}
+
+	std::vector<KernelResult> kernel_results;
+	if (kernels)
+		bench_kernels((size_t)kernel_items, std::max(repeat, 20), seed, kernel_results);
+
+	// the standard scenes, everything random is driven by the fixed seed
+	std::vector<BenchResult> results;
+	std::vector<vector3> reference;
+	bool error_exceeded = false;
+	for (const std::string& name : scene_names)
+	{
+		World world;
+		SceneSettings settings;
+		Rng scene_rng(seed);
+		auto start = std::chrono::high_resolution_clock::now();
+		if (!build_builtin_scene(name, world, scene_rng, settings, stress_spheres)) {
+			std::cerr << "Unknown scene " << name << " (expected default, sample, book_cover, stress or crowd)\n";
+			return 1;
+		}
+		double scene_time = seconds_since(start);
+
+		start = std::chrono::high_resolution_clock::now();
+		world.build();
+		double bvh_time = seconds_since(start);
+
+		std::cout << name << ": " << world.sphere_count() << " sphere(s), scene " << scene_time * 1000.0
+			<< " ms, bvh " << bvh_time * 1000.0 << " ms\n";
+
+		for (const auto& resolution : resolutions)
+		{
+			int32_t width = resolution.first;
+			int32_t height = resolution.second;
+			const SceneSettings& s = settings;
+			Camera cam(s._lookfrom, s._lookat, s._vup, s._vfov, (float)width / (float)height, s._aperture, s._focus_dist);
+			Film film(width, height, tile_size);
+			std::vector<vector3> frame_buffer((size_t)width * height);
+			std::vector<uint8_t> encoded((size_t)width * height * 3);
+
+			for (int32_t samples : spp)
+			{
+				double single_thread_time = 0.0;
+				for (int32_t n_threads : threads)
+				{
+					ThreadPool pool(n_threads);
+					pool.init();
+					SceneInfo scene = { width, height, samples, tile_size, seed, max_depth, rr_depth, sampler, packet_size, &cam, &world };
+
+					BenchResult r;
+					r._render_time = 0.0;
+					for (int32_t rep = 0; rep < repeat; rep++) {
+						ray_total() = 0;
+						film.clear();
+						start = std::chrono::high_resolution_clock::now();
+						if (wavefront)
+							wavefront_process(pool, scene, film);
+						else
+							thread_process(pool, scene, film);
+						double t = seconds_since(start);
+						if (rep == 0 || t < r._render_time)
+							r._render_time = t;
+					}
+
+					start = std::chrono::high_resolution_clock::now();
+					film.resolve(frame_buffer.data());
+					encode_pixels(ImageFormat::PPM, frame_buffer.data(), frame_buffer.size(), encoded.data());
+					r._output_time = seconds_since(start);
+
+					// the image doesn't depend on the thread count, only the first run of a setting is checked
+					r._image_error = -1.0;
+					if (n_threads == threads.front()) {
+						std::string path;
+						if (save_images_dir) {
+							path = image_path(save_images_dir, name, width, height, samples);
+							if (!write_image(path.c_str(), ImageFormat::PFM, width, height, frame_buffer.data())) {
+								std::cerr << "Failed to write " << path << "\n";
+								return 1;
+							}
+						}
+						if (compare_dir) {
+							path = image_path(compare_dir, name, width, height, samples);
+							int32_t ref_width = 0, ref_height = 0;
+							std::string error;
+							if (!read_pfm(path.c_str(), ref_width, ref_height, reference, error)) {
+								std::cerr << "Failed to compare: " << error << "\n";
+								return 1;
+							}
+							if (ref_width != width || ref_height != height) {
+								std::cerr << path << " is " << ref_width << "x" << ref_height << "\n";
+								return 1;
+							}
+							r._image_error = image_rms_error(frame_buffer, reference);
+						}
+					}
+
+					r._scene = name;
+					r._spheres = world.sphere_count();
+					r._width = width;
+					r._height = height;
+					r._samples = samples;
+					r._threads = n_threads;
+					r._scene_time = scene_time;
+					r._bvh_time = bvh_time;
+					r._rays = ray_total().load();
+					r._rays_per_second = (double)r._rays / r._render_time;
+					r._samples_per_second = (double)width * height * samples / r._render_time;
+					if (n_threads == 1)
+						single_thread_time = r._render_time;
+					r._scaling = single_thread_time > 0.0 ? single_thread_time / (r._render_time * n_threads) : 0.0;
+					results.push_back(r);
+
+					std::cout << "  " << width << "x" << height << " " << samples << " spp " << n_threads << " thread(s): "
+						<< r._render_time * 1000.0 << " ms, " << r._rays_per_second / 1e6 << " Mrays/s, "
+						<< r._samples_per_second / 1e6 << " Msamples/s";
+					if (r._scaling > 0.0 && n_threads > 1)
+						std::cout << ", scaling " << r._scaling * 100.0 << "%";
+					if (r._image_error >= 0.0) {
+						std::cout << ", image error " << r._image_error;
+						if (max_error >= 0.0 && r._image_error > max_error) {
+							std::cout << " (above " << max_error << ")";
+							error_exceeded = true;
+						}
+					}
+					std::cout << "\n";
+				}
+			}
+		}
+	}
+
+	if (!write_json(json_path, label, wavefront, packet_size, sampler, results, kernel_results)) {
+		std::cerr << "Failed to write " << json_path << "\n";
+		return 1;
+	}
+	return error_exceeded ? 1 : 0;
+}
@@ -0,0 +1,362 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "aabb.h"
+#include "packet.h"
+#include "profile.h"
+
+// flattened bounding volume hierarchy built with the binned surface area heuristic.
+// the tree only knows about primitive bounds, callers get the leaf ranges back through
+// primitive_index() (or reorder their own storage with it) and do the actual hit tests
+class BVH
+{
+public:
+	struct Node
+	{
+		AABB bounds;
+		uint32_t offset;	// leaf: first primitive, interior: index of the second child (first child is node + 1)
+		uint16_t count;		// number of primitives, 0 for interior nodes
+		uint8_t axis;		// split axis, used to pick the near child first
+		uint8_t pad;
+
+		inline bool leaf() const { return count > 0; }
+	};
+
+	BVH() = default;
+
+	// builds the tree over the given primitive bounds, previous content is discarded
+	void build(const std::vector<AABB>& bounds, int max_leaf_size = 4);
+
+	void clear() {
+		_nodes.clear();
+		_indices.clear();
+	}
+
+	// recomputes the node bounds bottom up after primitives moved, the topology stays as it was built.
+	// bounds(slot) returns the current bounds of the primitive in leaf slot slot
+	template <typename BoundsFn>
+	void refit(BoundsFn&& bounds);
+
+	// expected cost of a ray through the tree relative to its root's area. refitting moving primitives
+	// makes it grow, comparing it with the cost after build() tells when a rebuild pays off
+	float sah_cost() const;
+
+	inline bool empty() const { return _nodes.empty(); }
+	inline const std::vector<Node>& nodes() const { return _nodes; }
+	inline const AABB& bounds() const { return _nodes[0].bounds; }
+
+	// maps a leaf slot to the index of the primitive passed to build()
+	inline uint32_t primitive_index(uint32_t slot) const { return _indices[slot]; }
+	inline const std::vector<uint32_t>& primitive_indices() const { return _indices; }
+
+	// walks the tree front to back calling leaf(first, count, t_max) for every leaf the ray enters.
+	// leaf returns true when it found a hit and must shrink t_max to the closest hit distance
+	template <typename LeafFn>
+	bool traverse(const ray& r, float t_min, float& t_max, LeafFn&& leaf) const;
+
+	// traverse() for every ray of a coherent packet at once. a node is visited while any ray can still
+	// enter it, nodes outside the packet's intervals are dropped without testing a single ray.
+	// leaf(first, count, k, t_max) is called for every ray k entering a leaf and shrinks t_max on a hit.
+	// the rays see their leaves in the order traverse() would visit them
+	template <typename LeafFn>
+	void traverse_packet(RayPacket& packet, float t_min, LeafFn&& leaf) const;
+
+private:
+	static const int BIN_COUNT = 16;
+	// past this depth the builder only does median splits, which keeps the tree within the traversal stack
+	static const int MAX_SAH_DEPTH = 48;
+	static const int STACK_SIZE = 128;
+
+	struct BuildPrim
+	{
+		AABB bounds;
+		vector3 centroid;
+		uint32_t index;
+	};
+
+	struct Bin
+	{
+		AABB bounds;
+		uint32_t count = 0;
+	};
+
+	uint32_t build_recursive(std::vector<BuildPrim>& prims, uint32_t begin, uint32_t end, int depth);
+	uint32_t make_leaf(std::vector<BuildPrim>& prims, uint32_t node, uint32_t begin, uint32_t end);
+
+	std::vector<Node> _nodes;
+	std::vector<uint32_t> _indices;
+	int _max_leaf_size = 4;
+};
+
+void BVH::build(const std::vector<AABB>& bounds, int max_leaf_size)
+{
+	clear();
+	_max_leaf_size = std::max(1, std::min(max_leaf_size, 0xffff));
+	if (bounds.empty())
+		return;
+
+	std::vector<BuildPrim> prims(bounds.size());
+	for (uint32_t i = 0; i < (uint32_t)bounds.size(); i++) {
+		prims[i].bounds = bounds[i];
+		prims[i].centroid = bounds[i].centroid();
+		prims[i].index = i;
+	}
+
+	// a binary tree with leaves of at least one primitive never has more than 2n - 1 nodes
+	_nodes.reserve(2 * prims.size() - 1);
+	_indices.reserve(prims.size());
+	build_recursive(prims, 0, (uint32_t)prims.size(), 0);
+}
+
+uint32_t BVH::make_leaf(std::vector<BuildPrim>& prims, uint32_t node, uint32_t begin, uint32_t end)
+{
+	_nodes[node].offset = (uint32_t)_indices.size();
+	_nodes[node].count = (uint16_t)(end - begin);
+	for (uint32_t i = begin; i < end; i++)
+		_indices.push_back(prims[i].index);
+	return node;
+}
+
+uint32_t BVH::build_recursive(std::vector<BuildPrim>& prims, uint32_t begin, uint32_t end, int depth)
+{
+	uint32_t node = (uint32_t)_nodes.size();
+	_nodes.emplace_back();
+	_nodes[node].offset = 0;
+	_nodes[node].count = 0;
+	_nodes[node].axis = 0;
+	_nodes[node].pad = 0;
+
+	AABB bounds, centroid_bounds;
+	for (uint32_t i = begin; i < end; i++) {
+		bounds.expand(prims[i].bounds);
+		centroid_bounds.expand(prims[i].centroid);
+	}
+	_nodes[node].bounds = bounds;
+
+	uint32_t count = end - begin;
+	if (count == 1)
+		return make_leaf(prims, node, begin, end);
+
+	// evaluate binned SAH on all three axes and keep the cheapest split
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	int best_split = 0;
+	vector3 cmin = centroid_bounds.min();
+	vector3 cext = centroid_bounds.extent();
+
+	for (int axis = 0; axis < 3; axis++) {
+		if (cext[axis] <= 0.0f)
+			continue;
+
+		Bin bins[BIN_COUNT];
+		float scale = BIN_COUNT / cext[axis];
+		for (uint32_t i = begin; i < end; i++) {
+			int b = std::min(BIN_COUNT - 1, (int)((prims[i].centroid[axis] - cmin[axis]) * scale));
+			bins[b].count++;
+			bins[b].bounds.expand(prims[i].bounds);
+		}
+
+		// sweep from the right to get the area and count of every right hand side
+		float right_area[BIN_COUNT];
+		uint32_t right_count[BIN_COUNT];
+		AABB right_box;
+		uint32_t right_sum = 0;
+		for (int b = BIN_COUNT - 1; b > 0; b--) {
+			right_box.expand(bins[b].bounds);
+			right_sum += bins[b].count;
+			right_area[b] = right_box.surface_area();
+			right_count[b] = right_sum;
+		}
+
+		AABB left_box;
+		uint32_t left_sum = 0;
+		for (int b = 0; b < BIN_COUNT - 1; b++) {
+			left_box.expand(bins[b].bounds);
+			left_sum += bins[b].count;
+			if (left_sum == 0 || right_count[b + 1] == 0)
+				continue;
+			float cost = left_sum * left_box.surface_area() + right_count[b + 1] * right_area[b + 1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b;
+			}
+		}
+	}
+
+	if (best_axis < 0 && count <= (uint32_t)_max_leaf_size)
+		return make_leaf(prims, node, begin, end);
+
+	// traversal cost of 1 against intersection cost of 1 per primitive, relative to the parent area
+	float area = bounds.surface_area();
+	float split_cost = 1.0f + (area > 0.0f ? best_cost / area : 0.0f);
+	if (best_axis >= 0 && count <= (uint32_t)_max_leaf_size && split_cost >= (float)count)
+		return make_leaf(prims, node, begin, end);
+
+	uint32_t mid = begin;
+	int axis = best_axis >= 0 ? best_axis : centroid_bounds.largest_axis();
+	if (best_axis >= 0 && depth < MAX_SAH_DEPTH) {
+		float scale = BIN_COUNT / cext[axis];
+		float base = cmin[axis];
+		int split = best_split;
+		auto mid_itr = std::partition(prims.begin() + begin, prims.begin() + end, [=](const BuildPrim& p) {
+			int b = std::min(BIN_COUNT - 1, (int)((p.centroid[axis] - base) * scale));
+			return b <= split;
+		});
+		mid = (uint32_t)(mid_itr - prims.begin());
+	}
+
+	// coincident centroids, a degenerate partition or a runaway deep tree fall back to a median split
+	if (mid == begin || mid == end) {
+		mid = begin + count / 2;
+		std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+			[=](const BuildPrim& a, const BuildPrim& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	_nodes[node].axis = (uint8_t)axis;
+	build_recursive(prims, begin, mid, depth + 1);
+	uint32_t second = build_recursive(prims, mid, end, depth + 1);
+	_nodes[node].offset = second;
+	return node;
+}
+
+template <typename BoundsFn>
+void BVH::refit(BoundsFn&& bounds)
+{
+	// children always come after their parent, so one backwards sweep sees them first
+	for (size_t n = _nodes.size(); n-- > 0; ) {
+		Node& node = _nodes[n];
+		AABB box;
+		if (node.leaf()) {
+			for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++)
+				box.expand(bounds(slot));
+		}
+		else {
+			box.expand(_nodes[n + 1].bounds);
+			box.expand(_nodes[node.offset].bounds);
+		}
+		node.bounds = box;
+	}
+}
+
+float BVH::sah_cost() const
+{
+	if (_nodes.empty())
+		return 0.0f;
+	float root_area = _nodes[0].bounds.surface_area();
+	if (root_area <= 0.0f)
+		return 0.0f;
+
+	// same unit costs as the builder, one per node visited and one per primitive tested
+	float cost = 0.0f;
+	for (const Node& node : _nodes)
+		cost += node.bounds.surface_area() * (node.leaf() ? (float)node.count : 1.0f);
+	return cost / root_area;
+}
+
+template <typename LeafFn>
+bool BVH::traverse(const ray& r, float t_min, float& t_max, LeafFn&& leaf) const
+{
+	if (_nodes.empty())
+		return false;
+
+	const vector3& d = r.direction();
+	vector3 inv_dir(1.0f / d.x(), 1.0f / d.y(), 1.0f / d.z());
+	bool dir_neg[3] = { inv_dir.x() < 0.0f, inv_dir.y() < 0.0f, inv_dir.z() < 0.0f };
+
+	uint32_t stack[STACK_SIZE];
+	int stack_size = 0;
+	uint32_t current = 0;
+	bool hit_anything = false;
+
+	while (true) {
+		const Node& node = _nodes[current];
+		SPUD_COUNT(BVHNodes);
+		if (node.bounds.hit(r, inv_dir, t_min, t_max)) {
+			if (node.leaf()) {
+				if (leaf(node.offset, (uint32_t)node.count, t_max))
+					hit_anything = true;
+				if (stack_size == 0)
+					break;
+				current = stack[--stack_size];
+			}
+			else if (dir_neg[node.axis]) {
+				stack[stack_size++] = current + 1;
+				current = node.offset;
+			}
+			else {
+				stack[stack_size++] = node.offset;
+				current = current + 1;
+			}
+		}
+		else {
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
+		}
+	}
+	return hit_anything;
+}
+
+template <typename LeafFn>
+void BVH::traverse_packet(RayPacket& packet, float t_min, LeafFn&& leaf) const
+{
+	if (_nodes.empty())
+		return;
+
+	// every node remembers the first ray that entered its parent, the rays before it missed an
+	// ancestor already
+	struct Entry
+	{
+		uint32_t node;
+		uint32_t first;
+	};
+
+	Entry stack[STACK_SIZE];
+	int stack_size = 0;
+	Entry current = { 0, 0 };
+	const uint32_t none = packet.size();
+
+	while (true) {
+		const Node& node = _nodes[current.node];
+		SPUD_COUNT(PacketNodes);
+		uint32_t first = none;
+		if (packet.interval_miss(node.bounds, t_min))
+			SPUD_COUNT(PacketCulled);
+		else
+			first = packet.first_hit(node.bounds, t_min, current.first);
+
+		if (first != none) {
+			if (node.leaf()) {
+				for (uint32_t g = first / RayPacket::WIDTH; g < packet.groups(); g++) {
+					unsigned mask = packet.hit_box(node.bounds, t_min, g);
+					for (; mask != 0; mask &= mask - 1) {
+						uint32_t k = g * RayPacket::WIDTH + (uint32_t)lowest_bit(mask);
+						if (k >= first)
+							leaf(node.offset, (uint32_t)node.count, k, packet.t_max(k));
+					}
+				}
+				packet.update_t_max_bound();
+				if (stack_size == 0)
+					break;
+				current = stack[--stack_size];
+			}
+			else if (packet.dir_neg(node.axis)) {
+				stack[stack_size++] = Entry{ current.node + 1, first };
+				current = Entry{ node.offset, first };
+			}
+			else {
+				stack[stack_size++] = Entry{ node.offset, first };
+				current = Entry{ current.node + 1, first };
+			}
+		}
+		else {
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
+		}
+	}
+}
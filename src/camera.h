@@ -1,6 +1,7 @@
 #pragma once
 
 #include "math_utils.h"
+#include "aabb.h"
 
 class Camera {
 public:
@@ -39,12 +40,21 @@ public:
 		_vertical = 2.0f * half_height * focus_dist  * _v;
 	}
 
-	ray getRay(float s, float t) const {
-		vector3 rd = _lens_radius * random_in_unit_disk();
-		vector3 offset = _u * rd.x() + _v * rd.y();
+	ray getRay(float s, float t, Sampler& sampler) const {
+		vector3 offset = vector3::ZERO;
+		if (_lens_radius > 0.0f) {
+			float u1, u2;
+			sampler.get_2d(u1, u2);
+			vector3 rd = _lens_radius * concentric_disk(u1, u2);
+			offset = _u * rd.x() + _v * rd.y();
+		}
 		return ray(_origin + offset, _lower_left_corner + s * _horizontal + t * _vertical - _origin - offset);
 	}
 
+	// the range of (s, t) of getRay() whose rays can pass through box, from any point of the lens.
+	// false when part of the box is not in front of the lens, the range is unbounded then
+	bool screen_bounds(const AABB& box, float& s0, float& t0, float& s1, float& t1) const;
+
 private:
 
 	vector3 _lower_left_corner;
@@ -52,5 +62,39 @@ private:
 	vector3 _vertical;
 	vector3 _origin;
 	vector3 _w, _u, _v;
-	float _lens_radius;
+	float _lens_radius = 0.0f;
 };
+
+bool Camera::screen_bounds(const AABB& box, float& s0, float& t0, float& s1, float& t1) const
+{
+	// a ray from lens point l through p meets the plane of _lower_left_corner at l + (p - l) * plane / pw.
+	// that is linear in l, so s only takes its extremes at the lens edge along _u and t along _v, and
+	// for a fixed lens point the extremes over the box are at its corners
+	float plane = dot(_lower_left_corner - _origin, _w);
+	vector3 lens[4] = { _origin + _lens_radius * _u, _origin - _lens_radius * _u,
+		_origin + _lens_radius * _v, _origin - _lens_radius * _v };
+	int lens_points = _lens_radius > 0.0f ? 4 : 1;
+	float hh = dot(_horizontal, _horizontal);
+	float vv = dot(_vertical, _vertical);
+
+	s0 = t0 = FLT_MAX;
+	s1 = t1 = -FLT_MAX;
+	for (int c = 0; c < 8; c++) {
+		vector3 p((c & 1) ? box.max().x() : box.min().x(), (c & 2) ? box.max().y() : box.min().y(),
+			(c & 4) ? box.max().z() : box.min().z());
+		float pw = dot(p - _origin, _w);
+		if (!(pw < -1e-4f))
+			return false;
+		for (int l = 0; l < lens_points; l++) {
+			vector3 origin = lens_points == 1 ? _origin : lens[l];
+			vector3 rel = origin + (p - origin) * (plane / pw) - _lower_left_corner;
+			float s = dot(rel, _horizontal) / hh;
+			float t = dot(rel, _vertical) / vv;
+			s0 = std::min(s0, s);
+			s1 = std::max(s1, s);
+			t0 = std::min(t0, t);
+			t1 = std::max(t1, t);
+		}
+	}
+	return true;
+}
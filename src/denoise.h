@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "integrator.h"
+#include "tiles.h"
+#include "threadqueue.h"
+
+struct DenoiseSettings
+{
+	int32_t	_iterations = 5;		// a-trous passes, the footprint doubles with each one
+	float	_color_sigma = 0.5f;	// irradiance difference that still blends, halves every pass
+	float	_normal_power = 64.0f;	// sharpness of the normal edge stop
+	float	_depth_sigma = 0.05f;	// depth difference relative to the distance of the nearer pixel
+	float	_albedo_sigma = 0.1f;
+};
+
+// one a-trous pass over the rows of tile, reads src and writes dst. the 5x5 B3 spline kernel is
+// spread over step pixels and every tap is weighted by how close it is to the center pixel in
+// irradiance, normal, depth and albedo, so the blur stops at geometric and texture edges
+void atrous_tile(const Tile& tile, int32_t width, int32_t height, int32_t step, float color_sigma,
+	const DenoiseSettings& settings, const FirstHit* features, const vector3* src, vector3* dst)
+{
+	static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+	const float inv_color = 1.0f / (color_sigma * color_sigma);
+	const float inv_albedo = 1.0f / (settings._albedo_sigma * settings._albedo_sigma);
+	const float inv_depth = 1.0f / settings._depth_sigma;
+
+	for (int32_t y = tile._y0; y < tile._y1; y++)
+	{
+		for (int32_t x = tile._x0; x < tile._x1; x++)
+		{
+			size_t center = (size_t)y * width + x;
+			const FirstHit& fc = features[center];
+			const vector3& cc = src[center];
+			// averaged normals are shorter than 1 along edges, compare directions only
+			float nc_len = fc._normal.length();
+			vector3 nc = nc_len > 1e-4f ? fc._normal / nc_len : vector3::ZERO;
+
+			// the center tap always counts fully, so the sum can't underflow to 0
+			vector3 sum = kernel[2] * kernel[2] * cc;
+			float weight_sum = kernel[2] * kernel[2];
+			for (int32_t ky = 0; ky < 5; ky++)
+			{
+				int32_t sy = y + (ky - 2) * step;
+				if (sy < 0 || sy >= height)
+					continue;
+				for (int32_t kx = 0; kx < 5; kx++)
+				{
+					int32_t sx = x + (kx - 2) * step;
+					if (sx < 0 || sx >= width || (kx == 2 && ky == 2))
+						continue;
+
+					size_t q = (size_t)sy * width + sx;
+					const FirstHit& fq = features[q];
+
+					vector3 dc = src[q] - cc;
+					vector3 da = fq._albedo - fc._albedo;
+					float dz = fabsf(fq._depth - fc._depth) / std::max(std::min(fq._depth, fc._depth), 1e-4f);
+					float nq_len = fq._normal.length();
+					float n = nq_len > 1e-4f ? std::max(0.0f, dot(fq._normal, nc) / nq_len) : 0.0f;
+					// misses have no normal, the depth term alone keeps them apart from surfaces
+					float wn = nc_len > 1e-4f ? powf(n, settings._normal_power) : 1.0f;
+
+					float w = kernel[kx] * kernel[ky] * wn
+						* expf(-dot(dc, dc) * inv_color - dot(da, da) * inv_albedo - dz * inv_depth);
+					sum += w * src[q];
+					weight_sum += w;
+				}
+			}
+			dst[center] = sum / weight_sum;
+		}
+	}
+}
+
+// edge aware a-trous wavelet filter (Dammertz et al. 2010) guided by the first hit features.
+// the image is divided by the albedo before filtering so texture detail survives and multiplied
+// back afterwards. every pass is spread over the pool tile by tile
+void denoise(ThreadPool& pool, int32_t width, int32_t height, const FirstHit* features,
+	const DenoiseSettings& settings, vector3* image)
+{
+	const size_t pixels = (size_t)width * height;
+	const float min_albedo = 1e-3f;
+	const int32_t tile_size = 64;
+
+	std::vector<vector3> a(pixels), b(pixels);
+	for (size_t i = 0; i < pixels; i++)
+	{
+		const vector3& albedo = features[i]._albedo;
+		a[i] = vector3(image[i].x() / std::max(albedo.x(), min_albedo),
+			image[i].y() / std::max(albedo.y(), min_albedo),
+			image[i].z() / std::max(albedo.z(), min_albedo));
+	}
+
+	// once the step reaches the larger edge of the frame every tap but the center falls outside it,
+	// further passes change nothing and the step would only head for an overflow
+	int32_t passes = 0;
+	while (passes < settings._iterations && (1 << passes) < std::max(width, height))
+		passes++;
+
+	float color_sigma = settings._color_sigma;
+	for (int32_t pass = 0; pass < passes; pass++)
+	{
+		int32_t step = 1 << pass;
+		const vector3* src = a.data();
+		vector3* dst = b.data();
+		for_each_tile(pool, width, height, tile_size, [&](const Tile& tile) {
+			atrous_tile(tile, width, height, step, color_sigma, settings, features, src, dst);
+		});
+		a.swap(b);
+		color_sigma *= 0.5f;
+	}
+
+	for (size_t i = 0; i < pixels; i++)
+	{
+		const vector3& albedo = features[i]._albedo;
+		image[i] = vector3(a[i].x() * std::max(albedo.x(), min_albedo),
+			a[i].y() * std::max(albedo.y(), min_albedo),
+			a[i].z() * std::max(albedo.z(), min_albedo));
+	}
+}
@@ -0,0 +1,465 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "net.h"
+#include "film.h"
+#include "render.h"
+#include "wavefront.h"
+#include "scene_file.h"
+#include "scenes.h"
+
+// distributed rendering. a coordinator cuts the frame into tiles and hands them to worker processes
+// that connect over TCP, every worker renders its tiles on its own thread pool and sends back the film
+// sums, which the coordinator adds to its film. pixels draw from per pixel streams, so the merged frame
+// is identical to a local render whatever the number of workers.
+//
+// the protocol is a little endian stream of raw structs:
+//   worker -> coordinator  NetHello
+//   coordinator -> worker  NetJobHeader, scene name, scene file contents
+//   coordinator -> worker  Tile, any number of them, one with _x0 < 0 ends the job
+//   worker -> coordinator  Tile, then the tile's PackedFilmPixels row by row, once per requested tile
+
+static const char NET_MAGIC[4] = { 'S', 'P', 'N', 'W' };
+static const uint32_t NET_VERSION = 2;
+// the worker sizes its buffers from the job header, these bound what it accepts
+static const uint32_t NET_MAX_NAME_LENGTH = 4096;
+static const uint32_t NET_MAX_SCENE_LENGTH = 256u << 20;
+
+struct NetHello
+{
+	char		_magic[4];
+	uint32_t	_version;
+	int32_t		_threads;
+};
+
+struct NetJobHeader
+{
+	char		_magic[4];
+	uint32_t	_version;
+	int32_t		_width;
+	int32_t		_height;
+	int32_t		_samples;
+	int32_t		_tile_size;
+	uint64_t	_seed;
+	int32_t		_max_depth;
+	int32_t		_rr_depth;
+	int32_t		_wavefront;
+	uint32_t	_sampler;	// SamplerKind
+	float		_camera[12];	// lookfrom, lookat, vup, vfov, aperture, focus distance
+	uint32_t	_name_length;
+	uint32_t	_scene_length;
+};
+
+// everything a worker needs to render tiles of the frame
+struct RenderJob
+{
+	SceneSettings	_settings;	// after the command line overrides
+	int32_t		_tile_size;		// tiles the workers split their network tiles into
+	uint64_t	_seed;
+	int32_t		_rr_depth;
+	SamplerKind	_sampler;
+	bool		_wavefront;
+	std::string	_scene;			// built in scene name or the path the scene file was read from
+	std::vector<uint8_t>	_scene_data;	// contents of the scene file, empty for built in scenes
+
+	// reads the scene file at path into _scene_data
+	bool read_scene(const char* path, std::string& error);
+};
+
+bool RenderJob::read_scene(const char* path, std::string& error)
+{
+	std::ifstream stream(path, std::ios::in | std::ios::binary);
+	if (!stream.is_open()) {
+		error = std::string("can't open ") + path;
+		return false;
+	}
+	_scene = path;
+	_scene_data.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+	if (_scene.size() > NET_MAX_NAME_LENGTH || _scene_data.size() > NET_MAX_SCENE_LENGTH) {
+		error = std::string(path) + " is too large to send to workers";
+		return false;
+	}
+	return true;
+}
+
+inline bool net_magic_ok(const char* magic)
+{
+	return memcmp(magic, NET_MAGIC, sizeof(NET_MAGIC)) == 0;
+}
+
+// serves one frame to any number of workers. tiles of a worker that disconnects or stalls go back to
+// the queue
+class RenderCoordinator
+{
+public:
+	static const int32_t DEFAULT_TILE_SIZE = 128;
+	static const int32_t TILES_IN_FLIGHT = 2;	// per worker, so it never waits for the next request
+	static const int32_t DEFAULT_WORKER_TIMEOUT = 300;	// seconds
+
+	RenderCoordinator(const RenderJob& job, int32_t tile_size = DEFAULT_TILE_SIZE);
+
+	// loopback only takes workers from this machine, enough when they are all spawned locally
+	bool listen(uint16_t port, bool loopback, std::string& error);
+	inline uint16_t port() const { return _listener.local_port(); }
+
+	// a worker that sends nothing for this long is dropped, it has to cover TILES_IN_FLIGHT tiles
+	inline void set_worker_timeout(int32_t seconds) { _worker_timeout = seconds; }
+
+	// local worker processes the frame relies on, see spawn_local_worker. once all of them have
+	// exited while tiles are left and no other worker is connected, run() gives up on the frame
+	void add_local_worker();
+	void local_worker_exited();
+
+	// accepts workers until every tile is back in film. on_tile is called from the connection
+	// threads once a tile was added. false when the frame can't be finished
+	bool run(Film& film, const std::function<void(const Tile&)>& on_tile, std::string& error);
+
+private:
+	void serve(Socket socket, Film& film, const std::function<void(const Tile&)>& on_tile);
+	bool send_job(Socket& socket);
+
+	// pops a pending tile. with wait it blocks until one is available, false means the frame is done
+	bool take(Tile& tile, bool wait);
+	void give_back(const std::deque<Tile>& tiles);
+	void finish();
+
+	const RenderJob& _job;
+	Socket _listener;
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::deque<Tile> _pending;
+	int32_t _remaining;		// tiles not yet added to the film, guarded by _mutex
+	int32_t _connected = 0;		// connections being served, guarded by _mutex
+	int32_t _local_workers = 0;	// guarded by _mutex like the count of those that exited
+	int32_t _local_exited = 0;
+	int32_t _worker_timeout = DEFAULT_WORKER_TIMEOUT;
+};
+
+RenderCoordinator::RenderCoordinator(const RenderJob& job, int32_t tile_size)
+	: _job(job)
+{
+	TileScheduler tiles(job._settings._width, job._settings._height, tile_size);
+	for (int32_t i = 0; i < tiles.tile_count(); i++)
+		_pending.push_back(tiles.tile(i));
+	_remaining = tiles.tile_count();
+}
+
+bool RenderCoordinator::listen(uint16_t port, bool loopback, std::string& error)
+{
+	return _listener.listen(port, loopback, error);
+}
+
+void RenderCoordinator::add_local_worker()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_local_workers++;
+}
+
+void RenderCoordinator::local_worker_exited()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_local_exited++;
+}
+
+bool RenderCoordinator::run(Film& film, const std::function<void(const Tile&)>& on_tile, std::string& error)
+{
+	std::vector<std::thread> connections;
+	bool finished = true;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (_remaining == 0)
+				break;
+			// a serve thread is only counted once it runs, but a worker process that exited has no
+			// connection left to accept either
+			if (_local_workers > 0 && _local_exited == _local_workers && _connected == 0) {
+				error = "every local worker exited with " + std::to_string(_remaining) + " tile(s) left";
+				finished = false;
+				break;
+			}
+		}
+		// polled so the loop notices when the frame is done
+		if (!_listener.wait_readable(100))
+			continue;
+		Socket socket = _listener.accept();
+		if (socket.valid()) {
+			std::unique_lock<std::mutex> lock(_mutex);
+			_connected++;
+			connections.emplace_back(&RenderCoordinator::serve, this, std::move(socket), std::ref(film), std::cref(on_tile));
+		}
+	}
+	for (std::thread& t : connections)
+		t.join();
+	return finished;
+}
+
+bool RenderCoordinator::send_job(Socket& socket)
+{
+	const SceneSettings& s = _job._settings;
+	NetJobHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header._magic, NET_MAGIC, sizeof(NET_MAGIC));
+	header._version = NET_VERSION;
+	header._width = s._width;
+	header._height = s._height;
+	header._samples = s._samples;
+	header._tile_size = _job._tile_size;
+	header._seed = _job._seed;
+	header._max_depth = s._max_depth;
+	header._rr_depth = _job._rr_depth;
+	header._wavefront = _job._wavefront ? 1 : 0;
+	header._sampler = (uint32_t)_job._sampler;
+	const vector3* v[3] = { &s._lookfrom, &s._lookat, &s._vup };
+	for (int i = 0; i < 3; i++) {
+		header._camera[3 * i] = v[i]->x();
+		header._camera[3 * i + 1] = v[i]->y();
+		header._camera[3 * i + 2] = v[i]->z();
+	}
+	header._camera[9] = s._vfov;
+	header._camera[10] = s._aperture;
+	header._camera[11] = s._focus_dist;
+	header._name_length = (uint32_t)_job._scene.size();
+	header._scene_length = (uint32_t)_job._scene_data.size();
+
+	return socket.send_all(&header, sizeof(header))
+		&& socket.send_all(_job._scene.data(), _job._scene.size())
+		&& socket.send_all(_job._scene_data.data(), _job._scene_data.size());
+}
+
+void RenderCoordinator::serve(Socket socket, Film& film, const std::function<void(const Tile&)>& on_tile)
+{
+	// the count drops on every way out, after the tiles were given back
+	struct Disconnect {
+		RenderCoordinator* _coordinator;
+		~Disconnect() {
+			std::unique_lock<std::mutex> lock(_coordinator->_mutex);
+			_coordinator->_connected--;
+		}
+	} disconnect = { this };
+	socket.set_receive_timeout(_worker_timeout);
+
+	NetHello hello;
+	if (!socket.recv_all(&hello, sizeof(hello)) || !net_magic_ok(hello._magic) || hello._version != NET_VERSION) {
+		std::cerr << "Ignoring a connection that isn't a worker of this version\n";
+		return;
+	}
+	if (!send_job(socket)) {
+		std::cerr << "Lost a worker before it got the job\n";
+		return;
+	}
+
+	std::deque<Tile> in_flight;
+	std::vector<PackedFilmPixel> pixels;
+	for (;;)
+	{
+		// keep the worker's queue topped up, only wait for new tiles when it has nothing to do
+		Tile tile;
+		while ((int32_t)in_flight.size() < TILES_IN_FLIGHT && take(tile, in_flight.empty())) {
+			if (!socket.send_all(&tile, sizeof(tile))) {
+				in_flight.push_back(tile);
+				give_back(in_flight);
+				std::cerr << "Lost a worker, its tiles go back to the queue\n";
+				return;
+			}
+			in_flight.push_back(tile);
+		}
+		if (in_flight.empty())
+			break;
+
+		const Tile expected = in_flight.front();
+		Tile returned;
+		pixels.resize((size_t)(expected._x1 - expected._x0) * (expected._y1 - expected._y0));
+		if (!socket.recv_all(&returned, sizeof(returned)) || memcmp(&returned, &expected, sizeof(Tile)) != 0
+			|| !socket.recv_all(pixels.data(), pixels.size() * sizeof(PackedFilmPixel))) {
+			give_back(in_flight);
+			std::cerr << "Lost a worker, its tiles go back to the queue\n";
+			return;
+		}
+
+		const PackedFilmPixel* p = pixels.data();
+		for (int32_t y = expected._y0; y < expected._y1; y++)
+			for (int32_t x = expected._x0; x < expected._x1; x++, p++)
+				film.add(x, y, vector3(p->_sum[0], p->_sum[1], p->_sum[2]), p->_lum_sum, p->_lum_sq_sum, p->_samples);
+		in_flight.pop_front();
+		if (on_tile)
+			on_tile(expected);
+		finish();
+	}
+
+	Tile end = { -1, -1, -1, -1 };
+	socket.send_all(&end, sizeof(end));
+}
+
+bool RenderCoordinator::take(Tile& tile, bool wait)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (wait)
+		_changed.wait(lock, [this]() { return !_pending.empty() || _remaining == 0; });
+	if (_pending.empty())
+		return false;
+	tile = _pending.front();
+	_pending.pop_front();
+	return true;
+}
+
+void RenderCoordinator::give_back(const std::deque<Tile>& tiles)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_pending.insert(_pending.end(), tiles.begin(), tiles.end());
+	_changed.notify_all();
+}
+
+void RenderCoordinator::finish()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (--_remaining == 0)
+		_changed.notify_all();
+}
+
+// connects to the coordinator at host:port and renders tiles for it on pool until the job is done.
+// the coordinator may start after the worker, connecting is retried for retry_seconds
+bool run_worker(ThreadPool& pool, const char* host, uint16_t port, double retry_seconds, std::string& error)
+{
+	Socket socket;
+	auto start = std::chrono::steady_clock::now();
+	while (!socket.connect(host, port, error)) {
+		std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+		if (waited.count() >= retry_seconds)
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	NetHello hello;
+	memcpy(hello._magic, NET_MAGIC, sizeof(NET_MAGIC));
+	hello._version = NET_VERSION;
+	hello._threads = pool.size();
+	NetJobHeader header;
+	if (!socket.send_all(&hello, sizeof(hello)) || !socket.recv_all(&header, sizeof(header))) {
+		error = "the coordinator closed the connection";
+		return false;
+	}
+	if (!net_magic_ok(header._magic) || header._version != NET_VERSION) {
+		error = "the coordinator speaks another protocol version";
+		return false;
+	}
+	SceneSettings settings;
+	settings._width = header._width;
+	settings._height = header._height;
+	settings._samples = header._samples;
+	settings._max_depth = header._max_depth;
+	if (!check_settings(settings, error)) {
+		error = "the job has bad render settings: " + error;
+		return false;
+	}
+	if (header._tile_size <= 0 || header._sampler >= (uint32_t)SamplerKind::Count) {
+		error = "the job has bad render settings";
+		return false;
+	}
+	if (header._name_length > NET_MAX_NAME_LENGTH || header._scene_length > NET_MAX_SCENE_LENGTH) {
+		error = "the job's scene is too large";
+		return false;
+	}
+
+	std::string name(header._name_length, '\0');
+	std::vector<uint8_t> scene_data(header._scene_length);
+	if (!socket.recv_all(&name[0], name.size()) || !socket.recv_all(scene_data.data(), scene_data.size())) {
+		error = "the coordinator closed the connection";
+		return false;
+	}
+
+	// the scene file is rebuilt from the received copy, built in scenes from their name and the seed
+	World world;
+	SceneSettings ignored;
+	SceneFile file;
+	if (scene_data.empty()) {
+		Rng scene_rng(header._seed);
+		if (!build_builtin_scene(name, world, scene_rng, ignored)) {
+			error = "unknown scene " + name;
+			return false;
+		}
+	}
+	else {
+		if (!file.parse(scene_data.data(), scene_data.size(), error))
+			return false;
+		file.build_world(world);
+	}
+	world.build();
+
+	const float* c = header._camera;
+	Camera cam(vector3(c[0], c[1], c[2]), vector3(c[3], c[4], c[5]), vector3(c[6], c[7], c[8]), c[9],
+		(float)header._width / (float)header._height, c[10], c[11]);
+	SceneInfo scene = { header._width, header._height, header._samples, header._tile_size, header._seed,
+		header._max_depth, header._rr_depth, (SamplerKind)header._sampler, RayPacket::MAX_EDGE, &cam, &world };
+	std::cout << "Rendering " << name << " for " << host << ":" << port << " on " << pool.size() << " thread(s)\n";
+
+	Film film(header._width, header._height, header._tile_size);
+	std::vector<PackedFilmPixel> pixels;
+	int32_t tiles = 0;
+	for (;;)
+	{
+		Tile tile;
+		if (!socket.recv_all(&tile, sizeof(tile))) {
+			error = "the coordinator closed the connection";
+			return false;
+		}
+		if (tile._x0 < 0)
+			break;
+		if (tile._x0 >= tile._x1 || tile._y0 >= tile._y1 || tile._x1 > header._width || tile._y1 > header._height) {
+			error = "the coordinator sent a tile outside the frame";
+			return false;
+		}
+
+		// a tile is only ever rendered once per worker, but start from zero anyway
+		for (int32_t y = tile._y0; y < tile._y1; y++)
+			for (int32_t x = tile._x0; x < tile._x1; x++)
+				film.pixel(x, y) = FilmPixel{ vector3::ZERO, 0.0f, 0.0f, 0 };
+		if (header._wavefront)
+			wavefront_process(pool, scene, tile, film);
+		else
+			thread_process(pool, scene, tile, film);
+
+		pixels.clear();
+		for (int32_t y = tile._y0; y < tile._y1; y++)
+			for (int32_t x = tile._x0; x < tile._x1; x++)
+				pixels.push_back(pack(film.pixel(x, y)));
+		if (!socket.send_all(&tile, sizeof(tile)) || !socket.send_all(pixels.data(), pixels.size() * sizeof(PackedFilmPixel))) {
+			error = "the coordinator closed the connection";
+			return false;
+		}
+		tiles++;
+	}
+	std::cout << "Rendered " << tiles << " tile(s)\n";
+	return true;
+}
+
+// starts a worker process of this executable on the local machine, the thread calls on_exit and
+// returns when it exits
+std::thread spawn_local_worker(const char* executable, uint16_t port, int32_t threads, const std::function<void()>& on_exit)
+{
+	std::string command = std::string("\"") + executable + "\" --worker 127.0.0.1:" + std::to_string(port)
+		+ " --threads " + std::to_string(threads);
+#if defined(_WIN32)
+	// cmd strips the outer quotes of the whole line, keep the ones around the executable
+	command = "\"" + command + "\"";
+#endif
+	return std::thread([command, on_exit]() {
+		if (system(command.c_str()) != 0)
+			std::cerr << "Local worker exited with an error\n";
+		if (on_exit)
+			on_exit();
+	});
+}
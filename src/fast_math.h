@@ -0,0 +1,72 @@
+#pragma once
+
+#include <math.h>
+
+#include "simd.h"
+
+// precision of the shading math, picked at compile time. by default everything is IEEE exact:
+// libm square roots and real divisions. define SPUD_FAST_MATH to swap in the hardware reciprocal
+// and reciprocal square root estimates, refined by one newton step to about 22 of the 24 mantissa
+// bits, and fused multiply adds in the vector3 products where the CPU has FMA.
+// bench --save-images / --compare measures what that does to the images
+#if defined(SPUD_FAST_MATH) && (defined(__FMA__) || defined(__AVX2__))
+#define SPUD_FMA 1
+#endif
+
+inline const char* math_precision_name()
+{
+#if defined(SPUD_FAST_MATH) && defined(SPUD_FMA)
+	return "fast+fma";
+#elif defined(SPUD_FAST_MATH)
+	return "fast";
+#else
+	return "exact";
+#endif
+}
+
+inline float math_rsqrt(float x)
+{
+#if defined(SPUD_FAST_MATH) && defined(SPUD_SIMD_SSE)
+	float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+	return y * (1.5f - 0.5f * x * y * y);
+#else
+	return 1.0f / sqrtf(x);
+#endif
+}
+
+inline float math_rcp(float x)
+{
+#if defined(SPUD_FAST_MATH) && defined(SPUD_SIMD_SSE)
+	float y = _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss(x)));
+	return y * (2.0f - x * y);
+#else
+	return 1.0f / x;
+#endif
+}
+
+inline float math_sqrt(float x)
+{
+#if defined(SPUD_FAST_MATH) && defined(SPUD_SIMD_SSE)
+	// the estimate of 1 / sqrt(0) is infinite, 0 has to stay 0
+	return x > 0.0f ? x * math_rsqrt(x) : 0.0f;
+#else
+	return sqrtf(x);
+#endif
+}
+
+// a * b + c, rounded once where there is an FMA unit
+inline float math_fma(float a, float b, float c)
+{
+#if defined(SPUD_FMA)
+	return fmaf(a, b, c);
+#else
+	return a * b + c;
+#endif
+}
+
+// x^5 in three multiplies, the schlick term without a call to pow
+inline float pow5(float x)
+{
+	float x2 = x * x;
+	return x2 * x2 * x;
+}
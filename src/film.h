@@ -0,0 +1,289 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include "vector3.h"
+#include "sampler.h"
+#include "tiles.h"
+
+// running sums of one pixel, enough for the mean color and the variance of its luminance
+struct FilmPixel
+{
+	vector3		_sum;
+	float		_lum_sum;
+	float		_lum_sq_sum;
+	uint32_t	_samples;
+};
+
+// FilmPixel as it goes to checkpoints and over the network: plain floats, so the bytes don't
+// depend on how vector3 is laid out in memory
+struct PackedFilmPixel
+{
+	float		_sum[3];
+	float		_lum_sum;
+	float		_lum_sq_sum;
+	uint32_t	_samples;
+};
+
+inline PackedFilmPixel pack(const FilmPixel& p)
+{
+	return PackedFilmPixel{ { p._sum.x(), p._sum.y(), p._sum.z() }, p._lum_sum, p._lum_sq_sum, p._samples };
+}
+
+inline FilmPixel unpack(const PackedFilmPixel& p)
+{
+	return FilmPixel{ vector3(p._sum[0], p._sum[1], p._sum[2]), p._lum_sum, p._lum_sq_sum, p._samples };
+}
+
+inline float luminance(const vector3& c)
+{
+	return 0.2126f * c.r() + 0.7152f * c.g() + 0.0722f * c.b();
+}
+
+static const char FILM_CHECKPOINT_MAGIC[4] = { 'S', 'P', 'F', 'M' };
+static const uint32_t FILM_CHECKPOINT_VERSION = 2;
+
+struct FilmCheckpointHeader
+{
+	char		_magic[4];
+	uint32_t	_version;
+	int32_t		_width;
+	int32_t		_height;
+	int32_t		_passes;
+	int32_t		_pass_samples;
+	uint64_t	_seed;
+	uint32_t	_sampler;	// SamplerKind
+};
+
+// accumulation buffer of a render. it keeps linear radiance sums and sample counts rather than
+// finished colors, so passes can be added on top of each other and a render can be checkpointed and
+// resumed. turning the sums into an image (resolve) and tonemapping it (image_io) are separate steps.
+// pixels are stored tile by tile with every tile starting on its own cache line, workers rendering
+// neighbouring tiles never write to the same line
+class Film
+{
+public:
+	static const size_t CACHE_LINE = 64;
+
+	Film() = default;
+	Film(int32_t width, int32_t height, int32_t tile_size) { reset(width, height, tile_size); }
+	Film(const Film&) = delete;
+	Film& operator=(const Film&) = delete;
+
+	void reset(int32_t width, int32_t height, int32_t tile_size);
+
+	// zeroes every pixel and the pass count
+	void clear();
+
+	inline int32_t width() const { return _width; }
+	inline int32_t height() const { return _height; }
+	inline int32_t tile_size() const { return _tile_size; }
+
+	// completed progressive passes, stored in checkpoints so a resumed render picks up where it stopped
+	inline int32_t passes() const { return _passes; }
+	inline void set_passes(int32_t passes) { _passes = passes; }
+
+	inline FilmPixel& pixel(int32_t x, int32_t y) {
+		return *reinterpret_cast<FilmPixel*>(_pixels + offset(x, y));
+	}
+
+	inline const FilmPixel& pixel(int32_t x, int32_t y) const {
+		return *reinterpret_cast<const FilmPixel*>(_pixels + offset(x, y));
+	}
+
+	inline void add(int32_t x, int32_t y, const vector3& sum, float lum_sum, float lum_sq_sum, uint32_t samples) {
+		FilmPixel& p = pixel(x, y);
+		p._sum += sum;
+		p._lum_sum += lum_sum;
+		p._lum_sq_sum += lum_sq_sum;
+		p._samples += samples;
+	}
+
+	inline vector3 mean(int32_t x, int32_t y) const {
+		const FilmPixel& p = pixel(x, y);
+		return p._samples > 0 ? p._sum / (float)p._samples : vector3::ZERO;
+	}
+
+	// mean linear radiance of the pixels in tile, written to a width * height row major frame
+	void resolve_tile(const Tile& tile, vector3* output) const;
+	void resolve(vector3* output) const;
+
+	// the seed, samples per pass and sampler are stored next to the sums, a resumed render has to use the same
+	bool save(const char* path, uint64_t seed, int32_t pass_samples, SamplerKind sampler, std::string& error) const;
+	// replaces size, pass count and sums with the checkpoint's, the tile size stays as it is
+	bool load(const char* path, uint64_t& seed, int32_t& pass_samples, SamplerKind& sampler, std::string& error);
+
+private:
+	inline size_t offset(int32_t x, int32_t y) const {
+		int32_t tx = x / _tile_size;
+		int32_t ty = y / _tile_size;
+		size_t tile = (size_t)ty * _tiles_x + tx;
+		size_t local = (size_t)(y - ty * _tile_size) * _tile_size + (x - tx * _tile_size);
+		return tile * _tile_bytes + local * sizeof(FilmPixel);
+	}
+
+	int32_t _width = 0;
+	int32_t _height = 0;
+	int32_t _tile_size = 1;
+	int32_t _tiles_x = 0;
+	int32_t _tiles_y = 0;
+	int32_t _passes = 0;
+	size_t _tile_bytes = 0;		// a full tile rounded up to whole cache lines
+	std::unique_ptr<uint8_t[]> _storage;
+	uint8_t* _pixels = nullptr;	// _storage aligned to CACHE_LINE
+};
+
+void Film::reset(int32_t width, int32_t height, int32_t tile_size)
+{
+	_width = width;
+	_height = height;
+	_tile_size = std::max(1, tile_size);
+	_tiles_x = (_width + _tile_size - 1) / _tile_size;
+	_tiles_y = (_height + _tile_size - 1) / _tile_size;
+	_tile_bytes = ((size_t)_tile_size * _tile_size * sizeof(FilmPixel) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+	size_t bytes = _tile_bytes * _tiles_x * _tiles_y;
+	_storage.reset(new uint8_t[bytes + CACHE_LINE]);
+	_pixels = reinterpret_cast<uint8_t*>(((uintptr_t)_storage.get() + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+	clear();
+}
+
+void Film::clear()
+{
+	memset(_pixels, 0, _tile_bytes * _tiles_x * _tiles_y);
+	_passes = 0;
+}
+
+void Film::resolve_tile(const Tile& tile, vector3* output) const
+{
+	for (int32_t y = tile._y0; y < tile._y1; y++)
+	{
+		vector3* row = output + (size_t)y * _width;
+		for (int32_t x = tile._x0; x < tile._x1; x++)
+			row[x] = mean(x, y);
+	}
+}
+
+void Film::resolve(vector3* output) const
+{
+	resolve_tile(Tile{ 0, 0, _width, _height }, output);
+}
+
+bool Film::save(const char* path, uint64_t seed, int32_t pass_samples, SamplerKind sampler, std::string& error) const
+{
+	FilmCheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header._magic, FILM_CHECKPOINT_MAGIC, sizeof(FILM_CHECKPOINT_MAGIC));
+	header._version = FILM_CHECKPOINT_VERSION;
+	header._width = _width;
+	header._height = _height;
+	header._passes = _passes;
+	header._pass_samples = pass_samples;
+	header._seed = seed;
+	header._sampler = (uint32_t)sampler;
+
+	// written next to the old checkpoint and renamed over it, so being killed mid write leaves the
+	// previous checkpoint intact. rename replaces the target atomically on posix, windows needs
+	// MoveFileEx for that
+	std::string temp = std::string(path) + ".tmp";
+	{
+		std::ofstream stream(temp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!stream.is_open()) {
+			error = "can't write " + temp;
+			return false;
+		}
+		stream.write((const char*)&header, sizeof(header));
+		// row major on disk, independent of the tile size
+		std::vector<PackedFilmPixel> row(_width);
+		for (int32_t y = 0; y < _height; y++) {
+			for (int32_t x = 0; x < _width; x++)
+				row[x] = pack(pixel(x, y));
+			stream.write((const char*)row.data(), row.size() * sizeof(PackedFilmPixel));
+		}
+		if (!stream.good()) {
+			error = "can't write " + temp;
+			return false;
+		}
+	}
+#if defined(_WIN32)
+	if (!MoveFileExA(temp.c_str(), path, MOVEFILE_REPLACE_EXISTING)) {
+#else
+	if (rename(temp.c_str(), path) != 0) {
+#endif
+		error = std::string("can't replace ") + path;
+		return false;
+	}
+	return true;
+}
+
+bool Film::load(const char* path, uint64_t& seed, int32_t& pass_samples, SamplerKind& sampler, std::string& error)
+{
+	std::ifstream stream(path, std::ios::in | std::ios::binary);
+	if (!stream.is_open()) {
+		error = std::string("can't open ") + path;
+		return false;
+	}
+
+	FilmCheckpointHeader header;
+	stream.read((char*)&header, sizeof(header));
+	if (!stream.good() || memcmp(header._magic, FILM_CHECKPOINT_MAGIC, sizeof(FILM_CHECKPOINT_MAGIC)) != 0) {
+		error = std::string(path) + " is not a film checkpoint";
+		return false;
+	}
+	if (header._version != FILM_CHECKPOINT_VERSION) {
+		error = std::string(path) + " has unsupported version " + std::to_string(header._version);
+		return false;
+	}
+	if (header._width <= 0 || header._height <= 0) {
+		error = std::string(path) + " has a bad resolution";
+		return false;
+	}
+	if (header._passes < 0 || header._pass_samples <= 0) {
+		error = std::string(path) + " has a bad sample count";
+		return false;
+	}
+	if (header._sampler >= (uint32_t)SamplerKind::Count) {
+		error = std::string(path) + " has an unknown sampler";
+		return false;
+	}
+	// the pixels have to be in the file before the film is sized for them, so a corrupt header
+	// can't ask for an absurd allocation
+	std::streamoff start = stream.tellg();
+	stream.seekg(0, std::ios::end);
+	uint64_t available = (uint64_t)(stream.tellg() - start);
+	stream.seekg(start);
+	if ((uint64_t)header._width * (uint64_t)header._height * sizeof(PackedFilmPixel) > available) {
+		error = std::string(path) + " is truncated";
+		return false;
+	}
+
+	reset(header._width, header._height, _tile_size);
+	std::vector<PackedFilmPixel> row(_width);
+	for (int32_t y = 0; y < _height; y++) {
+		stream.read((char*)row.data(), row.size() * sizeof(PackedFilmPixel));
+		if (!stream.good()) {
+			error = std::string(path) + " is truncated";
+			return false;
+		}
+		for (int32_t x = 0; x < _width; x++)
+			pixel(x, y) = unpack(row[x]);
+	}
+	_passes = header._passes;
+	seed = header._seed;
+	pass_samples = header._pass_samples;
+	sampler = (SamplerKind)header._sampler;
+	return true;
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "vector3.h"
+#include "tiles.h"
+#include "simd.h"
+
+// output formats, all binary so every pixel has a fixed size and tiles can be written in place
+//  PPM   - P6, 8 bit per channel, gamma 2
+//  PPM16 - P6 with maxval 65535, 16 bit big endian per channel, gamma 2
+//  PFM   - 32 bit float per channel, linear radiance, rows stored bottom to top
+enum class ImageFormat
+{
+	PPM,
+	PPM16,
+	PFM,
+};
+
+bool image_format_from_name(const char* name, ImageFormat& format)
+{
+	if (strcmp(name, "ppm") == 0)
+		format = ImageFormat::PPM;
+	else if (strcmp(name, "ppm16") == 0)
+		format = ImageFormat::PPM16;
+	else if (strcmp(name, "pfm") == 0)
+		format = ImageFormat::PFM;
+	else
+		return false;
+	return true;
+}
+
+ImageFormat image_format_from_path(const char* path)
+{
+	size_t len = strlen(path);
+	if (len >= 4 && strcmp(path + len - 4, ".pfm") == 0)
+		return ImageFormat::PFM;
+	return ImageFormat::PPM;
+}
+
+inline size_t image_bytes_per_pixel(ImageFormat format)
+{
+	switch (format) {
+	case ImageFormat::PPM: return 3;
+	case ImageFormat::PPM16: return 6;
+	default: return 12;
+	}
+}
+
+std::string image_header(ImageFormat format, int32_t width, int32_t height)
+{
+	switch (format) {
+	case ImageFormat::PPM:
+		return "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+	case ImageFormat::PPM16:
+		return "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n65535\n";
+	default:
+		// negative scale marks little endian data
+		return "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+	}
+}
+
+// gamma 2 encodes, clamps to [0, 1] and quantizes count floats, NaNs end up as 0
+void encode_8bit(const float* src, size_t count, uint8_t* dst)
+{
+	size_t i = 0;
+#if defined(SPUD_SIMD_SSE)
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(255.99f);
+	for (; i + 16 <= count; i += 16) {
+		__m128i q[4];
+		for (int k = 0; k < 4; k++) {
+			// max(NaN, 0) returns 0, so NaNs are flushed before the sqrt
+			__m128 v = _mm_max_ps(_mm_loadu_ps(src + i + 4 * k), zero);
+			v = _mm_min_ps(_mm_sqrt_ps(v), one);
+			q[k] = _mm_cvttps_epi32(_mm_mul_ps(v, scale));
+		}
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+		_mm_storeu_si128((__m128i*)(dst + i), packed);
+	}
+#endif
+	for (; i < count; i++) {
+		float v = src[i] > 0.0f ? sqrtf(src[i]) : 0.0f;
+		v = v < 1.0f ? v : 1.0f;
+		dst[i] = (uint8_t)(255.99f * v);
+	}
+}
+
+void encode_16bit(const float* src, size_t count, uint8_t* dst)
+{
+	for (size_t i = 0; i < count; i++) {
+		float v = src[i] > 0.0f ? sqrtf(src[i]) : 0.0f;
+		v = v < 1.0f ? v : 1.0f;
+		uint16_t q = (uint16_t)(65535.0f * v + 0.5f);
+		dst[2 * i] = (uint8_t)(q >> 8);
+		dst[2 * i + 1] = (uint8_t)(q & 0xff);
+	}
+}
+
+// converts a run of linear pixels to the on disk representation of the format
+void encode_pixels(ImageFormat format, const vector3* src, size_t count, uint8_t* dst)
+{
+	const float* f = reinterpret_cast<const float*>(src);
+	std::vector<float> packed;
+	if (sizeof(vector3) != 3 * sizeof(float)) {
+		// the SSE vector3 is padded to 4 floats, the files hold 3
+		packed.resize(count * 3);
+		for (size_t i = 0; i < count; i++) {
+			packed[3 * i] = src[i].x();
+			packed[3 * i + 1] = src[i].y();
+			packed[3 * i + 2] = src[i].z();
+		}
+		f = packed.data();
+	}
+	switch (format) {
+	case ImageFormat::PPM:
+		encode_8bit(f, count * 3, dst);
+		break;
+	case ImageFormat::PPM16:
+		encode_16bit(f, count * 3, dst);
+		break;
+	default:
+		memcpy(dst, f, count * 3 * sizeof(float));
+		break;
+	}
+}
+
+// file row of image row y, PFM stores the bottom row first
+inline int32_t image_file_row(ImageFormat format, int32_t y, int32_t height)
+{
+	return format == ImageFormat::PFM ? height - 1 - y : y;
+}
+
+// encodes the whole frame (rows top to bottom, linear radiance) and writes it with a single call
+bool write_image(const char* filename, ImageFormat format, int32_t width, int32_t height, const vector3* data)
+{
+	std::string header = image_header(format, width, height);
+	size_t row_bytes = width * image_bytes_per_pixel(format);
+
+	std::vector<uint8_t> buffer(header.size() + row_bytes * height);
+	memcpy(buffer.data(), header.data(), header.size());
+	uint8_t* pixels = buffer.data() + header.size();
+	for (int32_t y = 0; y < height; y++)
+		encode_pixels(format, data + (size_t)y * width, width, pixels + row_bytes * image_file_row(format, y, height));
+
+	std::ofstream stream(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!stream.is_open())
+		return false;
+	stream.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+	return stream.good();
+}
+
+// reads a PFM as write_image writes them (3 channels, little endian) into data, rows top to bottom
+bool read_pfm(const char* filename, int32_t& width, int32_t& height, std::vector<vector3>& data, std::string& error)
+{
+	std::ifstream stream(filename, std::ios::in | std::ios::binary);
+	if (!stream.is_open()) {
+		error = std::string("can't open ") + filename;
+		return false;
+	}
+	std::string magic;
+	float scale = 0.0f;
+	stream >> magic >> width >> height >> scale;
+	stream.get();	// the single whitespace before the data
+	if (!stream.good() || magic != "PF" || width <= 0 || height <= 0) {
+		error = std::string(filename) + " is not a color PFM";
+		return false;
+	}
+	if (scale >= 0.0f) {
+		error = std::string(filename) + " is big endian";
+		return false;
+	}
+
+	data.resize((size_t)width * height);
+	std::vector<float> row(3 * (size_t)width);
+	for (int32_t y = 0; y < height; y++) {
+		stream.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float));
+		if (!stream.good()) {
+			error = std::string(filename) + " is truncated";
+			return false;
+		}
+		vector3* dst = data.data() + (size_t)image_file_row(ImageFormat::PFM, y, height) * width;
+		for (int32_t x = 0; x < width; x++)
+			dst[x] = vector3(row[3 * x], row[3 * x + 1], row[3 * x + 2]);
+	}
+	return true;
+}
+
+// writes finished tiles straight into their place in the output file while the rest of
+// the frame is still rendering. safe to call from several workers at once
+class TileImageWriter
+{
+public:
+	TileImageWriter() = default;
+	TileImageWriter(const TileImageWriter&) = delete;
+	TileImageWriter& operator=(const TileImageWriter&) = delete;
+
+	bool open(const char* filename, ImageFormat format, int32_t width, int32_t height) {
+		_format = format;
+		_width = width;
+		_height = height;
+		_stream.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!_stream.is_open())
+			return false;
+
+		std::string header = image_header(format, width, height);
+		_data_offset = header.size();
+		_row_bytes = width * image_bytes_per_pixel(format);
+		_stream.write(header.data(), header.size());
+
+		// size the file up front so tiles can land anywhere in it
+		size_t total = _data_offset + _row_bytes * height;
+		_stream.seekp(total - 1);
+		_stream.put('\0');
+		return _stream.good();
+	}
+
+	// frame is the full frame buffer, only the pixels inside the tile are read
+	bool write_tile(const Tile& tile, const vector3* frame) {
+		int32_t tile_width = tile._x1 - tile._x0;
+		size_t bpp = image_bytes_per_pixel(_format);
+		std::vector<uint8_t> row(tile_width * bpp);
+
+		for (int32_t y = tile._y0; y < tile._y1; y++) {
+			encode_pixels(_format, frame + (size_t)y * _width + tile._x0, tile_width, row.data());
+			size_t offset = _data_offset + _row_bytes * image_file_row(_format, y, _height) + tile._x0 * bpp;
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_stream.seekp(offset);
+			_stream.write(reinterpret_cast<const char*>(row.data()), row.size());
+			// the other workers write through the same stream, its state is only read under the lock
+			if (!_stream.good())
+				return false;
+		}
+		return true;
+	}
+
+	bool close() {
+		_stream.close();
+		return !_stream.fail();
+	}
+
+private:
+	std::fstream _stream;
+	std::mutex _mutex;
+	ImageFormat _format = ImageFormat::PPM;
+	int32_t _width = 0;
+	int32_t _height = 0;
+	size_t _data_offset = 0;
+	size_t _row_bytes = 0;
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <stdint.h>
+#include <cfloat>
+#include <algorithm>
+#include <atomic>
+
+#include "objects.h"
+#include "camera.h"
+
+struct SceneInfo
+{
+	int32_t	_width; 
+	int32_t	_height;
+	int32_t	_samples; 
+	int32_t	_tile_size;
+	uint64_t	_seed;
+	int32_t	_max_depth;	// bounces before a path is cut off
+	int32_t	_rr_depth;	// bounces before russian roulette kicks in, >= _max_depth disables it
+	SamplerKind	_sampler;
+	int32_t	_packet_size;	// camera rays are traced in packets of this many pixels squared, 0 traces them one by one
+	const Camera*	_camera; 
+	const World*	_world;
+};
+
+// rays traced by the calling thread, counted thread locally so the bounce loop never writes shared
+// memory. the tile loops move it into ray_total() with flush_ray_count() once per tile
+inline uint64_t& thread_ray_count()
+{
+	static thread_local uint64_t count = 0;
+	return count;
+}
+
+inline std::atomic<uint64_t>& ray_total()
+{
+	static std::atomic<uint64_t> total(0);
+	return total;
+}
+
+inline void flush_ray_count()
+{
+	ray_total().fetch_add(thread_ray_count(), std::memory_order_relaxed);
+	thread_ray_count() = 0;
+}
+
+// background gradient every escaping path picks up
+inline vector3 sky_color(const vector3& direction)
+{
+	vector3 unit_direction = unit_vector(direction);
+	float t = 0.5f * (unit_direction.y() + 1.0f);
+	return (1.0f - t) * vector3::ONE + t * vector3(0.5f, 0.7f, 1.0f);
+}
+
+// what the camera ray of a sample saw first, the guide for the denoiser. averaged over the samples
+// of a pixel, so edges come out blended like the color
+struct FirstHit
+{
+	static constexpr float MISS_DEPTH = 1e30f;	// large but still finite when summed over many samples
+
+	vector3	_albedo;
+	vector3	_normal;
+	float	_depth;		// distance from the camera
+
+	static FirstHit miss(const vector3& direction) {
+		return FirstHit{ sky_color(direction), vector3::ZERO, MISS_DEPTH };
+	}
+
+	inline void add(const FirstHit& other) {
+		_albedo += other._albedo;
+		_normal += other._normal;
+		_depth += other._depth;
+	}
+
+	inline void scale(float s) {
+		_albedo *= s;
+		_normal *= s;
+		_depth *= s;
+	}
+};
+
+// the materials and objects (HitRecord::object) the paths of a pixel hit, as two bloom filters of
+// BITS bits. a pixel whose footprint doesn't have an edited material or a moved object in it traces
+// exactly what it did before the edit, see RenderSession
+struct PathFootprint
+{
+	static const uint32_t BITS = 256;
+	static const uint32_t WORDS = BITS / 64;
+
+	uint64_t	_materials[WORDS];
+	uint64_t	_objects[WORDS];
+
+	inline void clear() {
+		std::fill(_materials, _materials + WORDS, 0ull);
+		std::fill(_objects, _objects + WORDS, 0ull);
+	}
+
+	inline void add(const HitRecord& rec) {
+		set(_materials, rec.mat_id._value);
+		set(_objects, rec.object);
+	}
+
+	inline bool has_material(MaterialHandle h) const { return test(_materials, h._value); }
+	inline bool has_object(uint32_t object) const { return test(_objects, object); }
+
+private:
+	static inline uint32_t bit(uint32_t value) { return (uint32_t)(mix64(value) % BITS); }
+	static inline void set(uint64_t* words, uint32_t value) {
+		uint32_t b = bit(value);
+		words[b / 64] |= 1ull << (b % 64);
+	}
+	static inline bool test(const uint64_t* words, uint32_t value) {
+		uint32_t b = bit(value);
+		return (words[b / 64] >> (b % 64)) & 1;
+	}
+};
+
+// what a RenderSession keeps per pixel: the first hit of the pixel's first sample and the footprint
+// of all its samples
+struct GBufferPixel
+{
+	static const uint32_t MISS = 0xffffffffu;	// _object of a pixel whose first sample saw the sky
+
+	uint32_t	_object;	// HitRecord::object
+	MaterialHandle	_material;
+	vector3	_position;
+	vector3	_normal;
+	PathFootprint	_footprint;
+};
+
+// survives with a probability equal to the largest throughput channel (capped so bright paths can
+// still die) and reweights the survivors, false means the path was terminated
+inline bool russian_roulette(vector3& throughput, int32_t depth, Sampler& sampler)
+{
+	float survive = std::min(0.95f, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+	sampler.start_dimension(Sampler::bounce_dimension(depth) + Sampler::ROULETTE_DIMENSION);
+	if (sampler.get_1d() >= survive) {
+		return false;
+	}
+	throughput /= survive;
+	return true;
+}
+
+// iterative path tracer, continuing the camera ray r from its first intersection: hit tells whether
+// there was one and first is it. throughput carries the product of the attenuations along the path,
+// paths die when they leave the scene, get absorbed, hit max_depth or lose the russian roulette
+// that starts after rr_depth bounces. first_hit, when set, receives the features of the camera ray's hit,
+// footprint, when set, has every hit of the path added
+vector3 continue_path(const ray& r, bool hit, const HitRecord& first, const World& world, int max_depth, int rr_depth,
+	Sampler& sampler, FirstHit* first_hit = nullptr, PathFootprint* footprint = nullptr) {
+	const MaterialPool& materials = world.materials();
+	ray current = r;
+	HitRecord rec = first;
+	vector3 throughput = vector3::ONE;
+
+	for (int depth = 0; ; depth++) {
+		if (depth > 0) {
+			SPUD_COUNT_RAYS(depth, 1);
+			hit = world.hit(current, 0.001f, FLT_MAX, rec);
+		}
+		if (!hit) {
+			if (depth == 0 && first_hit)
+				*first_hit = FirstHit::miss(current.direction());
+			thread_ray_count() += depth + 1;
+			return throughput * sky_color(current.direction());
+		}
+
+		if (depth == 0 && first_hit)
+			*first_hit = FirstHit{ materials.albedo(rec.mat_id), unit_vector(rec.normal), rec.t * current.direction().length() };
+		if (footprint)
+			footprint->add(rec);
+
+		ray scattered;
+		vector3 attenuation;
+		sampler.start_dimension(Sampler::bounce_dimension(depth));
+		if (depth >= max_depth || !materials.scatter(current, rec, attenuation, scattered, sampler)) {
+			thread_ray_count() += depth + 1;
+			return vector3::ZERO;
+		}
+		throughput *= attenuation;
+
+		if (depth >= rr_depth && !russian_roulette(throughput, depth, sampler)) {
+			thread_ray_count() += depth + 1;
+			return vector3::ZERO;
+		}
+		current = scattered;
+	}
+}
+
+// radiance along the camera ray r
+vector3 color(const ray& r, const World& world, int max_depth, int rr_depth, Sampler& sampler, FirstHit* first_hit = nullptr) {
+	HitRecord rec;
+	SPUD_COUNT_RAYS(0, 1);
+	bool hit = world.hit(r, 0.001f, FLT_MAX, rec);
+	return continue_path(r, hit, rec, world, max_depth, rr_depth, sampler, first_hit);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+
+// the built in material types, lets renderers group hits and call scatter without virtual dispatch
+enum class MaterialKind : uint8_t
+{
+	Lambertian,
+	Metal,
+	Dielectric,
+	Custom,
+	Count
+};
+
+// 32 bit reference to a material in a MaterialPool: the kind sits in the top bits, the index
+// into that kind's contiguous storage below it
+struct MaterialHandle
+{
+	static const uint32_t INDEX_BITS = 28;
+	static const uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+
+	uint32_t _value;
+
+	static inline MaterialHandle make(MaterialKind kind, uint32_t index) {
+		// a larger index would wrap onto another material of the same kind
+		assert(index <= INDEX_MASK);
+		MaterialHandle h;
+		h._value = ((uint32_t)kind << INDEX_BITS) | (index & INDEX_MASK);
+		return h;
+	}
+
+	// refers to no material, its kind is past Count. MaterialPool::add returns it once a kind is full
+	static inline MaterialHandle none() {
+		MaterialHandle h;
+		h._value = ~0u;
+		return h;
+	}
+
+	inline MaterialKind kind() const { return (MaterialKind)(_value >> INDEX_BITS); }
+	inline uint32_t index() const { return _value & INDEX_MASK; }
+	inline bool valid() const { return kind() < MaterialKind::Count; }
+
+	inline bool operator==(const MaterialHandle& other) const { return _value == other._value; }
+	inline bool operator!=(const MaterialHandle& other) const { return _value != other._value; }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "materials.h"
+#include "material_handle.h"
+
+template <typename T>
+struct is_builtin_material : std::integral_constant<bool,
+	std::is_same<T, Lambertian>::value || std::is_same<T, Metal>::value || std::is_same<T, Dielectric>::value> {};
+
+// owns all materials of a scene. the built in types live by value in one contiguous array per type,
+// anything else is heap allocated and reached through the virtual interface. materials are referred
+// to by 32 bit handles and are all released together by clear() or the destructor
+class MaterialPool
+{
+public:
+	MaterialPool() = default;
+	MaterialPool(const MaterialPool&) = delete;
+	MaterialPool& operator=(const MaterialPool&) = delete;
+
+	// MaterialHandle::none() when the kind already holds INDEX_MASK + 1 materials, a handle can't
+	// address more
+	template <typename T, typename... Args>
+	MaterialHandle add(Args&&... args) {
+		return add_impl<T>(is_builtin_material<T>(), std::forward<Args>(args)...);
+	}
+
+	// typed access for callers that already know the kind from the handle
+	template <typename M>
+	inline const M& get(MaterialHandle h) const { return storage((const M*)nullptr)[h.index()]; }
+
+	// replaces a built in material, M has to be the kind of the handle
+	template <typename M>
+	inline void set(MaterialHandle h, const M& material) {
+		static_assert(is_builtin_material<M>::value, "only the built in materials are stored by value");
+		storage((M*)nullptr)[h.index()] = material;
+	}
+
+	// calls fn with the material as its concrete type, so for the built in kinds everything fn does
+	// with it is resolved at compile time. custom materials are passed as a plain Material
+	template <typename Fn>
+	inline auto visit(MaterialHandle h, Fn&& fn) const -> decltype(fn(std::declval<const Material&>())) {
+		switch (h.kind()) {
+		case MaterialKind::Lambertian: return fn(_lambertian[h.index()]);
+		case MaterialKind::Metal: return fn(_metal[h.index()]);
+		case MaterialKind::Dielectric: return fn(_dielectric[h.index()]);
+		default: return fn(static_cast<const Material&>(*_custom[h.index()]));
+		}
+	}
+
+	// tag dispatched scatter, the built in bodies are called directly and can be inlined into the
+	// bounce loop, only custom materials pay for the virtual call
+	inline bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered, Sampler& sampler) const {
+		SPUD_COUNT_SCATTER(rec.mat_id.kind(), 1);
+		return visit(rec.mat_id, [&](const auto& mat) {
+			return mat.scatter(in, rec, attenuation, scattered, sampler);
+		});
+	}
+
+	inline vector3 albedo(MaterialHandle h) const {
+		return visit(h, [](const auto& mat) { return mat.albedo(); });
+	}
+
+	const Material& material(MaterialHandle h) const {
+		switch (h.kind()) {
+		case MaterialKind::Lambertian: return _lambertian[h.index()];
+		case MaterialKind::Metal: return _metal[h.index()];
+		case MaterialKind::Dielectric: return _dielectric[h.index()];
+		default: return *_custom[h.index()];
+		}
+	}
+
+	inline size_t size() const { return _lambertian.size() + _metal.size() + _dielectric.size() + _custom.size(); }
+	template <typename M>
+	inline size_t count() const { return storage((const M*)nullptr).size(); }
+
+	void clear() {
+		_lambertian.clear();
+		_metal.clear();
+		_dielectric.clear();
+		_custom.clear();
+	}
+
+private:
+	template <typename T, typename... Args>
+	MaterialHandle add_impl(std::true_type, Args&&... args) {
+		std::vector<T>& v = storage((T*)nullptr);
+		if (v.size() > MaterialHandle::INDEX_MASK)
+			return MaterialHandle::none();
+		v.emplace_back(std::forward<Args>(args)...);
+		return MaterialHandle::make(T::KIND, (uint32_t)(v.size() - 1));
+	}
+
+	template <typename T, typename... Args>
+	MaterialHandle add_impl(std::false_type, Args&&... args) {
+		if (_custom.size() > MaterialHandle::INDEX_MASK)
+			return MaterialHandle::none();
+		_custom.emplace_back(new T(std::forward<Args>(args)...));
+		return MaterialHandle::make(MaterialKind::Custom, (uint32_t)(_custom.size() - 1));
+	}
+
+	inline std::vector<Lambertian>& storage(Lambertian*) { return _lambertian; }
+	inline std::vector<Metal>& storage(Metal*) { return _metal; }
+	inline std::vector<Dielectric>& storage(Dielectric*) { return _dielectric; }
+	inline const std::vector<Lambertian>& storage(const Lambertian*) const { return _lambertian; }
+	inline const std::vector<Metal>& storage(const Metal*) const { return _metal; }
+	inline const std::vector<Dielectric>& storage(const Dielectric*) const { return _dielectric; }
+
+	std::vector<Lambertian> _lambertian;
+	std::vector<Metal> _metal;
+	std::vector<Dielectric> _dielectric;
+	std::vector<std::unique_ptr<Material>> _custom;
+};
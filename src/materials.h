@@ -1,22 +1,36 @@
 #pragma once
 
+#include <stdint.h>
 #include <algorithm>
 #include "math_utils.h"
+#include "material_handle.h"
 
 class Material
 {
 public:
-	virtual bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered) const = 0;
+	// custom materials are owned and deleted through this base
+	virtual ~Material() = default;
+	virtual bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered, Sampler& sampler) const = 0;
+	virtual MaterialKind kind() const { return MaterialKind::Custom; }
+	// surface color as seen by the denoiser, white for materials without one
+	virtual vector3 albedo() const { return vector3::ONE; }
 };
 
 
-class Lambertian : public Material
+class Lambertian final : public Material
 {
 public:
 	Lambertian(const vector3& a) : _albedo(a) {}
-	virtual bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered) const {
-		vector3 target = rec.p + rec.normal + random_in_unit_sphere();
-		scattered = ray(rec.p, target - rec.p);
+	static const MaterialKind KIND = MaterialKind::Lambertian;
+	virtual MaterialKind kind() const { return KIND; }
+	virtual vector3 albedo() const { return _albedo; }
+	virtual bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered, Sampler& sampler) const {
+		float u1, u2;
+		sampler.get_2d(u1, u2);
+		vector3 t, b;
+		orthonormal_basis(rec.normal, t, b);
+		vector3 d = cosine_hemisphere(u1, u2);
+		scattered = ray(rec.p, d.x() * t + d.y() * b + d.z() * rec.normal);
 		attenuation = _albedo;
 		return true;
 	}
@@ -24,15 +38,21 @@ private:
 	vector3 _albedo;
 };
 
-class Metal : public Material
+class Metal final : public Material
 {
 public:
 	Metal(const vector3& a, float f) : _albedo(a), _fuzz(std::min(f, 1.0f)) {
 	}
+	static const MaterialKind KIND = MaterialKind::Metal;
+	virtual MaterialKind kind() const { return KIND; }
+	virtual vector3 albedo() const { return _albedo; }
 
-	virtual bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered) const {
+	virtual bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered, Sampler& sampler) const {
 		vector3 reflected = reflect(unit_vector(in.direction()), rec.normal);
-		scattered = ray(rec.p, reflected + _fuzz * random_in_unit_sphere());
+		float u1, u2;
+		sampler.get_2d(u1, u2);
+		float u3 = sampler.get_1d();
+		scattered = ray(rec.p, reflected + _fuzz * uniform_ball(u1, u2, u3));
 		attenuation = _albedo;
 		return dot(scattered.direction(), rec.normal) > 0.0f;
 	}
@@ -41,11 +61,13 @@ private:
 	float _fuzz;
 };
 
-class Dielectric : public Material
+class Dielectric final : public Material
 {
 public:
 	Dielectric(float ri) : _ref_idx(ri) {}
-	virtual bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered) const
+	static const MaterialKind KIND = MaterialKind::Dielectric;
+	virtual MaterialKind kind() const { return KIND; }
+	virtual bool scatter(const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered, Sampler& sampler) const
 	{
 		vector3 outward_normal;
 		vector3 reflected = reflect(in.direction(), rec.normal);
@@ -74,7 +96,7 @@ public:
 			reflect_prob = 1.0f;
 		}
 
-		if (drand48() < reflect_prob) {
+		if (sampler.get_1d() < reflect_prob) {
 			scattered = ray(rec.p, reflected);
 		}
 		else {
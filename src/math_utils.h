@@ -2,39 +2,71 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <algorithm>
 
 #include "vector3.h"
 #include "ray.h"
+#include "sampler.h"
+#include "material_handle.h"
+#include "profile.h"
 
-class Material;
 struct HitRecord
 {
 	float t;
 	vector3 p;
 	vector3 normal;
-	Material* mat_ptr;
+	MaterialHandle mat_id;
+	uint32_t object;	// what World::hit hit: a sphere slot, or World::OBJECT_BIT | index into _objects
 };
 
-float drand48()
-{
-	return (float)rand() / (RAND_MAX + 1.0f);
+// closed form mappings of uniform samples in [0, 1)^n, each output point comes from exactly one input
+// point so the stratification of the sampler carries over
+
+// concentric map of the square to the unit disk in the xy plane (shirley and chiu)
+vector3 concentric_disk(float u1, float u2) {
+	float a = 2.0f * u1 - 1.0f;
+	float b = 2.0f * u2 - 1.0f;
+	if (a == 0.0f && b == 0.0f)
+		return vector3::ZERO;
+	float r, phi;
+	if (fabsf(a) > fabsf(b)) {
+		r = a;
+		phi = (float)M_PI / 4.0f * (b / a);
+	}
+	else {
+		r = b;
+		phi = (float)M_PI / 2.0f - (float)M_PI / 4.0f * (a / b);
+	}
+	return vector3(r * cosf(phi), r * sinf(phi), 0.0f);
 }
 
-vector3 random_in_unit_sphere() {
-	vector3 p;
-	do {
-		p = 2.0f * vector3(drand48(), drand48(), drand48()) - vector3::ONE;
-	} while (p.squared_length() >= 1.0f);
-	return p;
+// cosine weighted direction around +z, the disk lifted onto the hemisphere (malley's method)
+vector3 cosine_hemisphere(float u1, float u2) {
+	vector3 d = concentric_disk(u1, u2);
+	float z = sqrtf(std::max(0.0f, 1.0f - d.x() * d.x() - d.y() * d.y()));
+	return vector3(d.x(), d.y(), z);
 }
 
-vector3 random_in_unit_disk() {
-	vector3 p;
-	static const vector3 c = vector3(1.0f, 1.0f, 0.0f);
-	do {
-		p = 2.0f * vector3(drand48(), drand48(), 0.0f) - c;
-	} while (dot(p,p) >= 1.0f);
-	return p;
+vector3 uniform_sphere(float u1, float u2) {
+	float z = 1.0f - 2.0f * u1;
+	float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+	float phi = 2.0f * (float)M_PI * u2;
+	return vector3(r * cosf(phi), r * sinf(phi), z);
+}
+
+// uniform point inside the unit ball
+vector3 uniform_ball(float u1, float u2, float u3) {
+	return cbrtf(u3) * uniform_sphere(u1, u2);
+}
+
+// t and b complete the unit vector n to an orthonormal basis (duff et al., "building an orthonormal
+// basis, revisited")
+void orthonormal_basis(const vector3& n, vector3& t, vector3& b) {
+	float sign = copysignf(1.0f, n.z());
+	float a = -1.0f / (sign + n.z());
+	float c = n.x() * n.y() * a;
+	t = vector3(1.0f + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+	b = vector3(c, sign + n.y() * n.y() * a, -n.y());
 }
 
 vector3 reflect(const vector3& v, const vector3& n) {
@@ -47,7 +79,7 @@ bool refract(const vector3& v, const vector3& n, float ni_over_nt, vector3& refr
 	float discriminant = 1.0f - ni_over_nt * ni_over_nt * (1 - dt * dt);
 	if (discriminant > 0)
 	{
-		refracted = ni_over_nt * (uv - n * dt) - n * sqrt(discriminant);
+		refracted = ni_over_nt * (uv - n * dt) - n * math_sqrt(discriminant);
 		return true;
 	}
 	return false;
@@ -56,5 +88,5 @@ bool refract(const vector3& v, const vector3& n, float ni_over_nt, vector3& refr
 float schlick(float cosine, float ref_idx) {
 	float r0 = (1 - ref_idx) / (1 + ref_idx);
 	r0 = r0 * r0;
-	return r0 + (1 - r0) * pow((1 - cosine), 5);
+	return r0 + (1 - r0) * pow5(1 - cosine);
 }
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// blocking TCP socket, just enough for the coordinator / worker protocol. move only, closes on destruction
+class Socket
+{
+public:
+#if defined(_WIN32)
+	typedef SOCKET Handle;
+	static const Handle INVALID = INVALID_SOCKET;
+#else
+	typedef int Handle;
+	static const Handle INVALID = -1;
+#endif
+
+	Socket() = default;
+	explicit Socket(Handle handle) : _handle(handle) {}
+	~Socket() { close(); }
+
+	Socket(Socket&& other) : _handle(other._handle) { other._handle = INVALID; }
+	Socket& operator=(Socket&& other) {
+		if (this != &other) {
+			close();
+			_handle = other._handle;
+			other._handle = INVALID;
+		}
+		return *this;
+	}
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+
+	inline bool valid() const { return _handle != INVALID; }
+
+	// listens on every interface or, with loopback, only for connections from this machine. port 0
+	// picks a free one (see local_port)
+	bool listen(uint16_t port, bool loopback, std::string& error);
+	uint16_t local_port() const;
+
+	// true once accept() won't block, false on timeout
+	bool wait_readable(int32_t timeout_ms) const;
+	Socket accept() const;
+
+	bool connect(const char* host, uint16_t port, std::string& error);
+
+	// whole buffers or nothing, false means the connection is gone
+	bool send_all(const void* data, size_t size);
+	bool recv_all(void* data, size_t size);
+
+	// recv_all() fails once a receive waited this long, 0 waits forever
+	void set_receive_timeout(int32_t seconds);
+
+	void close();
+
+private:
+	static bool startup();
+	void set_no_delay();
+
+	Handle _handle = INVALID;
+};
+
+// "host:port"
+bool parse_host_port(const char* text, std::string& host, uint16_t& port)
+{
+	const char* colon = strrchr(text, ':');
+	if (!colon || colon == text)
+		return false;
+	char* end = nullptr;
+	long value = strtol(colon + 1, &end, 10);
+	if (*end != '\0' || value <= 0 || value > 65535)
+		return false;
+	host.assign(text, colon - text);
+	port = (uint16_t)value;
+	return true;
+}
+
+bool Socket::startup()
+{
+#if defined(_WIN32)
+	static bool ok = []() {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+	return ok;
+#else
+	return true;
+#endif
+}
+
+void Socket::set_no_delay()
+{
+	// requests are a few bytes each, they shouldn't wait for more data to fill a segment
+	int one = 1;
+	setsockopt(_handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+}
+
+bool Socket::listen(uint16_t port, bool loopback, std::string& error)
+{
+	close();
+	if (!startup()) {
+		error = "can't initialize sockets";
+		return false;
+	}
+	_handle = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (_handle == INVALID) {
+		error = "can't create a socket";
+		return false;
+	}
+	int one = 1;
+	setsockopt(_handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(loopback ? INADDR_LOOPBACK : INADDR_ANY);
+	address.sin_port = htons(port);
+	if (::bind(_handle, (const sockaddr*)&address, sizeof(address)) != 0 || ::listen(_handle, 16) != 0) {
+		error = "can't listen on port " + std::to_string(port);
+		close();
+		return false;
+	}
+	return true;
+}
+
+uint16_t Socket::local_port() const
+{
+	sockaddr_in address;
+	socklen_t length = sizeof(address);
+	if (getsockname(_handle, (sockaddr*)&address, &length) != 0)
+		return 0;
+	return ntohs(address.sin_port);
+}
+
+bool Socket::wait_readable(int32_t timeout_ms) const
+{
+	fd_set set;
+	FD_ZERO(&set);
+	FD_SET(_handle, &set);
+	timeval timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	return select((int)_handle + 1, &set, nullptr, nullptr, &timeout) > 0;
+}
+
+Socket Socket::accept() const
+{
+	Socket socket(::accept(_handle, nullptr, nullptr));
+	if (socket.valid())
+		socket.set_no_delay();
+	return socket;
+}
+
+bool Socket::connect(const char* host, uint16_t port, std::string& error)
+{
+	close();
+	if (!startup()) {
+		error = "can't initialize sockets";
+		return false;
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host, std::to_string(port).c_str(), &hints, &result) != 0) {
+		error = std::string("can't resolve ") + host;
+		return false;
+	}
+	for (addrinfo* a = result; a; a = a->ai_next) {
+		_handle = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (_handle == INVALID)
+			continue;
+		if (::connect(_handle, a->ai_addr, (int)a->ai_addrlen) == 0)
+			break;
+		close();
+	}
+	freeaddrinfo(result);
+	if (!valid()) {
+		error = std::string("can't connect to ") + host + ":" + std::to_string(port);
+		return false;
+	}
+	set_no_delay();
+	return true;
+}
+
+bool Socket::send_all(const void* data, size_t size)
+{
+	// a closed peer should show up as an error, not as SIGPIPE
+#if defined(MSG_NOSIGNAL)
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+	const char* p = (const char*)data;
+	while (size > 0) {
+		int chunk = (int)std::min<size_t>(size, 1 << 30);
+		int sent = ::send(_handle, p, chunk, flags);
+		if (sent <= 0)
+			return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool Socket::recv_all(void* data, size_t size)
+{
+	char* p = (char*)data;
+	while (size > 0) {
+		int chunk = (int)std::min<size_t>(size, 1 << 30);
+		int received = ::recv(_handle, p, chunk, 0);
+		if (received <= 0)
+			return false;
+		p += received;
+		size -= received;
+	}
+	return true;
+}
+
+void Socket::set_receive_timeout(int32_t seconds)
+{
+#if defined(_WIN32)
+	DWORD timeout = (DWORD)seconds * 1000;
+#else
+	timeval timeout;
+	timeout.tv_sec = seconds;
+	timeout.tv_usec = 0;
+#endif
+	setsockopt(_handle, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+void Socket::close()
+{
+	if (_handle == INVALID)
+		return;
+#if defined(_WIN32)
+	closesocket(_handle);
+#else
+	::close(_handle);
+#endif
+	_handle = INVALID;
+}
@@ -2,25 +2,35 @@
 
 #include "math_utils.h"
 #include "materials.h"
+#include "material_pool.h"
+#include "arena.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+#include "transform.h"
 
+#include <algorithm>
 #include <vector>
-#include <memory.h>
+#include <utility>
 
 class Object {
 public:
 	virtual bool hit(const ray& r, float t_min, float t_max, HitRecord& rec) const = 0;
+	// returns false for unbounded objects, those are kept out of the acceleration structure
+	virtual bool bounding_box(AABB& box) const = 0;
 };
 
 class Sphere : public Object
 {
 public:
 	Sphere() = default;
-	Sphere(const vector3& c, float r, Material* m) : _center(c), _radius(r), _mat_ptr(m) {}
+	Sphere(const vector3& c, float r, MaterialHandle m) : _center(c), _radius(r), _mat_id(m) {}
 	virtual bool hit(const ray& r, float t_min, float t_max, HitRecord& rec) const;
+	virtual bool bounding_box(AABB& box) const;
 private:
 	vector3 _center;
 	float _radius;
-	Material* _mat_ptr;
+	MaterialHandle _mat_id;
 };
 
 bool Sphere::hit(const ray& r, float t_min, float t_max, HitRecord& rec) const
@@ -31,51 +41,446 @@ bool Sphere::hit(const ray& r, float t_min, float t_max, HitRecord& rec) const
 	float c = dot(oc, oc) - _radius * _radius;
 	float discriminant = b * b - a * c;
 	if (discriminant > 0.0f) {
-		float temp = (-b - sqrt(b * b - a * c)) / a;
+		float root = math_sqrt(discriminant);
+		float temp = (-b - root) / a;
 		if (temp < t_max && temp > t_min) {
 			rec.t = temp;
 			rec.p = r.point_at_parameter(rec.t);
 			rec.normal = (rec.p - _center) / _radius;
-			rec.mat_ptr = _mat_ptr;
+			rec.mat_id = _mat_id;
 			return true;
 		}
-		temp = (-b + sqrt(b * b - a * c)) / a;
+		temp = (-b + root) / a;
 		if (temp < t_max && temp > t_min) {
 			rec.t = temp;
 			rec.p = r.point_at_parameter(rec.t);
 			rec.normal = (rec.p - _center) / _radius;
-			rec.mat_ptr = _mat_ptr;
+			rec.mat_id = _mat_id;
 			return true;
 		}
 	}
 	return false;
 }
 
+bool Sphere::bounding_box(AABB& box) const
+{
+	// inverted spheres (negative radius) are used for hollow glass, the bounds are the same
+	float r = fabsf(_radius);
+	box = AABB(_center - vector3(r, r, r), _center + vector3(r, r, r));
+	return true;
+}
+
+// spheres shared by every Instance of them, kept in their own SoA store and BVH in object space.
+// has to be built before it is instanced, World::build() takes care of that for add_prototype()
+class Prototype final : public Object
+{
+public:
+	void add_sphere(const vector3& center, float radius, MaterialHandle mat) {
+		_spheres.add(center, radius, mat);
+		_built = false;
+	}
+
+	inline size_t sphere_count() const { return _spheres.size(); }
+	inline bool built() const { return _built; }
+
+	void build();
+
+	virtual bool hit(const ray& r, float t_min, float t_max, HitRecord& rec) const;
+	virtual bool bounding_box(AABB& box) const;
+
+private:
+	SphereSoA _spheres;
+	BVH _bvh;
+	bool _built = false;
+};
+
+void Prototype::build()
+{
+	std::vector<AABB> bounds;
+	bounds.reserve(_spheres.size());
+	for (uint32_t i = 0; i < (uint32_t)_spheres.size(); i++)
+		bounds.push_back(_spheres.bounds(i));
+	_bvh.build(bounds, SphereSoA::LANES);
+	_spheres.reorder(_bvh.primitive_indices());
+	_built = true;
+}
+
+bool Prototype::hit(const ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+	return _bvh.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count, float& t_closest) {
+		return _spheres.hit(r, first, count, t_min, t_closest, rec);
+	});
+}
+
+bool Prototype::bounding_box(AABB& box) const
+{
+	if (_bvh.empty())
+		return false;
+	box = _bvh.bounds();
+	return true;
+}
+
+// a placed copy of a prototype. rays are taken into object space rather than the geometry into
+// world space, so a thousand instances cost one prototype plus a transform each
+class Instance final : public Object
+{
+public:
+	// material overrides the prototype's materials unless it is MaterialHandle::none()
+	Instance(const Prototype* prototype, const Transform& to_world, MaterialHandle material)
+		: _prototype(prototype), _to_world(to_world), _to_object(to_world.inverse()), _material(material) {}
+
+	virtual bool hit(const ray& r, float t_min, float t_max, HitRecord& rec) const;
+	virtual bool bounding_box(AABB& box) const;
+
+private:
+	const Prototype* _prototype;
+	Transform _to_world;
+	Transform _to_object;
+	MaterialHandle _material;
+};
+
+bool Instance::hit(const ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+	// the direction isn't renormalized, that keeps t the same in both spaces
+	ray local(_to_object.point(r.origin()), _to_object.vector(r.direction()));
+	if (!_prototype->Prototype::hit(local, t_min, t_max, rec))
+		return false;
+	rec.p = r.point_at_parameter(rec.t);
+	rec.normal = unit_vector(_to_object.transposed_vector(rec.normal));
+	if (_material.valid())
+		rec.mat_id = _material;
+	return true;
+}
+
+bool Instance::bounding_box(AABB& box) const
+{
+	AABB local;
+	if (!_prototype->bounding_box(local))
+		return false;
+	box = _to_world.bounds(local);
+	return true;
+}
+
+// what World::update() had to do to the acceleration structures
+enum class WorldUpdate
+{
+	None,
+	Refit,
+	Rebuild
+};
+
+// owns everything in a scene: materials in a MaterialPool, spheres in the SoA store and any other
+// object in an arena. nothing is freed individually, clear() or the destructor releases it all at once
 class World : public Object
 {
 public:
-	using object_ptr = std::unique_ptr<Object>;
+	// a refit sphere BVH is rebuilt once its SAH cost grew past this multiple of the built one
+	static constexpr float REBUILD_COST_RATIO = 1.5f;
+	// marks HitRecord::object as an index into _objects rather than a sphere slot
+	static const uint32_t OBJECT_BIT = 0x80000000u;
 
 	World() = default;
+	World(const World&) = delete;
+	World& operator=(const World&) = delete;
+
+	// spheres go to the SoA store and are intersected 8 at a time, _objects is for everything else.
+	// returns the sphere's id, build() reorders the store but the id keeps naming the same sphere
+	uint32_t add_sphere(const vector3& center, float radius, MaterialHandle mat) {
+		_spheres_added = true;
+		_sphere_slots.push_back(_spheres.add(center, radius, mat));
+		return (uint32_t)_sphere_slots.size() - 1;
+	}
+
+	// bulk version for loaders, sphere i uses materials[material_index[i]]. the ids continue from
+	// the spheres already in the world
+	void add_spheres(size_t n, const float* cx, const float* cy, const float* cz, const float* radius,
+		const uint32_t* material_index, const MaterialHandle* materials) {
+		_spheres_added = true;
+		for (size_t i = 0; i < n; i++)
+			_sphere_slots.push_back((uint32_t)(_spheres.size() + i));
+		_spheres.append(n, cx, cy, cz, radius, material_index, materials);
+	}
+
+	inline vector3 sphere_center(uint32_t id) const { return _spheres.center(_sphere_slots[id]); }
+	inline AABB sphere_bounds(uint32_t id) const { return _spheres.bounds(_sphere_slots[id]); }
+	// what HitRecord::object holds for the sphere, until the next rebuild of the sphere BVH
+	inline uint32_t sphere_slot(uint32_t id) const { return _sphere_slots[id]; }
+	inline size_t sphere_id_count() const { return _sphere_slots.size(); }
+
+	// takes effect with the next update()
+	void move_sphere(uint32_t id, const vector3& center) {
+		uint32_t slot = _sphere_slots[id];
+		vector3 old = _spheres.center(slot);
+		if (old.x() == center.x() && old.y() == center.y() && old.z() == center.z())
+			return;
+		_spheres.set_center(slot, center);
+		_spheres_moved = true;
+	}
+
+	void reserve_spheres(size_t n) {
+		_spheres.reserve(_spheres.size() + n);
+	}
+
+	template <typename T, typename... Args>
+	MaterialHandle add_material(Args&&... args) {
+		return _materials.add<T>(std::forward<Args>(args)...);
+	}
+
+	// overwrites a built in material in place, nothing has to be rebuilt
+	template <typename M>
+	void set_material(MaterialHandle h, const M& material) {
+		_materials.set(h, material);
+	}
+
+	// constructs a generic object in the world's arena, the pointer stays valid until clear()
+	template <typename T, typename... Args>
+	T* add_object(Args&&... args) {
+		T* obj = _arena.make<T>(std::forward<Args>(args)...);
+		_objects.push_back(obj);
+		_objects_added = true;
+		return obj;
+	}
+
+	// an empty prototype in the arena, fill it with add_sphere() and place it with add_instance()
+	Prototype* add_prototype() {
+		Prototype* prototype = _arena.make<Prototype>();
+		_prototypes.push_back(prototype);
+		return prototype;
+	}
+
+	Instance* add_instance(const Prototype* prototype, const Transform& to_world, MaterialHandle material = MaterialHandle::none()) {
+		return add_object<Instance>(prototype, to_world, material);
+	}
+
+	inline const MaterialPool& materials() const { return _materials; }
+	inline size_t sphere_count() const { return _spheres.size(); }
+
+	void clear();
+
+	// builds the BVHs over the spheres and _objects, has to be called again whenever either changes.
+	// both get reordered so every BVH leaf covers a contiguous range of them
+	void build();
+
+	// brings the BVHs up to date for the next frame of an animation: added spheres or objects rebuild
+	// their BVH, moved spheres only refit the sphere BVH until that degrades too far
+	WorldUpdate update();
 
 	virtual bool hit(const ray& r, float t_min, float t_max, HitRecord& rec) const;
+	virtual bool bounding_box(AABB& box) const;
+
+	// hit() for every ray k of the packet up to its t_max(k), hits[k] tells whether recs[k] was filled.
+	// the results are exactly hit()'s, an incoherent packet is traced ray by ray
+	void hit_packet(RayPacket& packet, float t_min, HitRecord* recs, bool* hits) const;
 
-	std::vector<object_ptr> _objects;
+	// not owning, the objects live in _arena
+	std::vector<Object*> _objects;
+
+private:
+	void build_spheres();
+	void build_objects();
+
+	MaterialPool _materials;
+	Arena _arena;
+	SphereSoA _spheres;
+	std::vector<uint32_t> _sphere_slots;	// sphere id -> slot in _spheres
+	std::vector<Prototype*> _prototypes;	// in _arena like the objects
+	BVH _sphere_bvh;
+	float _sphere_build_cost = 0.0f;	// _sphere_bvh.sah_cost() right after it was built
+	BVH _bvh;
+	// objects at [0, _bounded_count) are in the BVH, the rest are unbounded and tested one by one
+	size_t _bounded_count = 0;
+	bool _spheres_added = false;
+	bool _spheres_moved = false;
+	bool _objects_added = false;
 };
 
+void World::clear()
+{
+	_objects.clear();
+	_arena.reset();
+	_materials.clear();
+	_spheres.clear();
+	_sphere_slots.clear();
+	_prototypes.clear();
+	_sphere_bvh.clear();
+	_sphere_build_cost = 0.0f;
+	_bvh.clear();
+	_bounded_count = 0;
+	_spheres_added = false;
+	_spheres_moved = false;
+	_objects_added = false;
+}
+
+void World::build()
+{
+	build_spheres();
+	build_objects();
+}
+
+WorldUpdate World::update()
+{
+	WorldUpdate result = WorldUpdate::None;
+	if (_objects_added) {
+		build_objects();
+		result = WorldUpdate::Rebuild;
+	}
+	if (_spheres_added) {
+		build_spheres();
+		return WorldUpdate::Rebuild;
+	}
+	if (!_spheres_moved)
+		return result;
+
+	_sphere_bvh.refit([this](uint32_t slot) { return _spheres.bounds(slot); });
+	_spheres_moved = false;
+	if (_sphere_bvh.sah_cost() > REBUILD_COST_RATIO * _sphere_build_cost) {
+		build_spheres();
+		return WorldUpdate::Rebuild;
+	}
+	return result == WorldUpdate::None ? WorldUpdate::Refit : result;
+}
+
+void World::build_spheres()
+{
+	std::vector<AABB> bounds;
+	bounds.reserve(_spheres.size());
+	for (uint32_t i = 0; i < (uint32_t)_spheres.size(); i++)
+		bounds.push_back(_spheres.bounds(i));
+	_sphere_bvh.build(bounds, SphereSoA::LANES);
+	const std::vector<uint32_t>& order = _sphere_bvh.primitive_indices();
+	_spheres.reorder(order);
+
+	// slot i now holds what was in slot order[i], follow the ids along
+	std::vector<uint32_t> new_slot(order.size());
+	for (uint32_t i = 0; i < (uint32_t)order.size(); i++)
+		new_slot[order[i]] = i;
+	for (uint32_t& slot : _sphere_slots)
+		slot = new_slot[slot];
+
+	_sphere_build_cost = _sphere_bvh.sah_cost();
+	_spheres_added = false;
+	_spheres_moved = false;
+}
+
+void World::build_objects()
+{
+	// instances take their bounds from the prototype's BVH
+	for (Prototype* prototype : _prototypes) {
+		if (!prototype->built())
+			prototype->build();
+	}
+
+	std::vector<Object*> bounded, unbounded;
+	std::vector<AABB> bounds;
+	bounds.reserve(_objects.size());
+	bounded.reserve(_objects.size());
+
+	for (Object* obj : _objects) {
+		AABB box;
+		if (obj->bounding_box(box)) {
+			bounds.push_back(box);
+			bounded.push_back(obj);
+		}
+		else {
+			unbounded.push_back(obj);
+		}
+	}
+
+	_bvh.build(bounds);
+
+	_objects.clear();
+	for (uint32_t index : _bvh.primitive_indices())
+		_objects.push_back(bounded[index]);
+	_bounded_count = _objects.size();
+	_objects.insert(_objects.end(), unbounded.begin(), unbounded.end());
+	_objects_added = false;
+}
 
 bool World::hit(const ray& r, float t_min, float t_max, HitRecord& rec) const
 {
 	HitRecord temp_rec;
 	bool hit_anything = false;
 	float closest_so_far = t_max;
-	for (auto& obj : _objects) {
-		if (obj->hit(r, t_min, closest_so_far, temp_rec))
+
+	hit_anything = _sphere_bvh.traverse(r, t_min, closest_so_far, [&](uint32_t first, uint32_t count, float& t_closest) {
+		return _spheres.hit(r, first, count, t_min, t_closest, rec);
+	});
+
+	hit_anything |= _bvh.traverse(r, t_min, closest_so_far, [&](uint32_t first, uint32_t count, float& t_closest) {
+		bool hit_leaf = false;
+		for (uint32_t i = first; i < first + count; i++) {
+			SPUD_COUNT(ObjectTests);
+			if (_objects[i]->hit(r, t_min, t_closest, temp_rec)) {
+				hit_leaf = true;
+				t_closest = temp_rec.t;
+				rec = temp_rec;
+				rec.object = OBJECT_BIT | i;
+			}
+		}
+		return hit_leaf;
+	});
+
+	for (size_t i = _bounded_count; i < _objects.size(); i++) {
+		SPUD_COUNT(ObjectTests);
+		if (_objects[i]->hit(r, t_min, closest_so_far, temp_rec))
 		{
 			hit_anything = true;
 			closest_so_far = temp_rec.t;
 			rec = temp_rec;
+			rec.object = OBJECT_BIT | (uint32_t)i;
 		}
 	}
 	return hit_anything;
 }
+
+void World::hit_packet(RayPacket& packet, float t_min, HitRecord* recs, bool* hits) const
+{
+	if (!packet.coherent()) {
+		for (uint32_t k = 0; k < packet.size(); k++)
+			hits[k] = hit(packet.get(k), t_min, packet.t_max(k), recs[k]);
+		return;
+	}
+
+	std::fill(hits, hits + packet.size(), false);
+	_sphere_bvh.traverse_packet(packet, t_min, [&](uint32_t first, uint32_t count, uint32_t k, float& t_closest) {
+		if (_spheres.hit(packet.get(k), first, count, t_min, t_closest, recs[k]))
+			hits[k] = true;
+	});
+
+	HitRecord temp_rec;
+	_bvh.traverse_packet(packet, t_min, [&](uint32_t first, uint32_t count, uint32_t k, float& t_closest) {
+		for (uint32_t i = first; i < first + count; i++) {
+			SPUD_COUNT(ObjectTests);
+			if (_objects[i]->hit(packet.get(k), t_min, t_closest, temp_rec)) {
+				hits[k] = true;
+				t_closest = temp_rec.t;
+				recs[k] = temp_rec;
+				recs[k].object = OBJECT_BIT | i;
+			}
+		}
+	});
+
+	for (size_t i = _bounded_count; i < _objects.size(); i++) {
+		for (uint32_t k = 0; k < packet.size(); k++) {
+			SPUD_COUNT(ObjectTests);
+			if (_objects[i]->hit(packet.get(k), t_min, packet.t_max(k), temp_rec)) {
+				hits[k] = true;
+				packet.t_max(k) = temp_rec.t;
+				recs[k] = temp_rec;
+				recs[k].object = OBJECT_BIT | (uint32_t)i;
+			}
+		}
+	}
+}
+
+bool World::bounding_box(AABB& box) const
+{
+	if (_bounded_count != _objects.size())
+		return false;
+	box = AABB();
+	if (!_sphere_bvh.empty())
+		box.expand(_sphere_bvh.bounds());
+	if (!_bvh.empty())
+		box.expand(_bvh.bounds());
+	return !box.empty();
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <stdint.h>
+#include <cfloat>
+#include <algorithm>
+
+#include "aabb.h"
+#include "ray.h"
+#include "vector3_batch.h"
+
+// up to MAX rays traced through a BVH together, the camera rays of a block of pixels.
+// the rays are kept twice, as ray objects for the per ray leaf tests and as columns for the box
+// tests, which run WIDTH rays at a time. a packet is coherent when every ray points into the same
+// octant, only then is the whole packet bounded by intervals of origins and inverse directions and
+// can a node be culled for all rays at once (BVH::traverse_packet)
+class RayPacket
+{
+public:
+	static const uint32_t MAX = 64;
+	static const int32_t MAX_EDGE = 8;		// edge of the largest square block of pixels that fits
+	static const uint32_t WIDTH = float8::WIDTH;
+
+	void reset() { _count = 0; }
+
+	// t_max of the new ray starts at FLT_MAX, returns its index
+	uint32_t add(const ray& r) {
+		uint32_t k = _count++;
+		const vector3& o = r.origin();
+		const vector3& d = r.direction();
+		_rays[k] = r;
+		_ox[k] = o.x();
+		_oy[k] = o.y();
+		_oz[k] = o.z();
+		// the same reciprocals BVH::traverse takes, so the box tests agree with the single ray ones
+		_ix[k] = 1.0f / d.x();
+		_iy[k] = 1.0f / d.y();
+		_iz[k] = 1.0f / d.z();
+		_t_max[k] = FLT_MAX;
+		return k;
+	}
+
+	// pads the last group and computes the octant and the intervals, call after the last add()
+	void finish();
+
+	inline uint32_t size() const { return _count; }
+	inline uint32_t groups() const { return (_count + WIDTH - 1) / WIDTH; }
+	inline const ray& get(uint32_t k) const { return _rays[k]; }
+	inline float& t_max(uint32_t k) { return _t_max[k]; }
+	inline bool coherent() const { return _coherent; }
+	inline bool dir_neg(int axis) const { return _dir_neg[axis]; }
+
+	// true when no ray of the (coherent) packet can enter box within [t_min, t_max]
+	bool interval_miss(const AABB& box, float t_min) const;
+
+	// bit i set when ray group * WIDTH + i enters box, the slab test of AABB::hit on WIDTH rays
+	unsigned hit_box(const AABB& box, float t_min, uint32_t group) const;
+
+	// first ray from index first on that enters box, size() if there is none
+	uint32_t first_hit(const AABB& box, float t_min, uint32_t first) const;
+
+	// the largest t_max of the packet, call after leaf tests shrank some of them
+	void update_t_max_bound();
+
+private:
+	ray _rays[MAX];
+	alignas(32) float _ox[MAX];
+	alignas(32) float _oy[MAX];
+	alignas(32) float _oz[MAX];
+	alignas(32) float _ix[MAX];
+	alignas(32) float _iy[MAX];
+	alignas(32) float _iz[MAX];
+	alignas(32) float _t_max[MAX];
+	uint32_t _count = 0;
+
+	bool _coherent = false;
+	bool _dir_neg[3] = { false, false, false };
+	vector3 _o_min, _o_max;
+	vector3 _inv_min, _inv_max;
+	float _t_max_bound = FLT_MAX;
+};
+
+void RayPacket::finish()
+{
+	// padding lanes copy ray 0 with an empty interval, they never enter a box
+	for (uint32_t k = _count; k < groups() * WIDTH; k++) {
+		_ox[k] = _ox[0];
+		_oy[k] = _oy[0];
+		_oz[k] = _oz[0];
+		_ix[k] = _ix[0];
+		_iy[k] = _iy[0];
+		_iz[k] = _iz[0];
+		_t_max[k] = -FLT_MAX;
+	}
+
+	_o_min = _o_max = _rays[0].origin();
+	_inv_min = _inv_max = vector3(_ix[0], _iy[0], _iz[0]);
+	_dir_neg[0] = _ix[0] < 0.0f;
+	_dir_neg[1] = _iy[0] < 0.0f;
+	_dir_neg[2] = _iz[0] < 0.0f;
+	// a zero direction component makes an infinite reciprocal, the interval products could turn into
+	// NaN, such packets are not culled as a whole
+	_coherent = _count > 0;
+	for (uint32_t k = 0; k < _count; k++) {
+		vector3 inv(_ix[k], _iy[k], _iz[k]);
+		_o_min = vmin(_o_min, _rays[k].origin());
+		_o_max = vmax(_o_max, _rays[k].origin());
+		_inv_min = vmin(_inv_min, inv);
+		_inv_max = vmax(_inv_max, inv);
+		for (int a = 0; a < 3; a++) {
+			if ((inv[a] < 0.0f) != _dir_neg[a] || fabsf(inv[a]) == INFINITY)
+				_coherent = false;
+		}
+	}
+	_t_max_bound = FLT_MAX;
+}
+
+bool RayPacket::interval_miss(const AABB& box, float t_min) const
+{
+	// per axis the smallest entry and the largest exit distance any ray of the packet can have.
+	// rounding is monotonic, so the bounds also hold for the rounded per ray distances
+	float near_lo = t_min;
+	float far_hi = _t_max_bound;
+	for (int a = 0; a < 3; a++) {
+		float i_lo = _inv_min[a];
+		float i_hi = _inv_max[a];
+		float n, f;
+		if (!_dir_neg[a]) {
+			float nd = box.min()[a] - _o_max[a];
+			float fd = box.max()[a] - _o_min[a];
+			n = nd >= 0.0f ? nd * i_lo : nd * i_hi;
+			f = fd >= 0.0f ? fd * i_hi : fd * i_lo;
+		}
+		else {
+			float nd = box.max()[a] - _o_min[a];
+			float fd = box.min()[a] - _o_max[a];
+			n = nd >= 0.0f ? nd * i_lo : nd * i_hi;
+			f = fd < 0.0f ? fd * i_lo : fd * i_hi;
+		}
+		near_lo = n > near_lo ? n : near_lo;
+		far_hi = f < far_hi ? f : far_hi;
+	}
+	return far_hi < near_lo;
+}
+
+unsigned RayPacket::hit_box(const AABB& box, float t_min, uint32_t group) const
+{
+	uint32_t k = group * WIDTH;
+	vector3 near_corner(_dir_neg[0] ? box.max().x() : box.min().x(),
+		_dir_neg[1] ? box.max().y() : box.min().y(),
+		_dir_neg[2] ? box.max().z() : box.min().z());
+	vector3 far_corner(_dir_neg[0] ? box.min().x() : box.max().x(),
+		_dir_neg[1] ? box.min().y() : box.max().y(),
+		_dir_neg[2] ? box.min().z() : box.max().z());
+
+	vector3x8 o = vector3x8::load(_ox + k, _oy + k, _oz + k);
+	vector3x8 inv = vector3x8::load(_ix + k, _iy + k, _iz + k);
+	vector3x8 t0 = (vector3x8(near_corner) - o) * inv;
+	vector3x8 t1 = (vector3x8(far_corner) - o) * inv;
+
+	// the running max / min of AABB::hit, a ray misses once the exit comes before the entry
+	float8 lo = vmax(t0.x(), float8(t_min));
+	float8 hi = vmin(t1.x(), float8::load(_t_max + k));
+	lo = vmax(t0.y(), lo);
+	hi = vmin(t1.y(), hi);
+	lo = vmax(t0.z(), lo);
+	hi = vmin(t1.z(), hi);
+	return (unsigned)movemask(hi >= lo);
+}
+
+uint32_t RayPacket::first_hit(const AABB& box, float t_min, uint32_t first) const
+{
+	for (uint32_t g = first / WIDTH; g < groups(); g++) {
+		unsigned mask = hit_box(box, t_min, g);
+		if (g == first / WIDTH)
+			mask &= ~0u << (first % WIDTH);
+		if (mask != 0)
+			return g * WIDTH + (uint32_t)lowest_bit(mask);
+	}
+	return _count;
+}
+
+void RayPacket::update_t_max_bound()
+{
+	float8 bound = float8::load(_t_max);
+	for (uint32_t g = 1; g < groups(); g++)
+		bound = vmax(bound, float8::load(_t_max + g * WIDTH));
+	float lanes[WIDTH];
+	bound.store(lanes);
+	_t_max_bound = *std::max_element(lanes, lanes + WIDTH);
+}
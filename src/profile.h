@@ -0,0 +1,229 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// hot path instrumentation. build with SPUD_PROFILE defined to turn it on, otherwise every SPUD_COUNT /
+// SPUD_TRACE macro expands to nothing and the renderer pays nothing for it.
+// each thread counts into its own ThreadProfile, they are only merged when a report is written
+
+enum class ProfileCounter : uint32_t
+{
+	BVHNodes,			// nodes popped during traversal
+	SphereTests,		// sphere lanes tested by the SoA kernel
+	ObjectTests,		// Object::hit calls on generic objects
+	PacketNodes,		// nodes popped during packet traversal
+	PacketCulled,		// of those, nodes dropped by the packet's interval test
+	ScatterLambertian,	// scatter calls, in MaterialKind order
+	ScatterMetal,
+	ScatterDielectric,
+	ScatterCustom,
+	Count
+};
+
+// finished tile as recorded for the trace, times in microseconds since the profiler started
+struct TileTraceEvent
+{
+	int32_t	_x0;
+	int32_t	_y0;
+	int32_t	_x1;
+	int32_t	_y1;
+	int64_t	_start;
+	int64_t	_end;
+};
+
+struct ThreadProfile
+{
+	static const int32_t MAX_DEPTH = 64;	// deeper bounces are counted in the last bucket
+
+	uint32_t	_thread_index = 0;
+	uint64_t	_counters[(int)ProfileCounter::Count] = {};
+	uint64_t	_rays_per_depth[MAX_DEPTH] = {};
+	std::vector<TileTraceEvent>	_tiles;
+
+	inline void count(ProfileCounter counter, uint64_t n) { _counters[(int)counter] += n; }
+	inline void ray(int32_t depth, uint64_t n) { _rays_per_depth[std::min(depth, MAX_DEPTH - 1)] += n; }
+};
+
+class Profiler
+{
+public:
+	static Profiler& instance() {
+		static Profiler profiler;
+		return profiler;
+	}
+
+	// the calling thread's profile, created on first use. profiles are owned by the profiler so they
+	// survive the pool threads that filled them
+	static ThreadProfile& thread() {
+		static thread_local ThreadProfile* profile = instance().register_thread();
+		return *profile;
+	}
+
+	inline int64_t now() const {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _epoch).count();
+	}
+
+	// sums of all threads, call once the workers are idle
+	ThreadProfile merged() const;
+
+	// zeroes every thread's counters and drops the recorded tiles
+	void reset();
+
+	void report(std::ostream& out) const;
+	bool write_trace(const char* path) const;
+
+private:
+	Profiler() : _epoch(std::chrono::steady_clock::now()) {}
+
+	ThreadProfile* register_thread() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_threads.emplace_back(new ThreadProfile());
+		_threads.back()->_thread_index = (uint32_t)(_threads.size() - 1);
+		return _threads.back().get();
+	}
+
+	std::chrono::steady_clock::time_point _epoch;
+	mutable std::mutex _mutex;
+	std::vector<std::unique_ptr<ThreadProfile>> _threads;
+};
+
+ThreadProfile Profiler::merged() const
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	ThreadProfile total;
+	for (const auto& t : _threads) {
+		for (int i = 0; i < (int)ProfileCounter::Count; i++)
+			total._counters[i] += t->_counters[i];
+		for (int i = 0; i < ThreadProfile::MAX_DEPTH; i++)
+			total._rays_per_depth[i] += t->_rays_per_depth[i];
+		total._tiles.insert(total._tiles.end(), t->_tiles.begin(), t->_tiles.end());
+	}
+	return total;
+}
+
+void Profiler::reset()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (auto& t : _threads) {
+		std::fill(std::begin(t->_counters), std::end(t->_counters), 0);
+		std::fill(std::begin(t->_rays_per_depth), std::end(t->_rays_per_depth), 0);
+		t->_tiles.clear();
+	}
+}
+
+void Profiler::report(std::ostream& out) const
+{
+#if defined(SPUD_PROFILE)
+	static const char* names[] = {
+		"bvh nodes", "sphere tests", "object tests", "packet nodes", "packet nodes culled",
+		"scatter lambertian", "scatter metal", "scatter dielectric", "scatter custom",
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == (size_t)ProfileCounter::Count, "a counter is missing its name");
+
+	ThreadProfile total = merged();
+	uint64_t rays = 0;
+	for (uint64_t n : total._rays_per_depth)
+		rays += n;
+	double per_ray = rays > 0 ? 1.0 / (double)rays : 0.0;
+
+	out << "rays " << rays << "\n";
+	for (int i = 0; i < (int)ProfileCounter::Count; i++)
+		out << names[i] << " " << total._counters[i] << " (" << total._counters[i] * per_ray << " per ray)\n";
+
+	out << "rays per depth";
+	int32_t last = ThreadProfile::MAX_DEPTH - 1;
+	while (last > 0 && total._rays_per_depth[last] == 0)
+		last--;
+	for (int32_t d = 0; d <= last; d++)
+		out << " " << total._rays_per_depth[d];
+	out << "\n";
+
+	// per thread busy time is what shows load imbalance on the pool
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (const auto& t : _threads) {
+		if (t->_tiles.empty())
+			continue;
+		int64_t busy = 0;
+		for (const TileTraceEvent& e : t->_tiles)
+			busy += e._end - e._start;
+		out << "thread " << t->_thread_index << ": " << t->_tiles.size() << " tile(s), " << busy / 1000.0 << " ms busy\n";
+	}
+#else
+	out << "profiling is disabled, build with SPUD_PROFILE\n";
+#endif
+}
+
+// chrome trace event format, load the file in chrome://tracing or perfetto. one complete event per
+// tile on the thread that rendered it
+bool Profiler::write_trace(const char* path) const
+{
+	std::ofstream out(path, std::ios::out | std::ios::trunc);
+	if (!out.is_open())
+		return false;
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	out << "{\"traceEvents\":[\n";
+	bool first = true;
+	for (const auto& t : _threads) {
+		if (t->_tiles.empty())
+			continue;
+		out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t->_thread_index
+			<< ",\"args\":{\"name\":\"worker " << t->_thread_index << "\"}}";
+		first = false;
+		for (const TileTraceEvent& e : t->_tiles) {
+			out << ",\n{\"name\":\"tile " << e._x0 << "," << e._y0 << "\",\"cat\":\"tile\",\"ph\":\"X\",\"pid\":0,\"tid\":" << t->_thread_index
+				<< ",\"ts\":" << e._start << ",\"dur\":" << e._end - e._start
+				<< ",\"args\":{\"x0\":" << e._x0 << ",\"y0\":" << e._y0 << ",\"x1\":" << e._x1 << ",\"y1\":" << e._y1 << "}}";
+		}
+	}
+	out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	return out.good();
+}
+
+#if defined(SPUD_PROFILE)
+
+// records the lifetime of the scope as one tile event of the calling thread
+class TileTraceScope
+{
+public:
+	template <typename TileT>
+	explicit TileTraceScope(const TileT& tile) : _start(Profiler::instance().now()) {
+		_event._x0 = tile._x0;
+		_event._y0 = tile._y0;
+		_event._x1 = tile._x1;
+		_event._y1 = tile._y1;
+	}
+
+	~TileTraceScope() {
+		_event._start = _start;
+		_event._end = Profiler::instance().now();
+		Profiler::thread()._tiles.push_back(_event);
+	}
+
+private:
+	int64_t _start;
+	TileTraceEvent _event;
+};
+
+#define SPUD_COUNT(counter) Profiler::thread().count(ProfileCounter::counter, 1)
+#define SPUD_COUNT_N(counter, n) Profiler::thread().count(ProfileCounter::counter, (uint64_t)(n))
+#define SPUD_COUNT_SCATTER(kind, n) Profiler::thread().count((ProfileCounter)((int)ProfileCounter::ScatterLambertian + (int)(kind)), (uint64_t)(n))
+#define SPUD_COUNT_RAYS(depth, n) Profiler::thread().ray((depth), (uint64_t)(n))
+#define SPUD_TRACE_TILE(tile) TileTraceScope spud_tile_trace_scope(tile)
+
+#else
+
+#define SPUD_COUNT(counter) ((void)0)
+#define SPUD_COUNT_N(counter, n) ((void)0)
+#define SPUD_COUNT_SCATTER(kind, n) ((void)0)
+#define SPUD_COUNT_RAYS(depth, n) ((void)0)
+#define SPUD_TRACE_TILE(tile) ((void)0)
+
+#endif
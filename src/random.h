@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+// 64 bit mixing function (splitmix64 finalizer), used to turn pixel coordinates into seeds
+inline uint64_t mix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+// PCG32 (XSH RR variant), small, fast and lock free. Every pixel owns a generator
+// derived from the frame seed so the image doesn't depend on which thread rendered what
+class Rng
+{
+public:
+	Rng() { seed(0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull); }
+	explicit Rng(uint64_t initstate, uint64_t initseq = 0xda3e39cb94b95bdbull) { seed(initstate, initseq); }
+
+	// hash of the frame seed and a pixel, what the per pixel streams are derived from
+	static inline uint64_t pixel_key(uint64_t frame_seed, uint32_t x, uint32_t y) {
+		return mix64(frame_seed ^ mix64(((uint64_t)y << 32) | x));
+	}
+
+	// generator for one pixel of one pass, all samples of the pass are drawn from it in order
+	static Rng for_pixel(uint64_t frame_seed, uint32_t x, uint32_t y, uint32_t pass = 0) {
+		uint64_t key = pixel_key(frame_seed, x, y);
+		return Rng(mix64(key + pass), key);
+	}
+
+	void seed(uint64_t initstate, uint64_t initseq) {
+		_state = 0u;
+		_inc = (initseq << 1u) | 1u;
+		next_uint();
+		_state += initstate;
+		next_uint();
+	}
+
+	inline uint32_t next_uint() {
+		uint64_t oldstate = _state;
+		_state = oldstate * 6364136223846793005ull + _inc;
+		uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+		uint32_t rot = (uint32_t)(oldstate >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+
+	// uniform float in [0, 1), uses the top 24 bits so the result never rounds up to 1
+	inline float next_float() {
+		return (next_uint() >> 8) * (1.0f / 16777216.0f);
+	}
+
+private:
+	uint64_t _state;
+	uint64_t _inc;
+};
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "integrator.h"
+#include "film.h"
+#include "tiles.h"
+#include "threadqueue.h"
+
+// jittered camera ray through pixel (i, j) for the sample sampler was started on
+inline ray camera_ray(const SceneInfo& scene, float nx, float ny, int32_t j, int32_t i, Sampler& sampler)
+{
+	float du, dv;
+	sampler.get_2d(du, dv);
+	float u = (i + du) / nx;
+	float v = (j + dv) / ny;
+	return scene._camera->getRay(u, v, sampler);
+}
+
+// one jittered camera sample through pixel (i, j), the sample sampler was started on
+inline vector3 sample_pixel(const SceneInfo& scene, float nx, float ny, int32_t j, int32_t i, Sampler& sampler, FirstHit* first_hit = nullptr)
+{
+	ray r = camera_ray(scene, nx, ny, j, i, sampler);
+	return color(r, *scene._world, scene._max_depth, scene._rr_depth, sampler, first_hit);
+}
+
+// adds the pixel's samples to film, features, when set, receives the first hit averaged over them
+void process_ray(const SceneInfo& scene, float nx, float ny, float ns, int32_t j, int32_t i, Film& film, FirstHit* features = nullptr)
+{
+	// the samples only depend on the pixel and their index, so the result is the same for any thread count
+	Sampler sampler(scene._sampler, scene._seed, (uint32_t)i, (uint32_t)j, (uint32_t)scene._samples);
+
+	vector3 col(0.f, 0.f, 0.f);
+	float lum_sum = 0.0f;
+	float lum_sq_sum = 0.0f;
+	FirstHit feature_sum = { vector3::ZERO, vector3::ZERO, 0.0f };
+	FirstHit hit;
+	for (int s = 0; s < (int)scene._samples; s++)
+	{
+		sampler.start_sample((uint32_t)s);
+		vector3 sample = sample_pixel(scene, nx, ny, j, i, sampler, features ? &hit : nullptr);
+		float lum = luminance(sample);
+		col += sample;
+		lum_sum += lum;
+		lum_sq_sum += lum * lum;
+		if (features)
+			feature_sum.add(hit);
+	}
+
+	// the film keeps linear sums, the mean and gamma are applied when the image is resolved and written
+	film.add(i, scene._height - 1 - j, col, lum_sum, lum_sq_sum, (uint32_t)scene._samples);
+	if (features) {
+		feature_sum.scale(1.0f / ns);
+		*features = feature_sum;
+	}
+}
+
+// traces the samples of n <= RayPacket::MAX pixels, given by their film coordinates, sample s of all
+// of them going out as one packet of camera rays. the bounces after the first hit are single rays
+// again. each pixel keeps its own sampler and sums, so the image is the same as with single camera
+// rays. features and gbuffer, when set, are width * height buffers
+void render_block(const SceneInfo& scene, const int32_t* xs, const int32_t* ys, uint32_t n, float nx, float ny, float ns,
+	Film& film, FirstHit* features = nullptr, GBufferPixel* gbuffer = nullptr)
+{
+	RayPacket packet;
+	Sampler samplers[RayPacket::MAX];
+	HitRecord recs[RayPacket::MAX];
+	bool hits[RayPacket::MAX];
+	int32_t js[RayPacket::MAX];
+	vector3 col[RayPacket::MAX];
+	float lum_sum[RayPacket::MAX], lum_sq_sum[RayPacket::MAX];
+	FirstHit feature_sum[RayPacket::MAX];
+	PathFootprint* footprints[RayPacket::MAX];
+	FirstHit hit;
+
+	for (uint32_t k = 0; k < n; k++) {
+		// film rows go top to bottom while j counts up from the bottom of the image
+		js[k] = scene._height - 1 - ys[k];
+		samplers[k] = Sampler(scene._sampler, scene._seed, (uint32_t)xs[k], (uint32_t)js[k], (uint32_t)scene._samples);
+		col[k] = vector3::ZERO;
+		lum_sum[k] = 0.0f;
+		lum_sq_sum[k] = 0.0f;
+		feature_sum[k] = FirstHit{ vector3::ZERO, vector3::ZERO, 0.0f };
+		footprints[k] = nullptr;
+		if (gbuffer) {
+			footprints[k] = &gbuffer[(size_t)ys[k] * scene._width + xs[k]]._footprint;
+			footprints[k]->clear();
+		}
+	}
+
+	for (int s = 0; s < (int)scene._samples; s++)
+	{
+		packet.reset();
+		for (uint32_t k = 0; k < n; k++) {
+			samplers[k].start_sample((uint32_t)s);
+			packet.add(camera_ray(scene, nx, ny, js[k], xs[k], samplers[k]));
+		}
+		packet.finish();
+		SPUD_COUNT_RAYS(0, n);
+		scene._world->hit_packet(packet, 0.001f, recs, hits);
+
+		for (uint32_t k = 0; k < n; k++) {
+			if (gbuffer && s == 0) {
+				GBufferPixel& g = gbuffer[(size_t)ys[k] * scene._width + xs[k]];
+				g._object = hits[k] ? recs[k].object : GBufferPixel::MISS;
+				g._material = hits[k] ? recs[k].mat_id : MaterialHandle::none();
+				g._position = hits[k] ? recs[k].p : vector3::ZERO;
+				g._normal = hits[k] ? unit_vector(recs[k].normal) : vector3::ZERO;
+			}
+			vector3 sample = continue_path(packet.get(k), hits[k], recs[k], *scene._world, scene._max_depth, scene._rr_depth,
+				samplers[k], features ? &hit : nullptr, footprints[k]);
+			float lum = luminance(sample);
+			col[k] += sample;
+			lum_sum[k] += lum;
+			lum_sq_sum[k] += lum * lum;
+			if (features)
+				feature_sum[k].add(hit);
+		}
+	}
+
+	for (uint32_t k = 0; k < n; k++) {
+		film.add(xs[k], ys[k], col[k], lum_sum[k], lum_sq_sum[k], (uint32_t)scene._samples);
+		if (features) {
+			feature_sum[k].scale(1.0f / ns);
+			features[(size_t)ys[k] * scene._width + xs[k]] = feature_sum[k];
+		}
+	}
+}
+
+// render_tile for blocks of scene._packet_size squared pixels, each traced by render_block
+void render_tile_packets(const SceneInfo& scene, const Tile& tile, float nx, float ny, float ns, Film& film, FirstHit* features = nullptr)
+{
+	const int32_t edge = scene._packet_size;
+	int32_t xs[RayPacket::MAX], ys[RayPacket::MAX];
+
+	for (int32_t by = tile._y0; by < tile._y1; by += edge)
+	{
+		for (int32_t bx = tile._x0; bx < tile._x1; bx += edge)
+		{
+			uint32_t n = 0;
+			for (int32_t y = by; y < std::min(by + edge, tile._y1); y++) {
+				for (int32_t x = bx; x < std::min(bx + edge, tile._x1); x++) {
+					xs[n] = x;
+					ys[n] = y;
+					n++;
+				}
+			}
+			render_block(scene, xs, ys, n, nx, ny, ns, film, features);
+		}
+	}
+}
+
+void render_tile(const SceneInfo& scene, const Tile& tile, float nx, float ny, float ns, Film& film, FirstHit* features = nullptr)
+{
+	if (scene._packet_size > 0) {
+		render_tile_packets(scene, tile, nx, ny, ns, film, features);
+		return;
+	}
+
+	for (int32_t y = tile._y0; y < tile._y1; y++)
+	{
+		// film rows go top to bottom while j counts up from the bottom of the image
+		int32_t j = scene._height - 1 - y;
+		size_t row = (size_t)y * scene._width;
+		for (int32_t i = tile._x0; i < tile._x1; i++)
+		{
+			process_ray(scene, nx, ny, ns, j, i, film, features ? features + row + i : nullptr);
+		}
+	}
+}
+
+// adds scene._samples samples per pixel of region to film. on_tile, when set, is called from the worker
+// right after a tile is finished. features, when set, is a width * height buffer that receives the
+// first hit guides for the denoiser
+void thread_process(ThreadPool& pool, const SceneInfo& scene, const Tile& region, Film& film,
+	const std::function<void(const Tile&)>& on_tile = nullptr, FirstHit* features = nullptr)
+{
+	float nx = scene._width * 1.0f;
+	float ny = scene._height * 1.0f;
+	float ns = scene._samples * 1.0f;
+
+	for_each_tile(pool, region, scene._tile_size, [&](const Tile& tile) {
+		render_tile(scene, tile, nx, ny, ns, film, features);
+		flush_ray_count();
+		if (on_tile)
+			on_tile(tile);
+	});
+}
+
+inline void thread_process(ThreadPool& pool, const SceneInfo& scene, Film& film,
+	const std::function<void(const Tile&)>& on_tile = nullptr, FirstHit* features = nullptr)
+{
+	thread_process(pool, scene, Tile{ 0, 0, scene._width, scene._height }, film, on_tile, features);
+}
+
+struct ProgressiveSettings
+{
+	int32_t	_pass_samples;	// samples added to every unconverged pixel per pass
+	int32_t	_min_samples;	// a pixel is never considered converged below this
+	float	_threshold;		// relative standard error of the pixel luminance that counts as converged, 0 disables
+	double	_time_budget;	// seconds, no new pass is started once it is used up, 0 means no limit
+};
+
+inline bool pixel_converged(const FilmPixel& px, const ProgressiveSettings& settings)
+{
+	if (settings._threshold <= 0.0f || px._samples == 0 || (int32_t)px._samples < settings._min_samples)
+		return false;
+	float n = (float)px._samples;
+	float mean = px._lum_sum / n;
+	float variance = std::max(0.0f, (px._lum_sq_sum - n * mean * mean) / (n - 1.0f));
+	float error = sqrtf(variance / n) / std::max(mean, 1e-3f);
+	return error < settings._threshold;
+}
+
+// renders in passes of _pass_samples until every pixel is below the noise threshold, scene._samples
+// samples were taken or the time budget ran out. the passes accumulate in film and continue from
+// film.passes(), so a film loaded from a checkpoint resumes the render. on_pass(pass, active_pixels)
+// is called after every pass, e.g. to write an intermediate frame or a checkpoint. returns the number
+// of samples taken by this call. features, when set, receives the denoiser guides averaged over the
+// samples of the first pass it runs
+int64_t progressive_process(ThreadPool& pool, const SceneInfo& scene, const ProgressiveSettings& settings, Film& film,
+	const std::function<void(int32_t, int64_t)>& on_pass = nullptr, FirstHit* features = nullptr)
+{
+	float nx = scene._width * 1.0f;
+	float ny = scene._height * 1.0f;
+	int32_t pass_samples = std::max(1, settings._pass_samples);
+	int32_t passes = (scene._samples + pass_samples - 1) / pass_samples;
+	int32_t first_pass = film.passes();
+
+	int64_t total_samples = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (int32_t pass = first_pass; pass < passes; pass++)
+	{
+		int32_t samples = std::min(pass_samples, scene._samples - pass * pass_samples);
+		std::atomic<int64_t> active(0);
+		std::atomic<int64_t> unconverged(0);
+
+		for_each_tile(pool, scene._width, scene._height, scene._tile_size, [&](const Tile& tile) {
+			int64_t tile_active = 0;
+			int64_t tile_unconverged = 0;
+			for (int32_t y = tile._y0; y < tile._y1; y++)
+			{
+				int32_t j = scene._height - 1 - y;
+				for (int32_t i = tile._x0; i < tile._x1; i++)
+				{
+					FilmPixel& px = film.pixel(i, y);
+					bool capture = features && pass == first_pass;
+					// pixels that converged before a resume are only traced for their features
+					bool converged = pixel_converged(px, settings);
+					if (converged && !capture)
+						continue;
+
+					// sample indices run on across passes, the passes draw the same samples a single
+					// pass render of the pixel would
+					Sampler sampler(scene._sampler, scene._seed, (uint32_t)i, (uint32_t)j, (uint32_t)scene._samples);
+					FirstHit feature_sum = { vector3::ZERO, vector3::ZERO, 0.0f };
+					FirstHit hit;
+					for (int32_t s = 0; s < samples; s++)
+					{
+						sampler.start_sample((uint32_t)(pass * pass_samples + s));
+						vector3 col = sample_pixel(scene, nx, ny, j, i, sampler, capture ? &hit : nullptr);
+						if (capture)
+							feature_sum.add(hit);
+						if (converged)
+							continue;
+						float lum = luminance(col);
+						px._sum += col;
+						px._lum_sum += lum;
+						px._lum_sq_sum += lum * lum;
+					}
+					if (capture) {
+						feature_sum.scale(1.0f / samples);
+						features[(size_t)y * scene._width + i] = feature_sum;
+					}
+					if (converged)
+						continue;
+					px._samples += samples;
+					tile_active++;
+					if (!pixel_converged(px, settings))
+						tile_unconverged++;
+				}
+			}
+			active += tile_active;
+			unconverged += tile_unconverged;
+			flush_ray_count();
+		});
+
+		film.set_passes(pass + 1);
+		total_samples += active.load() * samples;
+		if (on_pass)
+			on_pass(pass, active.load());
+
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		if (unconverged.load() == 0 || (settings._time_budget > 0.0 && elapsed.count() >= settings._time_budget))
+			break;
+	}
+	return total_samples;
+}
@@ -3,23 +3,23 @@
 
 #pragma once
 
+#include <deque>
 #include <mutex>
-#include <queue>
 
-// Thread safe implementation of a Queue using a std::queue
+// Thread safe double ended queue. The owning worker pushes and pops at the back (LIFO, keeps
+// its own work cache warm) while other workers steal from the front (FIFO, oldest work first)
 template <typename T>
 class SafeQueue {
 private:
-	std::queue<T> m_queue;
+	std::deque<T> m_queue;
 	std::mutex m_mutex;
 public:
 	SafeQueue() {
 
 	}
 
-	SafeQueue(SafeQueue& other) {
-		//TODO:
-	}
+	SafeQueue(const SafeQueue&) = delete;
+	SafeQueue& operator=(const SafeQueue&) = delete;
 
 	~SafeQueue() {
 
@@ -33,14 +33,28 @@ public:
 
 	int size() {
 		std::unique_lock<std::mutex> lock(m_mutex);
-		return m_queue.size();
+		return (int)m_queue.size();
 	}
 
-	void enqueue(T& t) {
+	void enqueue(T&& t) {
 		std::unique_lock<std::mutex> lock(m_mutex);
-		m_queue.push(t);
+		m_queue.push_back(std::move(t));
+	}
+
+	// owner side
+	bool dequeue_back(T& t) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		if (m_queue.empty()) {
+			return false;
+		}
+		t = std::move(m_queue.back());
+
+		m_queue.pop_back();
+		return true;
 	}
 
+	// thief side
 	bool dequeue(T& t) {
 		std::unique_lock<std::mutex> lock(m_mutex);
 
@@ -49,7 +63,7 @@ public:
 		}
 		t = std::move(m_queue.front());
 
-		m_queue.pop();
+		m_queue.pop_front();
 		return true;
 	}
 };
\ No newline at end of file
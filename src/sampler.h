@@ -0,0 +1,368 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "random.h"
+
+enum class SamplerKind : uint8_t
+{
+	Random,		// independent PCG streams
+	Stratified,	// correlated multi-jittered, the pattern is sized for the pixel's sample count
+	Sobol,		// Owen scrambled Sobol, padded with a fresh scramble per dimension pair
+	BlueNoise,	// one scrambled Sobol sequence for all pixels, offset per pixel by a blue noise mask
+	Count
+};
+
+static const char* SAMPLER_NAMES[(int)SamplerKind::Count] = { "random", "stratified", "sobol", "bluenoise" };
+
+inline const char* sampler_name(SamplerKind kind) { return SAMPLER_NAMES[(int)kind]; }
+
+inline bool parse_sampler(const char* name, SamplerKind& kind)
+{
+	for (int k = 0; k < (int)SamplerKind::Count; k++) {
+		if (strcmp(name, SAMPLER_NAMES[k]) == 0) {
+			kind = (SamplerKind)k;
+			return true;
+		}
+	}
+	return false;
+}
+
+// the numbers one pixel sample consumes, addressed by dimension so every sample of a pixel draws
+// the same quantity from the same dimension. a sample starts with the pixel jitter and the lens,
+// then every bounce owns BOUNCE_DIMENSIONS of them starting at bounce_dimension(depth).
+// a value type, each path carries its own
+class Sampler
+{
+public:
+	static const uint32_t CAMERA_DIMENSIONS = 4;	// pixel jitter, lens
+	static const uint32_t BOUNCE_DIMENSIONS = 4;	// up to three for the material, one for the roulette
+	static const uint32_t ROULETTE_DIMENSION = 3;	// within a bounce
+
+	Sampler() = default;
+	Sampler(SamplerKind kind, uint64_t frame_seed, uint32_t x, uint32_t y, uint32_t samples_per_pixel);
+
+	// index counts across passes, it is what makes the samples of a pixel different
+	void start_sample(uint32_t index);
+
+	static inline uint32_t bounce_dimension(int32_t depth) {
+		return CAMERA_DIMENSIONS + (uint32_t)depth * BOUNCE_DIMENSIONS;
+	}
+	inline void start_dimension(uint32_t dimension) { _dimension = dimension; }
+
+	// uniform in [0, 1)
+	float get_1d();
+	void get_2d(float& u, float& v);
+
+private:
+	static inline float wrap(float x) { return x >= 1.0f ? x - 1.0f : x; }
+	float blue_noise(uint32_t dimension, uint32_t shift) const;
+	uint32_t stratum_seed(uint32_t dimension) const;
+	float stratified_1d(uint32_t dimension) const;
+	void stratified_2d(uint32_t dimension, float& u, float& v) const;
+
+	SamplerKind _kind = SamplerKind::Random;
+	uint64_t _frame_seed = 0;
+	uint64_t _pixel_key = 0;
+	uint32_t _x = 0;
+	uint32_t _y = 0;
+	uint32_t _samples = 1;
+	uint32_t _index = 0;
+	uint32_t _dimension = 0;
+	Rng _rng;
+};
+
+// --- integer hashing and permutations
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// nested uniform (owen) scramble of the bits of x, seeded by seed. the hash only lets bits flow
+// from low to high, on reversed bits that makes every bit depend on the ones above it only
+// (laine and karras, "stratified sampling for stochastic transparency")
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+// first two dimensions of the sobol sequence as 32 bit fractions
+inline uint32_t sobol_0(uint32_t index) { return reverse_bits(index); }
+
+inline uint32_t sobol_1(uint32_t index)
+{
+	uint32_t result = 0;
+	for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+		if (index & 1)
+			result ^= v;
+	}
+	return result;
+}
+
+// largest float below 1
+static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+inline float fraction_to_float(uint32_t x) { return (x >> 8) * (1.0f / 16777216.0f); }
+
+// random permutation of [0, length) evaluated one element at a time (kensler, "correlated multi-jittered sampling")
+inline uint32_t permute(uint32_t i, uint32_t length, uint32_t p)
+{
+	uint32_t w = length - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p;
+		i *= 0xe170893du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303u;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= length);
+	return (i + p) % length;
+}
+
+inline float hash_float(uint32_t i, uint32_t p)
+{
+	i ^= p;
+	i ^= i >> 17;
+	i ^= i >> 10;
+	i *= 0xb36534e5u;
+	i ^= i >> 12;
+	i ^= i >> 21;
+	i *= 0x93fc4795u;
+	i ^= 0xdf6e307fu;
+	i ^= i >> 17;
+	i *= 1 | p >> 18;
+	return fraction_to_float(i);
+}
+
+// --- blue noise
+
+// side of the tiled blue noise mask
+static const uint32_t BLUE_NOISE_SIZE = 64;
+
+// blue noise mask made with void and cluster (ulichney 1993): every pixel's rank in [0, size^2),
+// neighbouring pixels get far apart ranks. built once on first use, the same on every machine
+const std::vector<uint16_t>& blue_noise_mask()
+{
+	static const std::vector<uint16_t> mask = []() {
+		const int32_t n = (int32_t)BLUE_NOISE_SIZE;
+		const int32_t count = n * n;
+		const float sigma = 1.5f;
+
+		// gaussian falloff by wrapped offset, the mask tiles
+		std::vector<float> kernel(count);
+		for (int32_t y = 0; y < n; y++) {
+			for (int32_t x = 0; x < n; x++) {
+				int32_t dx = std::min(x, n - x);
+				int32_t dy = std::min(y, n - y);
+				kernel[y * n + x] = expf(-(float)(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+			}
+		}
+
+		std::vector<uint8_t> on(count, 0);
+		std::vector<float> energy(count, 0.0f);
+		auto toggle = [&](int32_t p, bool set) {
+			on[p] = set ? 1 : 0;
+			float sign = set ? 1.0f : -1.0f;
+			int32_t px = p % n, py = p / n;
+			for (int32_t y = 0; y < n; y++) {
+				const float* row = &kernel[((y - py + n) % n) * n];
+				for (int32_t x = 0; x < n; x++)
+					energy[y * n + x] += sign * row[(x - px + n) % n];
+			}
+		};
+		// tightest cluster among the set pixels, or largest void among the clear ones
+		auto extreme = [&](bool set) {
+			int32_t best = -1;
+			for (int32_t p = 0; p < count; p++) {
+				if (on[p] != (set ? 1 : 0))
+					continue;
+				if (best < 0 || (set ? energy[p] > energy[best] : energy[p] < energy[best]))
+					best = p;
+			}
+			return best;
+		};
+
+		// random initial pattern, relaxed by moving the tightest cluster into the largest void
+		Rng rng(0x5eed);
+		int32_t initial = count / 10;
+		for (int32_t placed = 0; placed < initial; ) {
+			int32_t p = (int32_t)(rng.next_uint() % (uint32_t)count);
+			if (!on[p]) {
+				toggle(p, true);
+				placed++;
+			}
+		}
+		for (int32_t iteration = 0; iteration < count; iteration++) {
+			int32_t cluster = extreme(true);
+			toggle(cluster, false);
+			int32_t gap = extreme(false);
+			toggle(gap, true);
+			if (gap == cluster)
+				break;
+		}
+
+		std::vector<uint16_t> rank(count);
+		std::vector<uint8_t> pattern = on;
+		std::vector<float> pattern_energy = energy;
+		for (int32_t r = initial - 1; r >= 0; r--) {
+			int32_t p = extreme(true);
+			toggle(p, false);
+			rank[p] = (uint16_t)r;
+		}
+		// the clear pixels with the lowest energy from the set ones are also the tightest clusters of
+		// clear pixels, so one criterion covers both the second and the third phase
+		on.swap(pattern);
+		energy.swap(pattern_energy);
+		for (int32_t r = initial; r < count; r++) {
+			int32_t p = extreme(false);
+			toggle(p, true);
+			rank[p] = (uint16_t)r;
+		}
+		return rank;
+	}();
+	return mask;
+}
+
+// owen scrambled sobol points, the index is shuffled with the same scramble so every seed gives
+// an independent sequence that keeps the stratification of its prefixes (burley, "practical hash
+// based owen scrambling")
+inline float sobol_owen_1d(uint32_t index, uint32_t seed)
+{
+	index = owen_scramble(index, seed);
+	return fraction_to_float(owen_scramble(sobol_0(index), seed * 0x9e3779b9u));
+}
+
+inline void sobol_owen_2d(uint32_t index, uint32_t seed, float& u, float& v)
+{
+	index = owen_scramble(index, seed);
+	u = fraction_to_float(owen_scramble(sobol_0(index), seed * 0x9e3779b9u));
+	v = fraction_to_float(owen_scramble(sobol_1(index), seed * 0x85ebca6bu));
+}
+
+// --- Sampler
+
+Sampler::Sampler(SamplerKind kind, uint64_t frame_seed, uint32_t x, uint32_t y, uint32_t samples_per_pixel)
+	: _kind(kind), _frame_seed(frame_seed), _pixel_key(Rng::pixel_key(frame_seed, x, y)), _x(x), _y(y),
+	_samples(std::max(1u, samples_per_pixel))
+{
+}
+
+void Sampler::start_sample(uint32_t index)
+{
+	_index = index;
+	_dimension = 0;
+	if (_kind == SamplerKind::Random)
+		_rng = Rng::for_pixel(_frame_seed, _x, _y, index);
+}
+
+float Sampler::get_1d()
+{
+	uint32_t d = _dimension++;
+	switch (_kind) {
+	case SamplerKind::Stratified:
+		return stratified_1d(d);
+	case SamplerKind::Sobol:
+		return sobol_owen_1d(_index, (uint32_t)mix64(_pixel_key + d));
+	case SamplerKind::BlueNoise:
+		// the sequence is the same for all pixels, the mask decorrelates neighbours
+		return wrap(sobol_owen_1d(_index, (uint32_t)mix64(_frame_seed + d)) + blue_noise(d, 0));
+	default:
+		return _rng.next_float();
+	}
+}
+
+void Sampler::get_2d(float& u, float& v)
+{
+	uint32_t d = _dimension;
+	_dimension += 2;
+	switch (_kind) {
+	case SamplerKind::Stratified:
+		stratified_2d(d, u, v);
+		break;
+	case SamplerKind::Sobol:
+		sobol_owen_2d(_index, (uint32_t)mix64(_pixel_key + d), u, v);
+		break;
+	case SamplerKind::BlueNoise:
+		sobol_owen_2d(_index, (uint32_t)mix64(_frame_seed + d), u, v);
+		// the second component reads the mask half a tile away, which is uncorrelated with the first
+		u = wrap(u + blue_noise(d, 0));
+		v = wrap(v + blue_noise(d, BLUE_NOISE_SIZE / 2));
+		break;
+	default:
+		u = _rng.next_float();
+		v = _rng.next_float();
+		break;
+	}
+}
+
+float Sampler::blue_noise(uint32_t dimension, uint32_t shift) const
+{
+	// every dimension reads the tiled mask at its own offset
+	const std::vector<uint16_t>& mask = blue_noise_mask();
+	uint32_t offset = (uint32_t)mix64(_frame_seed ^ ((uint64_t)dimension << 32));
+	uint32_t mx = (_x + shift + offset) % BLUE_NOISE_SIZE;
+	uint32_t my = (_y + shift + (offset >> 16)) % BLUE_NOISE_SIZE;
+	return (mask[my * BLUE_NOISE_SIZE + mx] + 0.5f) * (1.0f / (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE));
+}
+
+uint32_t Sampler::stratum_seed(uint32_t dimension) const
+{
+	// samples past the pattern size start another permutation of it
+	return (uint32_t)mix64(_pixel_key + dimension + ((uint64_t)(_index / _samples) << 32));
+}
+
+float Sampler::stratified_1d(uint32_t dimension) const
+{
+	uint32_t p = stratum_seed(dimension);
+	uint32_t s = _index % _samples;
+	return std::min((permute(s, _samples, p) + hash_float(s, p * 0x68bc21ebu)) / _samples, ONE_MINUS_EPSILON);
+}
+
+void Sampler::stratified_2d(uint32_t dimension, float& u, float& v) const
+{
+	// correlated multi-jittered: an m x n grid holding all samples of the pixel, jittered so the
+	// points are also stratified along each axis on their own
+	uint32_t p = stratum_seed(dimension);
+	uint32_t m = std::max(1u, (uint32_t)sqrtf((float)_samples));
+	uint32_t n = (_samples + m - 1) / m;
+	uint32_t s = permute(_index % _samples, _samples, p * 0x51633e2du);
+	uint32_t sx = permute(s % m, m, p * 0x68bc21ebu);
+	uint32_t sy = permute(s / m, n, p * 0x02e5be93u);
+	float jx = hash_float(s, p * 0x967a889bu);
+	float jy = hash_float(s, p * 0x368cc8b7u);
+	u = std::min((sx + (sy + jx) / n) / m, ONE_MINUS_EPSILON);
+	v = std::min((s + jy) / _samples, ONE_MINUS_EPSILON);
+}
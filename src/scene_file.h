@@ -0,0 +1,666 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "objects.h"
+#include "materials.h"
+#include "animation.h"
+
+// scene files come in two flavours.
+//
+// text (.spud), one statement per line, '#' starts a comment:
+//   resolution <width> <height>
+//   samples <n>
+//   max_depth <n>
+//   camera <from x y z> <at x y z> <up x y z> <vfov> <aperture> <focus distance>
+//   material <name> lambertian <r g b>
+//   material <name> metal <r g b> <fuzz>
+//   material <name> dielectric <index of refraction>
+//   sphere <x y z> <radius> <material name>
+//   key <time> camera <from x y z> <at x y z>
+//   key <time> sphere <index> <x y z>
+//
+// keys animate the camera and the spheres (index counts the sphere statements from 0), see Animation.
+// binary (.spdb), little endian, meant to be memory mapped: a SceneBinaryHeader, the material
+// records, then the sphere columns cx[], cy[], cz[], radius[] as floats and material[] as uint32.
+// the columns have the same layout as SphereSoA so loading is a bulk copy. binary scenes are static,
+// keys are only kept by the text format
+
+struct SceneSettings
+{
+	int32_t	_width = 1920;
+	int32_t	_height = 1080;
+	int32_t	_samples = 10;
+	int32_t	_max_depth = 50;
+	vector3	_lookfrom = vector3(13.0f, 2.0f, 3.0f);
+	vector3	_lookat = vector3(0.0f, 0.0f, 0.0f);
+	vector3	_vup = vector3(0.0f, 1.0f, 0.0f);
+	float	_vfov = 20.0f;
+	float	_aperture = 0.1f;
+	float	_focus_dist = 10.0f;
+};
+
+// largest image edge a scene may ask for, beyond it the file is taken as corrupt
+static const int32_t SCENE_MAX_EDGE = 16384;
+
+// false with the reason when a scene's render settings can't be rendered
+bool check_settings(const SceneSettings& settings, std::string& error)
+{
+	if (settings._width <= 0 || settings._height <= 0 || settings._width > SCENE_MAX_EDGE || settings._height > SCENE_MAX_EDGE) {
+		error = "resolution " + std::to_string(settings._width) + "x" + std::to_string(settings._height)
+			+ " is out of range (1 to " + std::to_string(SCENE_MAX_EDGE) + ")";
+		return false;
+	}
+	if (settings._samples <= 0) {
+		error = "samples have to be positive, not " + std::to_string(settings._samples);
+		return false;
+	}
+	if (settings._max_depth < 0) {
+		error = "max_depth can't be negative";
+		return false;
+	}
+	return true;
+}
+
+// "WxH", both positive
+bool parse_resolution(const char* text, int32_t& width, int32_t& height)
+{
+	char* end = nullptr;
+	width = (int32_t)strtol(text, &end, 10);
+	if (*end != 'x')
+		return false;
+	height = (int32_t)strtol(end + 1, &end, 10);
+	return *end == '\0' && width > 0 && height > 0;
+}
+
+struct MaterialRecord
+{
+	uint32_t	_kind;		// MaterialKind, custom materials can't be stored
+	float	_params[4];	// lambertian: albedo, metal: albedo and fuzz, dielectric: index of refraction
+};
+
+struct SceneBinaryHeader
+{
+	char	_magic[4];
+	uint32_t	_version;
+	int32_t	_width;
+	int32_t	_height;
+	int32_t	_samples;
+	int32_t	_max_depth;
+	float	_camera[12];	// lookfrom, lookat, vup, vfov, aperture, focus distance
+	uint32_t	_material_count;
+	uint32_t	_sphere_count;
+};
+
+static const char SCENE_BINARY_MAGIC[4] = { 'S', 'P', 'D', 'B' };
+static const uint32_t SCENE_BINARY_VERSION = 1;
+
+// read only view of a file, memory mapped where the platform allows it
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	bool open(const char* path) {
+		close();
+#if defined(_WIN32)
+		_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (_file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_file, &size))
+			return false;
+		_size = (size_t)size.QuadPart;
+		if (_size == 0)
+			return true;
+		_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!_mapping)
+			return false;
+		_data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+		return _data != nullptr;
+#else
+		_fd = ::open(path, O_RDONLY);
+		if (_fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(_fd, &st) != 0)
+			return false;
+		_size = (size_t)st.st_size;
+		if (_size == 0)
+			return true;
+		void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+		if (data == MAP_FAILED)
+			return false;
+		_data = (const uint8_t*)data;
+		return true;
+#endif
+	}
+
+	void close() {
+#if defined(_WIN32)
+		if (_data)
+			UnmapViewOfFile(_data);
+		if (_mapping)
+			CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE)
+			CloseHandle(_file);
+		_mapping = nullptr;
+		_file = INVALID_HANDLE_VALUE;
+#else
+		if (_data)
+			munmap((void*)_data, _size);
+		if (_fd >= 0)
+			::close(_fd);
+		_fd = -1;
+#endif
+		_data = nullptr;
+		_size = 0;
+	}
+
+	inline const uint8_t* data() const { return _data; }
+	inline size_t size() const { return _size; }
+
+private:
+	const uint8_t* _data = nullptr;
+	size_t _size = 0;
+#if defined(_WIN32)
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+#else
+	int _fd = -1;
+#endif
+};
+
+// a parsed scene. the sphere columns either point into _storage (text files) or straight into
+// the mapped binary file, so they are only valid as long as the SceneFile and its mapping live
+class SceneFile
+{
+public:
+	SceneSettings _settings;
+	std::vector<MaterialRecord> _materials;
+	size_t _sphere_count = 0;
+	const float* _cx = nullptr;
+	const float* _cy = nullptr;
+	const float* _cz = nullptr;
+	const float* _radius = nullptr;
+	const uint32_t* _material = nullptr;
+	Animation _animation;
+
+	bool load(const char* path, std::string& error);
+	bool save(const char* path, std::string& error) const;
+
+	// parses the contents of a scene file that is already in memory. a binary scene keeps pointing
+	// into data, so data has to outlive the SceneFile
+	bool parse(const uint8_t* data, size_t size, std::string& error);
+
+	// creates the materials in the world and bulk loads the spheres, call World::build afterwards
+	void build_world(World& world) const;
+
+private:
+	bool parse_text(const char* text, std::string& error);
+	bool parse_binary(const uint8_t* data, size_t size, std::string& error);
+	// a material handle addresses at most INDEX_MASK + 1 materials of each kind
+	bool check_material_counts(std::string& error) const;
+	bool save_text(const char* path) const;
+	bool save_binary(const char* path) const;
+
+	MappedFile _file;
+	struct Columns
+	{
+		std::vector<float> _cx, _cy, _cz, _radius;
+		std::vector<uint32_t> _material;
+	} _storage;
+};
+
+inline bool scene_path_is_binary(const char* path)
+{
+	size_t len = strlen(path);
+	return len >= 5 && strcmp(path + len - 5, ".spdb") == 0;
+}
+
+inline bool scene_data_is_binary(const uint8_t* data, size_t size)
+{
+	return size >= sizeof(SCENE_BINARY_MAGIC) && memcmp(data, SCENE_BINARY_MAGIC, sizeof(SCENE_BINARY_MAGIC)) == 0;
+}
+
+bool SceneFile::load(const char* path, std::string& error)
+{
+	if (!_file.open(path)) {
+		error = std::string("can't open ") + path;
+		return false;
+	}
+	bool binary = scene_data_is_binary(_file.data(), _file.size());
+	bool ok = parse(_file.data(), _file.size(), error);
+	// text scenes are copied out of the mapping, only binary ones keep using it
+	if (!binary)
+		_file.close();
+	return ok;
+}
+
+bool SceneFile::parse(const uint8_t* data, size_t size, std::string& error)
+{
+	if (scene_data_is_binary(data, size))
+		return parse_binary(data, size, error);
+
+	// text needs a terminator for strtof, so it gets copied once
+	std::string text((const char*)data, size);
+	return parse_text(text.c_str(), error);
+}
+
+bool SceneFile::check_material_counts(std::string& error) const
+{
+	size_t counts[(int)MaterialKind::Count] = {};
+	for (const MaterialRecord& m : _materials) {
+		if (++counts[m._kind] > (size_t)MaterialHandle::INDEX_MASK + 1) {
+			error = "more than " + std::to_string((size_t)MaterialHandle::INDEX_MASK + 1) + " materials of one kind";
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SceneFile::parse_binary(const uint8_t* data, size_t size, std::string& error)
+{
+	if (size < sizeof(SceneBinaryHeader)) {
+		error = "truncated scene header";
+		return false;
+	}
+	SceneBinaryHeader header;
+	memcpy(&header, data, sizeof(header));
+	if (header._version != SCENE_BINARY_VERSION) {
+		error = "unsupported scene version " + std::to_string(header._version);
+		return false;
+	}
+
+	size_t materials_bytes = (size_t)header._material_count * sizeof(MaterialRecord);
+	size_t spheres_bytes = (size_t)header._sphere_count * (4 * sizeof(float) + sizeof(uint32_t));
+	if (size < sizeof(header) + materials_bytes + spheres_bytes) {
+		error = "truncated scene data";
+		return false;
+	}
+
+	_settings._width = header._width;
+	_settings._height = header._height;
+	_settings._samples = header._samples;
+	_settings._max_depth = header._max_depth;
+	const float* cam = header._camera;
+	_settings._lookfrom = vector3(cam[0], cam[1], cam[2]);
+	_settings._lookat = vector3(cam[3], cam[4], cam[5]);
+	_settings._vup = vector3(cam[6], cam[7], cam[8]);
+	_settings._vfov = cam[9];
+	_settings._aperture = cam[10];
+	_settings._focus_dist = cam[11];
+	if (!check_settings(_settings, error))
+		return false;
+
+	const uint8_t* p = data + sizeof(header);
+	_materials.resize(header._material_count);
+	memcpy(_materials.data(), p, materials_bytes);
+	p += materials_bytes;
+	for (const MaterialRecord& m : _materials) {
+		if (m._kind >= (uint32_t)MaterialKind::Custom) {
+			error = "unknown material kind " + std::to_string(m._kind);
+			return false;
+		}
+	}
+	if (!check_material_counts(error))
+		return false;
+
+	// every record so far is a multiple of 4 bytes, so the columns are float aligned in the mapping
+	size_t n = header._sphere_count;
+	_sphere_count = n;
+	_cx = (const float*)p;
+	_cy = _cx + n;
+	_cz = _cy + n;
+	_radius = _cz + n;
+	_material = (const uint32_t*)(_radius + n);
+	for (size_t i = 0; i < n; i++) {
+		if (_material[i] >= header._material_count) {
+			error = "sphere " + std::to_string(i) + " uses an undefined material";
+			return false;
+		}
+	}
+	return true;
+}
+
+// minimal tokenizer over a nul terminated buffer, keeps track of the line for error messages
+class SceneTokenizer
+{
+public:
+	explicit SceneTokenizer(const char* text) : _p(text) {}
+
+	// moves to the next token, returns false at the end of the buffer
+	bool next_token() {
+		while (*_p) {
+			if (*_p == '#') {
+				while (*_p && *_p != '\n')
+					_p++;
+			}
+			else if (*_p == '\n') {
+				_line++;
+				_p++;
+			}
+			else if (*_p == ' ' || *_p == '\t' || *_p == '\r') {
+				_p++;
+			}
+			else {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool word(std::string& out) {
+		if (!next_token())
+			return false;
+		const char* begin = _p;
+		while (*_p && *_p != ' ' && *_p != '\t' && *_p != '\r' && *_p != '\n' && *_p != '#')
+			_p++;
+		out.assign(begin, _p);
+		return true;
+	}
+
+	bool number(float& out) {
+		if (!next_token())
+			return false;
+		char* end;
+		out = strtof(_p, &end);
+		if (end == _p)
+			return false;
+		_p = end;
+		return true;
+	}
+
+	// whole decimal numbers in int32 range only, "2.7" or "1e20" are malformed rather than truncated
+	bool integer(int32_t& out) {
+		if (!next_token())
+			return false;
+		char* end;
+		errno = 0;
+		long v = strtol(_p, &end, 10);
+		if (end == _p || errno == ERANGE || v < INT32_MIN || v > INT32_MAX)
+			return false;
+		if (*end && *end != ' ' && *end != '\t' && *end != '\r' && *end != '\n' && *end != '#')
+			return false;
+		_p = end;
+		out = (int32_t)v;
+		return true;
+	}
+
+	bool vec(vector3& out) {
+		float x, y, z;
+		if (!number(x) || !number(y) || !number(z))
+			return false;
+		out = vector3(x, y, z);
+		return true;
+	}
+
+	inline int line() const { return _line; }
+
+private:
+	const char* _p;
+	int _line = 1;
+};
+
+bool SceneFile::parse_text(const char* text, std::string& error)
+{
+	SceneTokenizer tok(text);
+	std::unordered_map<std::string, uint32_t> material_names;
+	std::string keyword, name, kind;
+	bool ok = true;
+
+	while (ok && tok.word(keyword)) {
+		if (keyword == "resolution") {
+			ok = tok.integer(_settings._width) && tok.integer(_settings._height);
+		}
+		else if (keyword == "samples") {
+			ok = tok.integer(_settings._samples);
+		}
+		else if (keyword == "max_depth") {
+			ok = tok.integer(_settings._max_depth);
+		}
+		else if (keyword == "camera") {
+			ok = tok.vec(_settings._lookfrom) && tok.vec(_settings._lookat) && tok.vec(_settings._vup) &&
+				tok.number(_settings._vfov) && tok.number(_settings._aperture) && tok.number(_settings._focus_dist);
+		}
+		else if (keyword == "material") {
+			MaterialRecord m = {};
+			vector3 albedo;
+			ok = tok.word(name) && tok.word(kind);
+			if (ok && kind == "lambertian") {
+				m._kind = (uint32_t)MaterialKind::Lambertian;
+				ok = tok.vec(albedo);
+			}
+			else if (ok && kind == "metal") {
+				m._kind = (uint32_t)MaterialKind::Metal;
+				ok = tok.vec(albedo) && tok.number(m._params[3]);
+			}
+			else if (ok && kind == "dielectric") {
+				m._kind = (uint32_t)MaterialKind::Dielectric;
+				ok = tok.number(m._params[0]);
+			}
+			else if (ok) {
+				error = "line " + std::to_string(tok.line()) + ": unknown material type " + kind;
+				return false;
+			}
+			if (m._kind != (uint32_t)MaterialKind::Dielectric) {
+				m._params[0] = albedo.x();
+				m._params[1] = albedo.y();
+				m._params[2] = albedo.z();
+			}
+			material_names[name] = (uint32_t)_materials.size();
+			_materials.push_back(m);
+		}
+		else if (keyword == "sphere") {
+			vector3 c;
+			float r;
+			ok = tok.vec(c) && tok.number(r) && tok.word(name);
+			if (ok && (!std::isfinite(r) || r == 0.0f)) {
+				error = "line " + std::to_string(tok.line()) + ": sphere radius must be finite and non-zero";
+				return false;
+			}
+			if (ok) {
+				auto itr = material_names.find(name);
+				if (itr == material_names.end()) {
+					error = "line " + std::to_string(tok.line()) + ": undefined material " + name;
+					return false;
+				}
+				_storage._cx.push_back(c.x());
+				_storage._cy.push_back(c.y());
+				_storage._cz.push_back(c.z());
+				_storage._radius.push_back(r);
+				_storage._material.push_back(itr->second);
+			}
+		}
+		else if (keyword == "key") {
+			float time;
+			ok = tok.number(time) && tok.word(kind);
+			if (ok && kind == "camera") {
+				CameraKey key = { time, vector3::ZERO, vector3::ZERO };
+				ok = tok.vec(key._lookfrom) && tok.vec(key._lookat);
+				if (ok)
+					_animation.add_camera_key(key);
+			}
+			else if (ok && kind == "sphere") {
+				SphereKey key = { time, 0, vector3::ZERO };
+				int32_t index;
+				ok = tok.integer(index) && tok.vec(key._center);
+				if (ok && index < 0) {
+					error = "line " + std::to_string(tok.line()) + ": negative sphere index";
+					return false;
+				}
+				key._sphere = (uint32_t)index;
+				if (ok)
+					_animation.add_sphere_key(key);
+			}
+			else if (ok) {
+				error = "line " + std::to_string(tok.line()) + ": unknown key type " + kind;
+				return false;
+			}
+		}
+		else {
+			error = "line " + std::to_string(tok.line()) + ": unknown statement " + keyword;
+			return false;
+		}
+
+		bool setting = keyword == "resolution" || keyword == "samples" || keyword == "max_depth";
+		if (ok && setting && !check_settings(_settings, error)) {
+			error = "line " + std::to_string(tok.line()) + ": " + error;
+			return false;
+		}
+	}
+
+	if (!ok) {
+		error = "line " + std::to_string(tok.line()) + ": malformed " + keyword;
+		return false;
+	}
+	if (!check_material_counts(error))
+		return false;
+
+	_sphere_count = _storage._cx.size();
+	_cx = _storage._cx.data();
+	_cy = _storage._cy.data();
+	_cz = _storage._cz.data();
+	_radius = _storage._radius.data();
+	_material = _storage._material.data();
+
+	for (const SphereKey& key : _animation.sphere_keys()) {
+		if (key._sphere >= _sphere_count) {
+			error = "key for sphere " + std::to_string(key._sphere) + " but there are only " + std::to_string(_sphere_count);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SceneFile::save(const char* path, std::string& error) const
+{
+	bool ok = scene_path_is_binary(path) ? save_binary(path) : save_text(path);
+	if (!ok)
+		error = std::string("can't write ") + path;
+	return ok;
+}
+
+bool SceneFile::save_binary(const char* path) const
+{
+	SceneBinaryHeader header;
+	memcpy(header._magic, SCENE_BINARY_MAGIC, sizeof(SCENE_BINARY_MAGIC));
+	header._version = SCENE_BINARY_VERSION;
+	header._width = _settings._width;
+	header._height = _settings._height;
+	header._samples = _settings._samples;
+	header._max_depth = _settings._max_depth;
+	const vector3* v[3] = { &_settings._lookfrom, &_settings._lookat, &_settings._vup };
+	for (int i = 0; i < 3; i++) {
+		header._camera[3 * i] = v[i]->x();
+		header._camera[3 * i + 1] = v[i]->y();
+		header._camera[3 * i + 2] = v[i]->z();
+	}
+	header._camera[9] = _settings._vfov;
+	header._camera[10] = _settings._aperture;
+	header._camera[11] = _settings._focus_dist;
+	header._material_count = (uint32_t)_materials.size();
+	header._sphere_count = (uint32_t)_sphere_count;
+
+	std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!stream.is_open())
+		return false;
+	size_t n = _sphere_count;
+	stream.write((const char*)&header, sizeof(header));
+	stream.write((const char*)_materials.data(), _materials.size() * sizeof(MaterialRecord));
+	stream.write((const char*)_cx, n * sizeof(float));
+	stream.write((const char*)_cy, n * sizeof(float));
+	stream.write((const char*)_cz, n * sizeof(float));
+	stream.write((const char*)_radius, n * sizeof(float));
+	stream.write((const char*)_material, n * sizeof(uint32_t));
+	return stream.good();
+}
+
+bool SceneFile::save_text(const char* path) const
+{
+	std::ofstream stream(path, std::ios::out | std::ios::trunc);
+	if (!stream.is_open())
+		return false;
+	// enough digits to round trip a float
+	stream.precision(9);
+
+	const SceneSettings& s = _settings;
+	stream << "resolution " << s._width << " " << s._height << "\n";
+	stream << "samples " << s._samples << "\n";
+	stream << "max_depth " << s._max_depth << "\n";
+	stream << "camera " << s._lookfrom.x() << " " << s._lookfrom.y() << " " << s._lookfrom.z() << "  "
+		<< s._lookat.x() << " " << s._lookat.y() << " " << s._lookat.z() << "  "
+		<< s._vup.x() << " " << s._vup.y() << " " << s._vup.z() << "  "
+		<< s._vfov << " " << s._aperture << " " << s._focus_dist << "\n";
+
+	for (size_t i = 0; i < _materials.size(); i++) {
+		const MaterialRecord& m = _materials[i];
+		stream << "material m" << i << " ";
+		switch ((MaterialKind)m._kind) {
+		case MaterialKind::Lambertian:
+			stream << "lambertian " << m._params[0] << " " << m._params[1] << " " << m._params[2] << "\n";
+			break;
+		case MaterialKind::Metal:
+			stream << "metal " << m._params[0] << " " << m._params[1] << " " << m._params[2] << " " << m._params[3] << "\n";
+			break;
+		default:
+			stream << "dielectric " << m._params[0] << "\n";
+			break;
+		}
+	}
+	for (size_t i = 0; i < _sphere_count; i++) {
+		stream << "sphere " << _cx[i] << " " << _cy[i] << " " << _cz[i] << " " << _radius[i] << " m" << _material[i] << "\n";
+	}
+	for (const CameraKey& key : _animation.camera_keys()) {
+		stream << "key " << key._time << " camera " << key._lookfrom.x() << " " << key._lookfrom.y() << " " << key._lookfrom.z() << "  "
+			<< key._lookat.x() << " " << key._lookat.y() << " " << key._lookat.z() << "\n";
+	}
+	for (const SphereKey& key : _animation.sphere_keys()) {
+		stream << "key " << key._time << " sphere " << key._sphere << " "
+			<< key._center.x() << " " << key._center.y() << " " << key._center.z() << "\n";
+	}
+	return stream.good();
+}
+
+void SceneFile::build_world(World& world) const
+{
+	std::vector<MaterialHandle> materials;
+	materials.reserve(_materials.size());
+	for (const MaterialRecord& m : _materials) {
+		vector3 albedo(m._params[0], m._params[1], m._params[2]);
+		switch ((MaterialKind)m._kind) {
+		case MaterialKind::Lambertian:
+			materials.push_back(world.add_material<Lambertian>(albedo));
+			break;
+		case MaterialKind::Metal:
+			materials.push_back(world.add_material<Metal>(albedo, m._params[3]));
+			break;
+		default:
+			materials.push_back(world.add_material<Dielectric>(m._params[0]));
+			break;
+		}
+	}
+	world.add_spheres(_sphere_count, _cx, _cy, _cz, _radius, _material, materials.data());
+}
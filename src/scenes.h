@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "objects.h"
+#include "materials.h"
+#include "random.h"
+#include "scene_file.h"
+
+void sample_scene(World& world)
+{
+	world.add_sphere(vector3(0.0f, 0.0f, -1.0f), 0.5f,
+		world.add_material<Lambertian>(vector3(0.1f, 0.2f, 0.5f)));
+	world.add_sphere(vector3(0.0f, -100.5f, -1.0f), 100.f,
+		world.add_material<Lambertian>(vector3(.8f, 0.8f, 0.0f)));
+	world.add_sphere(vector3(1.0f, 0.0f, -1.0f), 0.5f,
+		world.add_material<Metal>(vector3(.8f, 0.6f, 0.2f), 0.2f));
+	world.add_sphere(vector3(-1.0f, 0.0f, -1.0f), 0.5f,
+		world.add_material<Dielectric>(1.5f));
+	world.add_sphere(vector3(-1.0f, 0.0f, -1.0f), -0.45f,
+		world.add_material<Dielectric>(1.5f));
+
+}
+
+void book_cover_scene(World& world, Rng& rng) {
+	
+	int32_t x_max = 22; 
+	int32_t y_max = 22;
+	int32_t x_half = 11; 
+	int32_t y_half = 11;
+
+	world.reserve_spheres((x_max * y_max) + 4);
+
+	world.add_sphere(vector3(0.f, -1000.f, 0.f), 1000.f,
+		world.add_material<Lambertian>(vector3(0.5f, 0.5f, 0.5f)));
+
+	for (int32_t x = 0; x < x_max; x++) {
+		for (int32_t y = 0; y < y_max; y++) {
+			int32_t a = x - x_half;
+			int32_t b = y - y_half;
+
+			float choose_mat = rng.next_float();
+			vector3 center(a + 0.9f * rng.next_float(), 0.2f, b + 0.9f * rng.next_float());
+			if ((center - vector3(4.f, 0.2f, 0.f)).length() > 0.9f) {
+				if (choose_mat < 0.8f) {  // diffuse
+					world.add_sphere(center, 0.2f,
+						world.add_material<Lambertian>(vector3(rng.next_float() * rng.next_float(), rng.next_float() * rng.next_float(), rng.next_float() * rng.next_float())));
+				}
+				else if (choose_mat < 0.95f) { // metal
+					world.add_sphere(center, 0.2f,
+						world.add_material<Metal>(vector3(0.5f * (1 + rng.next_float()), 0.5f * (1.f + rng.next_float()), 0.5f * (1.f + rng.next_float())), 0.5f * rng.next_float()));
+				}
+				else {  // glass
+					world.add_sphere(center, 0.2f, world.add_material<Dielectric>(1.5f));
+				}
+			}
+		}
+	}
+
+	world.add_sphere(vector3(0.f, 1.f, 0.f), 1.f, world.add_material<Dielectric>(1.5f));
+	world.add_sphere(vector3(-4.f, 1.f, 0.f), 1.f, world.add_material<Lambertian>(vector3(0.4f, 0.2f, 0.1f)));
+	world.add_sphere(vector3(4.f, 1.f, 0.f), 1.f, world.add_material<Metal>(vector3(0.7f, 0.6f, 0.5f), 0.0f));
+}
+
+// count spheres scattered through a cube of side 2 * extent around the origin with random materials,
+// the stress scene of the benchmark. the layout only depends on rng
+void random_spheres_scene(World& world, Rng& rng, int32_t count, float extent = 20.0f)
+{
+	world.reserve_spheres(count);
+	for (int32_t n = 0; n < count; n++) {
+		vector3 center(extent * (2.0f * rng.next_float() - 1.0f),
+			extent * (2.0f * rng.next_float() - 1.0f),
+			extent * (2.0f * rng.next_float() - 1.0f));
+		float radius = 0.05f + 0.25f * rng.next_float();
+		float choose_mat = rng.next_float();
+		if (choose_mat < 0.7f) {
+			world.add_sphere(center, radius,
+				world.add_material<Lambertian>(vector3(rng.next_float(), rng.next_float(), rng.next_float())));
+		}
+		else if (choose_mat < 0.9f) {
+			world.add_sphere(center, radius,
+				world.add_material<Metal>(vector3(0.5f + 0.5f * rng.next_float(), 0.5f + 0.5f * rng.next_float(), 0.5f + 0.5f * rng.next_float()), 0.3f * rng.next_float()));
+		}
+		else {
+			world.add_sphere(center, radius, world.add_material<Dielectric>(1.5f));
+		}
+	}
+}
+
+// count instances of one cluster of spheres, each randomly turned, scaled and placed in a cube of side
+// 2 * extent. about a third of them repaint the whole cluster with a material of their own
+void instanced_scene(World& world, Rng& rng, int32_t count, float extent = 20.0f)
+{
+	Prototype* cluster = world.add_prototype();
+	cluster->add_sphere(vector3(0.0f, 0.0f, 0.0f), 0.5f, world.add_material<Metal>(vector3(0.8f, 0.8f, 0.8f), 0.1f));
+	MaterialHandle satellite = world.add_material<Lambertian>(vector3(0.8f, 0.3f, 0.1f));
+	for (float side : { -0.6f, 0.6f }) {
+		cluster->add_sphere(vector3(side, 0.0f, 0.0f), 0.25f, satellite);
+		cluster->add_sphere(vector3(0.0f, side, 0.0f), 0.25f, satellite);
+		cluster->add_sphere(vector3(0.0f, 0.0f, side), 0.25f, satellite);
+	}
+
+	for (int32_t n = 0; n < count; n++) {
+		vector3 position(extent * (2.0f * rng.next_float() - 1.0f),
+			extent * (2.0f * rng.next_float() - 1.0f),
+			extent * (2.0f * rng.next_float() - 1.0f));
+		vector3 axis(2.0f * rng.next_float() - 1.0f, 2.0f * rng.next_float() - 1.0f, 2.0f * rng.next_float() - 1.0f);
+		if (axis.squared_length() < 1e-6f)
+			axis = vector3(0.0f, 1.0f, 0.0f);
+		float angle = 360.0f * rng.next_float();
+		float scale = 0.5f + rng.next_float();
+		Transform to_world = Transform::translate(position) * Transform::rotate(axis, angle) * Transform::scale(vector3(scale, scale, scale));
+
+		MaterialHandle material = MaterialHandle::none();
+		if (rng.next_float() < 0.3f)
+			material = world.add_material<Lambertian>(vector3(rng.next_float(), rng.next_float(), rng.next_float()));
+		world.add_instance(cluster, to_world, material);
+	}
+}
+
+// fills the world with one of the built in scenes and points the camera in settings at it, returns false
+// for an unknown name. "default" is the frame the renderer has always produced: the sample spheres
+// inside the book cover field. stress_spheres is also the number of instances in "crowd"
+bool build_builtin_scene(const std::string& name, World& world, Rng& rng, SceneSettings& settings, int32_t stress_spheres = 100000)
+{
+	if (name == "default") {
+		sample_scene(world);
+		book_cover_scene(world, rng);
+	}
+	else if (name == "book_cover") {
+		book_cover_scene(world, rng);
+	}
+	else if (name == "sample") {
+		sample_scene(world);
+		settings._lookfrom = vector3(-2.0f, 2.0f, 1.0f);
+		settings._lookat = vector3(0.0f, 0.0f, -1.0f);
+		settings._vfov = 40.0f;
+		settings._aperture = 0.0f;
+		settings._focus_dist = 1.0f;
+	}
+	else if (name == "stress") {
+		random_spheres_scene(world, rng, stress_spheres);
+		settings._lookfrom = vector3(0.0f, 0.0f, 60.0f);
+		settings._lookat = vector3(0.0f, 0.0f, 0.0f);
+		settings._vfov = 40.0f;
+		settings._aperture = 0.0f;
+		settings._focus_dist = 60.0f;
+	}
+	else if (name == "crowd") {
+		instanced_scene(world, rng, stress_spheres);
+		settings._lookfrom = vector3(0.0f, 0.0f, 60.0f);
+		settings._lookat = vector3(0.0f, 0.0f, 0.0f);
+		settings._vfov = 40.0f;
+		settings._aperture = 0.0f;
+		settings._focus_dist = 60.0f;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
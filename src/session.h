@@ -0,0 +1,188 @@
+#pragma once
+
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "render.h"
+
+// keeps a scene loaded between edits for interactive look development. the world with its BVHs, the
+// film and a GBufferPixel per pixel stay, an edit only marks the pixels it can change and render()
+// traces those again, exactly the way a full render traces them. after material edits the film is
+// the same as a full render of the edited scene, after sphere moves it is approximate() until every
+// pixel was traced again
+class RenderSession
+{
+public:
+	// the session renders scene with its own copy of camera and with world, which it edits in place
+	RenderSession(ThreadPool& pool, World& world, const Camera& camera, const SceneInfo& scene);
+	RenderSession(const RenderSession&) = delete;
+	RenderSession& operator=(const RenderSession&) = delete;
+
+	// replaces a built in material, M has to be the kind of h. marks the pixels whose paths may have hit it
+	template <typename M>
+	bool set_material(MaterialHandle h, const M& material, std::string& error);
+
+	// marks the pixels whose paths hit the sphere where it was and those whose camera rays can reach it
+	// where it goes. light it throws on the rest of the scene from there, its new shadow or its
+	// reflection in other spheres, isn't marked, the film stays approximate() until mark_all()
+	bool move_sphere(uint32_t id, const vector3& center, std::string& error);
+
+	// every camera ray changes, marks all pixels. the world and its BVHs are kept
+	void set_camera(const Camera& camera);
+
+	void mark_all();
+
+	// traces the marked pixels again and returns how many there were, the first call traces them all
+	int64_t render();
+
+	inline const Film& film() const { return _film; }
+	inline const Camera& camera() const { return _camera; }
+	inline int64_t marked() const { return _marked; }
+	// true when the film may differ from a full render of the scene because of sphere moves
+	inline bool approximate() const { return _approximate; }
+	// as of the last time the pixel was traced, y counts from the top like the film's rows
+	inline const GBufferPixel& pick(int32_t x, int32_t y) const { return _gbuffer[(size_t)y * _scene._width + x]; }
+
+private:
+	inline void mark(size_t pixel) {
+		_marked += _marked_pixels[pixel] ? 0 : 1;
+		_marked_pixels[pixel] = 1;
+	}
+
+	ThreadPool& _pool;
+	World& _world;
+	Camera _camera;
+	SceneInfo _scene;
+	Film _film;
+	std::vector<GBufferPixel> _gbuffer;
+	std::vector<uint8_t> _marked_pixels;
+	int64_t _marked = 0;
+	bool _moved = false;	// the world needs an update() before the next render
+	bool _approximate = false;
+};
+
+RenderSession::RenderSession(ThreadPool& pool, World& world, const Camera& camera, const SceneInfo& scene)
+	: _pool(pool), _world(world), _camera(camera), _scene(scene), _film(scene._width, scene._height, scene._tile_size)
+{
+	_scene._camera = &_camera;
+	_scene._world = &_world;
+	_gbuffer.resize((size_t)_scene._width * _scene._height);
+	_marked_pixels.resize(_gbuffer.size());
+	mark_all();
+}
+
+template <typename M>
+bool RenderSession::set_material(MaterialHandle h, const M& material, std::string& error)
+{
+	// the kind is part of the handle the spheres keep, it can't change in place
+	if (h.kind() != M::KIND || h.index() >= _world.materials().count<M>()) {
+		error = "there is no such material to replace";
+		return false;
+	}
+	_world.set_material(h, material);
+	for (size_t i = 0; i < _gbuffer.size(); i++) {
+		if (_gbuffer[i]._footprint.has_material(h))
+			mark(i);
+	}
+	return true;
+}
+
+bool RenderSession::move_sphere(uint32_t id, const vector3& center, std::string& error)
+{
+	if (id >= _world.sphere_id_count()) {
+		error = "there is no sphere " + std::to_string(id);
+		return false;
+	}
+	// the footprints name the slots of the last render, update() only runs in render()
+	uint32_t object = _world.sphere_slot(id);
+	for (size_t i = 0; i < _gbuffer.size(); i++) {
+		if (_gbuffer[i]._footprint.has_object(object))
+			mark(i);
+	}
+	_world.move_sphere(id, center);
+	_moved = true;
+	_approximate = true;
+
+	float s0, t0, s1, t1;
+	if (!_camera.screen_bounds(_world.sphere_bounds(id), s0, t0, s1, t1)) {
+		mark_all();
+		return true;
+	}
+	// pixel i draws s from [i, i + 1) / width, one more pixel on each side covers the rounding
+	auto first_pixel = [](float v, int32_t n) { return (int32_t)floorf(std::max(-1.0f, std::min(v, 2.0f)) * n) - 1; };
+	int32_t x0 = std::max(0, first_pixel(s0, _scene._width));
+	int32_t x1 = std::min(_scene._width, first_pixel(s1, _scene._width) + 3);
+	int32_t j0 = std::max(0, first_pixel(t0, _scene._height));
+	int32_t j1 = std::min(_scene._height, first_pixel(t1, _scene._height) + 3);
+	for (int32_t j = j0; j < j1; j++) {
+		size_t row = (size_t)(_scene._height - 1 - j) * _scene._width;
+		for (int32_t x = x0; x < x1; x++)
+			mark(row + x);
+	}
+	return true;
+}
+
+void RenderSession::set_camera(const Camera& camera)
+{
+	_camera = camera;
+	mark_all();
+}
+
+void RenderSession::mark_all()
+{
+	std::fill(_marked_pixels.begin(), _marked_pixels.end(), (uint8_t)1);
+	_marked = (int64_t)_marked_pixels.size();
+}
+
+int64_t RenderSession::render()
+{
+	if (_moved) {
+		_moved = false;
+		// a rebuild reorders the spheres, the slots in the footprints no longer name the same ones
+		if (_world.update() == WorldUpdate::Rebuild)
+			mark_all();
+	}
+	if (_marked == 0)
+		return 0;
+
+	float nx = _scene._width * 1.0f;
+	float ny = _scene._height * 1.0f;
+	float ns = _scene._samples * 1.0f;
+	// the marked pixels of a block still make a coherent packet. packets trace the same image as single
+	// rays, so they are used even when scene._packet_size turns them off
+	const int32_t edge = RayPacket::MAX_EDGE;
+
+	for_each_tile(_pool, _scene._width, _scene._height, _scene._tile_size, [&](const Tile& tile) {
+		int32_t xs[RayPacket::MAX], ys[RayPacket::MAX];
+		for (int32_t by = tile._y0; by < tile._y1; by += edge)
+		{
+			for (int32_t bx = tile._x0; bx < tile._x1; bx += edge)
+			{
+				uint32_t n = 0;
+				for (int32_t y = by; y < std::min(by + edge, tile._y1); y++) {
+					for (int32_t x = bx; x < std::min(bx + edge, tile._x1); x++) {
+						if (!_marked_pixels[(size_t)y * _scene._width + x])
+							continue;
+						_film.pixel(x, y) = FilmPixel{ vector3::ZERO, 0.0f, 0.0f, 0 };
+						xs[n] = x;
+						ys[n] = y;
+						n++;
+					}
+				}
+				if (n > 0)
+					render_block(_scene, xs, ys, n, nx, ny, ns, _film, nullptr, _gbuffer.data());
+			}
+		}
+		flush_ray_count();
+	});
+
+	int64_t traced = _marked;
+	if (traced == (int64_t)_marked_pixels.size())
+		_approximate = false;
+	std::fill(_marked_pixels.begin(), _marked_pixels.end(), (uint8_t)0);
+	_marked = 0;
+	return traced;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// picks the widest instruction set the compiler was told it can use.
+// define SPUD_NO_SIMD to force the scalar fallbacks (handy for validating the SIMD kernels)
+#if !defined(SPUD_NO_SIMD)
+#if defined(__AVX__)
+#define SPUD_SIMD_AVX 1
+#define SPUD_SIMD_SSE 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPUD_SIMD_SSE 1
+#endif
+#endif
+
+#if defined(SPUD_SIMD_AVX)
+#include <immintrin.h>
+#elif defined(SPUD_SIMD_SSE)
+#include <emmintrin.h>
+#endif
+
+// index of the lowest set bit, mask must not be 0
+inline int lowest_bit(unsigned mask)
+{
+	int index = 0;
+	while ((mask & 1u) == 0) {
+		mask >>= 1;
+		index++;
+	}
+	return index;
+}
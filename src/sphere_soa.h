@@ -0,0 +1,256 @@
+#pragma once
+
+#include <stdint.h>
+#include <cfloat>
+#include <vector>
+
+#include "math_utils.h"
+#include "aabb.h"
+#include "simd.h"
+
+// spheres kept as a structure of arrays, so a whole BVH leaf is tested against one ray
+// with a single 8 wide kernel instead of a virtual Sphere::hit call per sphere.
+// after reorder() the arrays carry LANES - 1 padding entries, which lets the kernel
+// always load full vectors
+class SphereSoA
+{
+public:
+	static const uint32_t LANES = 8;
+
+	void clear() {
+		_cx.clear();
+		_cy.clear();
+		_cz.clear();
+		_radius.clear();
+		_materials.clear();
+		_count = 0;
+	}
+
+	void reserve(size_t n) {
+		_cx.reserve(n + LANES);
+		_cy.reserve(n + LANES);
+		_cz.reserve(n + LANES);
+		_radius.reserve(n + LANES);
+		_materials.reserve(n + LANES);
+	}
+
+	uint32_t add(const vector3& center, float radius, MaterialHandle mat) {
+		strip_padding();
+		_cx.push_back(center.x());
+		_cy.push_back(center.y());
+		_cz.push_back(center.z());
+		_radius.push_back(radius);
+		_materials.push_back(mat);
+		return (uint32_t)_count++;
+	}
+
+	// appends n spheres straight from column arrays, sphere i uses materials[material_index[i]]
+	void append(size_t n, const float* cx, const float* cy, const float* cz, const float* radius,
+		const uint32_t* material_index, const MaterialHandle* materials) {
+		strip_padding();
+		_cx.insert(_cx.end(), cx, cx + n);
+		_cy.insert(_cy.end(), cy, cy + n);
+		_cz.insert(_cz.end(), cz, cz + n);
+		_radius.insert(_radius.end(), radius, radius + n);
+		_materials.reserve(_count + n);
+		for (size_t i = 0; i < n; i++)
+			_materials.push_back(materials[material_index[i]]);
+		_count += n;
+	}
+
+	inline size_t size() const { return _count; }
+	inline vector3 center(uint32_t i) const { return vector3(_cx[i], _cy[i], _cz[i]); }
+	inline float radius(uint32_t i) const { return _radius[i]; }
+	inline MaterialHandle material(uint32_t i) const { return _materials[i]; }
+
+	inline void set_center(uint32_t i, const vector3& center) {
+		_cx[i] = center.x();
+		_cy[i] = center.y();
+		_cz[i] = center.z();
+	}
+
+	AABB bounds(uint32_t i) const {
+		// inverted spheres (negative radius) are used for hollow glass, the bounds are the same
+		float r = fabsf(_radius[i]);
+		vector3 c = center(i);
+		return AABB(c - vector3(r, r, r), c + vector3(r, r, r));
+	}
+
+	// permutes the spheres so slot i holds the old sphere order[i], then pads the arrays
+	void reorder(const std::vector<uint32_t>& order);
+
+	// closest hit among the spheres [first, first + count), count must not exceed LANES
+	bool hit(const ray& r, uint32_t first, uint32_t count, float t_min, float& t_max, HitRecord& rec) const;
+
+private:
+	void strip_padding() {
+		_cx.resize(_count);
+		_cy.resize(_count);
+		_cz.resize(_count);
+		_radius.resize(_count);
+		_materials.resize(_count);
+	}
+
+	std::vector<float> _cx;
+	std::vector<float> _cy;
+	std::vector<float> _cz;
+	std::vector<float> _radius;
+	std::vector<MaterialHandle> _materials;
+	size_t _count = 0;
+};
+
+template <typename T>
+static void permute(std::vector<T>& v, const std::vector<uint32_t>& order)
+{
+	std::vector<T> result(order.size());
+	for (size_t i = 0; i < order.size(); i++)
+		result[i] = v[order[i]];
+	v.swap(result);
+}
+
+void SphereSoA::reorder(const std::vector<uint32_t>& order)
+{
+	strip_padding();
+	permute(_cx, order);
+	permute(_cy, order);
+	permute(_cz, order);
+	permute(_radius, order);
+	permute(_materials, order);
+
+	// padding lanes are masked off by count in the kernel, zeros just keep them finite
+	for (uint32_t i = 0; i < LANES - 1; i++) {
+		_cx.push_back(0.0f);
+		_cy.push_back(0.0f);
+		_cz.push_back(0.0f);
+		_radius.push_back(0.0f);
+		_materials.push_back(MaterialHandle());
+	}
+}
+
+bool SphereSoA::hit(const ray& r, uint32_t first, uint32_t count, float t_min, float& t_max, HitRecord& rec) const
+{
+	SPUD_COUNT_N(SphereTests, count);
+	const vector3& o = r.origin();
+	const vector3& d = r.direction();
+	float a = dot(d, d);
+
+	// per lane hit distance, FLT_MAX where the lane missed
+	alignas(32) float t[LANES];
+
+#if defined(SPUD_SIMD_AVX)
+	__m256 ox = _mm256_set1_ps(o.x()), oy = _mm256_set1_ps(o.y()), oz = _mm256_set1_ps(o.z());
+	__m256 dx = _mm256_set1_ps(d.x()), dy = _mm256_set1_ps(d.y()), dz = _mm256_set1_ps(d.z());
+	__m256 va = _mm256_set1_ps(a);
+	__m256 vt_min = _mm256_set1_ps(t_min);
+	__m256 vt_max = _mm256_set1_ps(t_max);
+	__m256 miss = _mm256_set1_ps(FLT_MAX);
+
+	__m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&_cx[first]));
+	__m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&_cy[first]));
+	__m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&_cz[first]));
+	__m256 rad = _mm256_loadu_ps(&_radius[first]);
+
+	__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+	__m256 c = _mm256_sub_ps(
+		_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+		_mm256_mul_ps(rad, rad));
+	__m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(va, c));
+	__m256 valid = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GT_OQ);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps((float)count), _CMP_LT_OQ));
+
+	__m256 sq = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+	__m256 nb = _mm256_sub_ps(_mm256_setzero_ps(), b);
+	__m256 t0 = _mm256_div_ps(_mm256_sub_ps(nb, sq), va);
+	__m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, sq), va);
+	__m256 ok0 = _mm256_and_ps(_mm256_cmp_ps(t0, vt_max, _CMP_LT_OQ), _mm256_cmp_ps(t0, vt_min, _CMP_GT_OQ));
+	__m256 ok1 = _mm256_and_ps(_mm256_cmp_ps(t1, vt_max, _CMP_LT_OQ), _mm256_cmp_ps(t1, vt_min, _CMP_GT_OQ));
+
+	__m256 th = _mm256_blendv_ps(_mm256_blendv_ps(miss, t1, ok1), t0, ok0);
+	valid = _mm256_and_ps(valid, _mm256_or_ps(ok0, ok1));
+	unsigned mask = (unsigned)_mm256_movemask_ps(valid);
+	_mm256_store_ps(t, _mm256_blendv_ps(miss, th, valid));
+#elif defined(SPUD_SIMD_SSE)
+	__m128 ox = _mm_set1_ps(o.x()), oy = _mm_set1_ps(o.y()), oz = _mm_set1_ps(o.z());
+	__m128 dx = _mm_set1_ps(d.x()), dy = _mm_set1_ps(d.y()), dz = _mm_set1_ps(d.z());
+	__m128 va = _mm_set1_ps(a);
+	__m128 vt_min = _mm_set1_ps(t_min);
+	__m128 vt_max = _mm_set1_ps(t_max);
+	__m128 miss = _mm_set1_ps(FLT_MAX);
+	__m128 vcount = _mm_set1_ps((float)count);
+	unsigned mask = 0;
+
+	// two 4 wide halves, SSE2 has no blend so selects are done with and/andnot/or
+	for (uint32_t h = 0; h < LANES; h += 4) {
+		__m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&_cx[first + h]));
+		__m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&_cy[first + h]));
+		__m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&_cz[first + h]));
+		__m128 rad = _mm_loadu_ps(&_radius[first + h]);
+
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+		__m128 c = _mm_sub_ps(
+			_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+			_mm_mul_ps(rad, rad));
+		__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(va, c));
+		__m128 valid = _mm_cmpgt_ps(disc, _mm_setzero_ps());
+		float fh = (float)h;
+		valid = _mm_and_ps(valid, _mm_cmplt_ps(_mm_setr_ps(fh, fh + 1.0f, fh + 2.0f, fh + 3.0f), vcount));
+
+		__m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+		__m128 nb = _mm_sub_ps(_mm_setzero_ps(), b);
+		__m128 t0 = _mm_div_ps(_mm_sub_ps(nb, sq), va);
+		__m128 t1 = _mm_div_ps(_mm_add_ps(nb, sq), va);
+		__m128 ok0 = _mm_and_ps(_mm_cmplt_ps(t0, vt_max), _mm_cmpgt_ps(t0, vt_min));
+		__m128 ok1 = _mm_and_ps(_mm_cmplt_ps(t1, vt_max), _mm_cmpgt_ps(t1, vt_min));
+
+		__m128 th = _mm_or_ps(_mm_and_ps(ok1, t1), _mm_andnot_ps(ok1, miss));
+		th = _mm_or_ps(_mm_and_ps(ok0, t0), _mm_andnot_ps(ok0, th));
+		valid = _mm_and_ps(valid, _mm_or_ps(ok0, ok1));
+		mask |= (unsigned)_mm_movemask_ps(valid) << h;
+		_mm_storeu_ps(t + h, _mm_or_ps(_mm_and_ps(valid, th), _mm_andnot_ps(valid, miss)));
+	}
+#else
+	unsigned mask = 0;
+	for (uint32_t i = 0; i < LANES; i++) {
+		t[i] = FLT_MAX;
+		if (i >= count)
+			continue;
+		uint32_t s = first + i;
+		vector3 oc = o - vector3(_cx[s], _cy[s], _cz[s]);
+		float b = dot(oc, d);
+		float c = dot(oc, oc) - _radius[s] * _radius[s];
+		float disc = b * b - a * c;
+		if (disc > 0.0f) {
+			float sq = sqrtf(disc);
+			float t0 = (-b - sq) / a;
+			float t1 = (-b + sq) / a;
+			if (t0 < t_max && t0 > t_min) {
+				t[i] = t0;
+				mask |= 1u << i;
+			}
+			else if (t1 < t_max && t1 > t_min) {
+				t[i] = t1;
+				mask |= 1u << i;
+			}
+		}
+	}
+#endif
+
+	if (mask == 0)
+		return false;
+
+	uint32_t lane = (uint32_t)lowest_bit(mask);
+	for (unsigned m = mask & (mask - 1); m != 0; m &= m - 1) {
+		uint32_t i = (uint32_t)lowest_bit(m);
+		if (t[i] < t[lane])
+			lane = i;
+	}
+
+	uint32_t s = first + lane;
+	rec.t = t[lane];
+	rec.p = r.point_at_parameter(rec.t);
+	rec.normal = (rec.p - center(s)) / _radius[s];
+	rec.mat_id = _materials[s];
+	rec.object = s;
+	t_max = rec.t;
+	return true;
+}
@@ -5,228 +5,754 @@
 #include "objects.h"
 #include "materials.h"
 #include "camera.h"
+#include "integrator.h"
 
 #include <iostream>
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <string>
 #include <thread>
+#include <cfloat>
+#include <cstring>
+#include <fstream>
+#include <sstream>
 
 #include "threadqueue.h"
+#include "tiles.h"
+#include "image_io.h"
+#include "film.h"
+#include "render.h"
+#include "wavefront.h"
+#include "scene_file.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "animation.h"
+#include "scenes.h"
+#include "profile.h"
+#include "session.h"
+
+static void print_usage()
+{
+	std::cout <<
+		"usage: spudtrace [options]\n"
+		"  --scene NAME|PATH      built in scene (default, sample, book_cover, stress, crowd) or a .spud/.spdb file\n"
+		"  --width N, --height N  image size, overrides the scene\n"
+		"  --resolution WxH       both at once\n"
+		"  --spp N                samples per pixel, overrides the scene\n"
+		"  --max-depth N          bounce limit, overrides the scene\n"
+		"  --rr-depth N           bounces before russian roulette starts (3)\n"
+		"  --threads N            worker threads, 0 is one per hardware thread (0)\n"
+		"  --pin                  pin the workers to cores\n"
+		"  --tile-size N          tile edge in pixels (32)\n"
+		"  --seed N               frame seed, also drives the built in random scenes (0)\n"
+		"  --sampler NAME         random, stratified, sobol or bluenoise (sobol)\n"
+		"  --output PATH          output image (output.ppm)\n"
+		"  --format ppm|ppm16|pfm output format, picked from the extension by default\n"
+		"  --stream               write tiles to the file as they finish\n"
+		"  --wavefront            use the wavefront renderer\n"
+		"  --packet N             trace camera rays in packets of N x N pixels, N up to 8, 0 traces\n"
+		"                         them one by one (8)\n"
+		"  --adaptive T           progressive rendering until the relative error is below T\n"
+		"  --time-budget S        progressive rendering for at most S seconds\n"
+		"  --pass-samples N       samples per progressive pass (4)\n"
+		"  --write-passes         write the image after every progressive pass\n"
+		"  --checkpoint PATH      save the film after every progressive pass\n"
+		"  --resume PATH          continue the progressive render saved in a checkpoint\n"
+		"  --frames N             render an animation of N frames, the frame number goes into the output\n"
+		"                         name (in place of '#'s or before the extension)\n"
+		"  --fps F                frames per second of the animation (24)\n"
+		"  --orbit DEGREES        swing the camera around its target by DEGREES over the animation\n"
+		"  --denoise              filter the frame guided by the first hit albedo, normal and depth\n"
+		"  --denoise-passes N     a-trous passes of the denoiser (5)\n"
+		"  --listen PORT          hand the frame out in tiles to workers connecting on PORT\n"
+		"  --spawn-workers N      start N local worker processes for the frame, listens on a free port\n"
+		"                         of the loopback interface unless --listen is given\n"
+		"  --worker-timeout S     drop a worker that sent nothing for S seconds, its tiles go to the\n"
+		"                         others, 0 waits forever (300)\n"
+		"  --worker HOST:PORT     render tiles for the coordinator at HOST:PORT, the job comes from it\n"
+		"  --session PATH         keep the scene loaded and run the edits in PATH (- reads stdin), one per\n"
+		"                         line, only the pixels an edit changes are traced again:\n"
+		"                           render [PATH]           trace the changed pixels, write the image. after\n"
+		"                                                   moves it is approximate until the next full\n"
+		"                           full [PATH]             trace every pixel, write the image\n"
+		"                           lambertian I R G B      replace lambertian material I\n"
+		"                           metal I R G B FUZZ      replace metal material I\n"
+		"                           dielectric I IOR        replace dielectric material I\n"
+		"                           move ID X Y Z           move sphere ID\n"
+		"                           camera FROM_XYZ AT_XYZ  move the camera\n"
+		"                           pick X Y                print what pixel X Y sees first\n"
+		"  --save-scene PATH      save a scene loaded from a file in another format\n"
+		"  --trace PATH           chrome trace of the tile schedule (SPUD_PROFILE builds)\n";
+}
 
-vector3 color(const ray& r, const Object* obj, int depth) {
-	HitRecord rec;
-	if (obj->hit(r, 0.001f, FLT_MAX, rec)) {
-		ray scattered;
-		vector3 attenuation;
-		if (depth < 50 && rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
-			return attenuation * color(scattered, obj, depth + 1);
-		}
-		else {
-			return vector3::ZERO;
+// hot path counters and the tile trace, only filled in SPUD_PROFILE builds
+static bool report_profile(const char* trace_path)
+{
+#if defined(SPUD_PROFILE)
+	Profiler::instance().report(std::cout);
+#endif
+	if (trace_path) {
+#if !defined(SPUD_PROFILE)
+		std::cerr << "The trace is empty, tiles are only recorded in builds with SPUD_PROFILE\n";
+#endif
+		if (!Profiler::instance().write_trace(trace_path)) {
+			std::cerr << "Failed to write " << trace_path << "\n";
+			return false;
 		}
 	}
-	else
-	{
-		vector3 unit_direction = unit_vector(r.direction());
-		float t = 0.5f * (unit_direction.y() + 1.0f);
-		return (1.0f - t) * vector3::ONE + t * vector3(0.5f, 0.7f, 1.0f);
-	}
+	return true;
 }
 
-void sample_scene(World& world)
+static const char* update_name(WorldUpdate update)
 {
-	world._objects.push_back(std::make_unique<Sphere>(vector3(0.0f, 0.0f, -1.0f), 0.5f,
-		new Lambertian(vector3(0.1f, 0.2f, 0.5f))));
-	world._objects.push_back(std::make_unique<Sphere>(vector3(0.0f, -100.5f, -1.0f), 100.f,
-		new Lambertian(vector3(.8f, 0.8f, 0.0f))));
-	world._objects.push_back(std::make_unique<Sphere>(vector3(1.0f, 0.0f, -1.0f), 0.5f,
-		new Metal(vector3(.8f, 0.6f, 0.2f), 0.2f)));
-	world._objects.push_back(std::make_unique<Sphere>(vector3(-1.0f, 0.0f, -1.0f), 0.5f,
-		new Dielectric(1.5f)));
-	world._objects.push_back(std::make_unique<Sphere>(vector3(-1.0f, 0.0f, -1.0f), -0.45f,
-		new Dielectric(1.5f)));
-
+	switch (update) {
+	case WorldUpdate::Refit:
+		return "refit";
+	case WorldUpdate::Rebuild:
+		return "rebuild";
+	default:
+		return "static";
+	}
 }
 
-void book_cover_scene(World& world) {
-	
-	int32_t x_max = 22; 
-	int32_t y_max = 22;
-	int32_t x_half = 11; 
-	int32_t y_half = 11;
-
-	world._objects.reserve(world._objects.size() + (x_max * y_max) + 4);
-
-	world._objects.push_back(std::make_unique<Sphere>(vector3(0.f, -1000.f, 0.f), 1000.f,
-		new Lambertian(vector3(0.5f, 0.5f, 0.5f))));
-
-	for (int32_t x = 0; x < x_max; x++) {
-		for (int32_t y = 0; y < y_max; y++) {
-			int32_t a = x - x_half;
-			int32_t b = y - y_half;
-
-			float choose_mat = drand48();
-			vector3 center(a + 0.9f * drand48(), 0.2f, b + 0.9f * drand48());
-			if ((center - vector3(4.f, 0.2f, 0.f)).length() > 0.9f) {
-				if (choose_mat < 0.8f) {  // diffuse
-					world._objects.push_back(std::make_unique<Sphere>(center, 0.2f,
-						new Lambertian(vector3(drand48() * drand48(), drand48() * drand48(), drand48() * drand48()))));
-				}
-				else if (choose_mat < 0.95f) { // metal
-					world._objects.push_back(std::make_unique<Sphere>(center, 0.2f,
-						new Metal(vector3(0.5f * (1 + drand48()), 0.5f * (1.f + drand48()), 0.5f * (1.f + drand48())), 0.5f * drand48())));
-				}
-				else {  // glass
-					world._objects.push_back(std::make_unique<Sphere>(center, 0.2f, new Dielectric(1.5f)));
-				}
-			}
-		}
+static const char* material_kind_name(MaterialKind kind)
+{
+	switch (kind) {
+	case MaterialKind::Lambertian:
+		return "lambertian";
+	case MaterialKind::Metal:
+		return "metal";
+	case MaterialKind::Dielectric:
+		return "dielectric";
+	default:
+		return "custom";
 	}
-
-	world._objects.push_back(std::make_unique<Sphere>(vector3(0.f, 1.f, 0.f), 1.f, new Dielectric(1.5f)));
-	world._objects.push_back(std::make_unique<Sphere>(vector3(-4.f, 1.f, 0.f), 1.f, new Lambertian(vector3(0.4f, 0.2f, 0.1f))));
-	world._objects.push_back(std::make_unique<Sphere>(vector3(4.f, 1.f, 0.f), 1.f, new Metal(vector3(0.7f, 0.6f, 0.5f), 0.0f)));
 }
 
-struct SceneInfo
+// the handle of a session's material edit, none() for an index no handle can address
+static MaterialHandle session_material(MaterialKind kind, uint32_t index)
 {
-	int32_t	_width; 
-	int32_t	_height;
-	int32_t	_samples; 
-	const Camera*	_camera; 
-	const World*	_world;
-};
-
+	return index <= MaterialHandle::INDEX_MASK ? MaterialHandle::make(kind, index) : MaterialHandle::none();
+}
 
-struct JobInfo
+// runs the edits of a --session script against a session that hasn't rendered yet
+static bool run_session(RenderSession& session, const World& world, const SceneSettings& settings, std::istream& script,
+	const char* output_path, ImageFormat format)
 {
-	float _nx; 
-	float _ny;
-	float _ns;
-	int32_t _j; 
-	int32_t _i;
-	vector3* _output; 
-};
-
-void process_ray(const SceneInfo& scene, float nx, float ny, float ns, int32_t j, int32_t i, vector3* output)
-{
-	vector3 col(0.f, 0.f, 0.f);
-	for (int s = 0; s < (int)scene._samples; s++)
-	{
-		float u = (i + drand48()) / nx;
-		float v = (j + drand48()) / ny;
-		ray r = scene._camera->getRay(u, v);
-		vector3 p = r.point_at_parameter(2.0);
-		col += color(r, scene._world, 0);
-	}
-	col /= ns;
-	col = vector3(sqrt(col.x()), sqrt(col.y()), sqrt(col.z()));
+	const Film& film = session.film();
+	std::vector<vector3> frame_buffer((size_t)film.width() * film.height());
+	std::string line;
+	int32_t line_number = 0;
+	int32_t renders = 0;
+	while (std::getline(script, line)) {
+		line_number++;
+		std::istringstream tok(line);
+		std::string command;
+		if (!(tok >> command) || command[0] == '#')
+			continue;
+
+		std::string error;
+		bool ok = true;
+		float r = 0.0f, g = 0.0f, b = 0.0f;
+		uint32_t index = 0;
+		if (command == "render" || command == "full") {
+			// a path of its own picks its format like --output does
+			std::string path = output_path;
+			ImageFormat path_format = format;
+			if (tok >> path)
+				path_format = image_format_from_path(path.c_str());
+			if (command == "full")
+				session.mark_all();
+			auto start = std::chrono::high_resolution_clock::now();
+			ray_total() = 0;
+			int64_t traced = session.render();
+			std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+			std::cout << "Render " << renders++ << ": " << traced << " pixel(s) traced ("
+				<< 100.0 * traced / frame_buffer.size() << "% of the frame) in " << elapsed.count() * 1000.0 << " ms, "
+				<< ray_total().load() << " ray(s)\n";
+			if (session.approximate())
+				std::cout << "  approximate until the next full: the shadows and reflections of moved spheres aren't traced yet\n";
+			film.resolve(frame_buffer.data());
+			if (!write_image(path.c_str(), path_format, film.width(), film.height(), frame_buffer.data())) {
+				std::cerr << "Failed to write " << path << "\n";
+				return false;
+			}
+			continue;
+		}
+		else if (command == "lambertian") {
+			ok = (bool)(tok >> index >> r >> g >> b);
+			ok = ok && session.set_material(session_material(MaterialKind::Lambertian, index), Lambertian(vector3(r, g, b)), error);
+		}
+		else if (command == "metal") {
+			float fuzz = 0.0f;
+			ok = (bool)(tok >> index >> r >> g >> b >> fuzz);
+			ok = ok && session.set_material(session_material(MaterialKind::Metal, index), Metal(vector3(r, g, b), fuzz), error);
+		}
+		else if (command == "dielectric") {
+			ok = (bool)(tok >> index >> r);
+			ok = ok && session.set_material(session_material(MaterialKind::Dielectric, index), Dielectric(r), error);
+		}
+		else if (command == "move") {
+			ok = (bool)(tok >> index >> r >> g >> b);
+			ok = ok && session.move_sphere(index, vector3(r, g, b), error);
+		}
+		else if (command == "camera") {
+			float x, y, z;
+			ok = (bool)(tok >> r >> g >> b >> x >> y >> z);
+			if (ok)
+				session.set_camera(Camera(vector3(r, g, b), vector3(x, y, z), settings._vup, settings._vfov,
+					film.width() * 1.0f / film.height(), settings._aperture, settings._focus_dist));
+		}
+		else if (command == "pick") {
+			int32_t x = 0, y = 0;
+			ok = (bool)(tok >> x >> y) && x >= 0 && y >= 0 && x < film.width() && y < film.height();
+			if (ok) {
+				const GBufferPixel& px = session.pick(x, y);
+				std::cout << "Pixel " << x << " " << y << ": ";
+				if (px._object == GBufferPixel::MISS)
+					std::cout << "sky\n";
+				else {
+					if (px._object & World::OBJECT_BIT)
+						std::cout << "object " << (px._object & ~World::OBJECT_BIT);
+					else {
+						// the g-buffer has the slot, the edits take the id
+						for (uint32_t id = 0; id < (uint32_t)world.sphere_id_count(); id++)
+							if (world.sphere_slot(id) == px._object)
+								std::cout << "sphere " << id;
+					}
+					std::cout << ", " << material_kind_name(px._material.kind()) << " " << px._material.index() << " at "
+						<< px._position.x() << " " << px._position.y() << " " << px._position.z() << ", normal "
+						<< px._normal.x() << " " << px._normal.y() << " " << px._normal.z() << "\n";
+				}
+			}
+		}
+		else {
+			error = "unknown command " + command;
+			ok = false;
+		}
 
-	// store the result in our output buffer
-	*output = col;
+		if (!ok) {
+			std::cerr << "Session line " << line_number << ": " << (error.empty() ? "bad arguments to " + command : error) << "\n";
+			return false;
+		}
+		if (command != "pick")
+			std::cout << command << ": " << session.marked() << " pixel(s) to trace\n";
+	}
+	return true;
 }
 
-void thread_process(const SceneInfo& scene, vector3* output)
+int main(int argc, char** argv)
 {
-	ThreadPool pool(8);
-	pool.init();
-
-	std::vector<std::future<void>> results; 
-	results.reserve(scene._height * scene._width); 
-
-	float nx = scene._width * 1.0f;
-	float ny = scene._height * 1.0f;
-	float ns = scene._samples * 1.0f;
-
-	for (int32_t j = scene._height - 1; j >= 0; j--)
-	{
-		for (int32_t i = 0; i < scene._width; i++)
-		{
-			results.emplace_back(pool.submit(process_ray, std::ref(scene), nx, ny, ns, j, i, output));
-			//process_ray(scene, job);
-			output++;
+	int32_t tile_size = 32;
+	// -1 keeps the value from the scene settings
+	int32_t width = -1;
+	int32_t height = -1;
+	int32_t samples = -1;
+	int32_t max_depth = -1;
+	int32_t rr_depth = 3;
+	SamplerKind sampler = SamplerKind::Sobol;
+	const char* scene_name = "default";
+	const char* save_scene_path = nullptr;
+	const char* trace_path = nullptr;
+	const char* session_path = nullptr;
+
+	// 0 threads means one per hardware thread
+	int32_t threads = 0;
+	bool pin_threads = false;
+	uint64_t seed = 0;
+	const char* output_path = "output.ppm";
+	const char* format_name = nullptr;
+	bool stream_tiles = false;
+	bool wavefront = false;
+	int32_t packet_size = RayPacket::MAX_EDGE;
+	bool progressive = false;
+	bool write_passes = false;
+	bool denoise_output = false;
+	const char* checkpoint_path = nullptr;
+	const char* resume_path = nullptr;
+	int32_t listen_port = -1;
+	int32_t worker_timeout = RenderCoordinator::DEFAULT_WORKER_TIMEOUT;
+	int32_t spawn_workers = 0;
+	const char* worker_address = nullptr;
+	int32_t frames = 1;
+	float fps = 24.0f;
+	float orbit_degrees = 0.0f;
+	DenoiseSettings denoise_settings;
+	ProgressiveSettings progressive_settings = { 4, 8, 0.0f, 0.0 };
+	for (int a = 1; a < argc; a++) {
+		if (strcmp(argv[a], "--help") == 0 || strcmp(argv[a], "-h") == 0) {
+			print_usage();
+			return 0;
+		}
+		else if (strcmp(argv[a], "--width") == 0 && a + 1 < argc)
+			width = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--height") == 0 && a + 1 < argc)
+			height = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--resolution") == 0 && a + 1 < argc) {
+			if (!parse_resolution(argv[++a], width, height)) {
+				std::cerr << "Bad resolution " << argv[a] << " (expected WxH)\n";
+				return 1;
+			}
+		}
+		else if (strcmp(argv[a], "--spp") == 0 && a + 1 < argc)
+			samples = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--tile-size") == 0 && a + 1 < argc)
+			tile_size = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+			threads = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc)
+			seed = strtoull(argv[++a], nullptr, 10);
+		else if (strcmp(argv[a], "--max-depth") == 0 && a + 1 < argc)
+			max_depth = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--rr-depth") == 0 && a + 1 < argc)
+			rr_depth = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--sampler") == 0 && a + 1 < argc) {
+			if (!parse_sampler(argv[++a], sampler)) {
+				std::cerr << "Unknown sampler " << argv[a] << " (expected random, stratified, sobol or bluenoise)\n";
+				return 1;
+			}
+		}
+		else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc)
+			trace_path = argv[++a];
+		else if (strcmp(argv[a], "--pin") == 0)
+			pin_threads = true;
+		else if (strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
+			scene_name = argv[++a];
+		else if (strcmp(argv[a], "--session") == 0 && a + 1 < argc)
+			session_path = argv[++a];
+		else if (strcmp(argv[a], "--save-scene") == 0 && a + 1 < argc)
+			save_scene_path = argv[++a];
+		else if (strcmp(argv[a], "--output") == 0 && a + 1 < argc)
+			output_path = argv[++a];
+		else if (strcmp(argv[a], "--format") == 0 && a + 1 < argc)
+			format_name = argv[++a];
+		else if (strcmp(argv[a], "--stream") == 0)
+			stream_tiles = true;
+		else if (strcmp(argv[a], "--wavefront") == 0)
+			wavefront = true;
+		else if (strcmp(argv[a], "--packet") == 0 && a + 1 < argc) {
+			packet_size = atoi(argv[++a]);
+			if (packet_size < 0 || packet_size > RayPacket::MAX_EDGE) {
+				std::cerr << "Packet size " << argv[a] << " is out of range (0 to " << RayPacket::MAX_EDGE << ")\n";
+				return 1;
+			}
+		}
+		else if (strcmp(argv[a], "--adaptive") == 0 && a + 1 < argc) {
+			progressive = true;
+			progressive_settings._threshold = (float)atof(argv[++a]);
+		}
+		else if (strcmp(argv[a], "--time-budget") == 0 && a + 1 < argc) {
+			progressive = true;
+			progressive_settings._time_budget = atof(argv[++a]);
+		}
+		else if (strcmp(argv[a], "--pass-samples") == 0 && a + 1 < argc) {
+			progressive = true;
+			progressive_settings._pass_samples = atoi(argv[++a]);
+		}
+		else if (strcmp(argv[a], "--denoise") == 0)
+			denoise_output = true;
+		else if (strcmp(argv[a], "--denoise-passes") == 0 && a + 1 < argc) {
+			denoise_output = true;
+			denoise_settings._iterations = atoi(argv[++a]);
+		}
+		else if (strcmp(argv[a], "--write-passes") == 0) {
+			progressive = true;
+			write_passes = true;
+		}
+		else if (strcmp(argv[a], "--checkpoint") == 0 && a + 1 < argc) {
+			progressive = true;
+			checkpoint_path = argv[++a];
+		}
+		else if (strcmp(argv[a], "--resume") == 0 && a + 1 < argc) {
+			progressive = true;
+			resume_path = argv[++a];
+		}
+		else if (strcmp(argv[a], "--listen") == 0 && a + 1 < argc)
+			listen_port = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--worker-timeout") == 0 && a + 1 < argc)
+			worker_timeout = std::max(0, atoi(argv[++a]));
+		else if (strcmp(argv[a], "--spawn-workers") == 0 && a + 1 < argc)
+			spawn_workers = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--worker") == 0 && a + 1 < argc)
+			worker_address = argv[++a];
+		else if (strcmp(argv[a], "--frames") == 0 && a + 1 < argc)
+			frames = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--fps") == 0 && a + 1 < argc)
+			fps = (float)atof(argv[++a]);
+		else if (strcmp(argv[a], "--orbit") == 0 && a + 1 < argc)
+			orbit_degrees = (float)atof(argv[++a]);
+		else {
+			std::cerr << "Unknown or incomplete option " << argv[a] << " (see --help)\n";
+			return 1;
 		}
 	}
 
-	for (auto& result : results) {
-		result.get();
+	ImageFormat format = image_format_from_path(output_path);
+	if (format_name && !image_format_from_name(format_name, format)) {
+		std::cerr << "Unknown image format " << format_name << " (expected ppm, ppm16 or pfm)\n";
+		return 1;
+	}
+	if (denoise_output && stream_tiles) {
+		std::cerr << "Streamed tiles are written before the frame could be denoised, --denoise and --stream don't mix\n";
+		return 1;
+	}
+	if (tile_size <= 0) {
+		std::cerr << "Tile size has to be positive\n";
+		return 1;
+	}
+	if (progressive && stream_tiles) {
+		std::cerr << "Streamed tiles are written once, --stream doesn't mix with progressive rendering\n";
+		return 1;
 	}
 
-	pool.shutdown();
+	if (worker_address) {
+		// everything about the frame comes from the coordinator
+		std::string host;
+		uint16_t port = 0;
+		if (!parse_host_port(worker_address, host, port)) {
+			std::cerr << "Bad worker address " << worker_address << " (expected HOST:PORT)\n";
+			return 1;
+		}
+		ThreadPool pool(threads, pin_threads);
+		pool.init();
+		std::string error;
+		if (!run_worker(pool, host.c_str(), port, 30.0, error)) {
+			std::cerr << "Worker failed: " << error << "\n";
+			return 1;
+		}
+		return 0;
+	}
 
-}
+	bool coordinate = listen_port >= 0 || spawn_workers > 0;
+	if (coordinate && (progressive || denoise_output)) {
+		std::cerr << "Distributed frames are rendered in one pass without denoiser guides, --listen and --spawn-workers "
+			"don't mix with progressive rendering or --denoise\n";
+		return 1;
+	}
+	if (listen_port > 65535) {
+		std::cerr << "Bad port " << listen_port << "\n";
+		return 1;
+	}
+	if (frames <= 0 || fps <= 0.0f) {
+		std::cerr << "Frame count and frame rate have to be positive\n";
+		return 1;
+	}
+	if (frames > 1 && (stream_tiles || write_passes || checkpoint_path || resume_path || coordinate)) {
+		std::cerr << "Animations are written frame by frame, --frames doesn't mix with --stream, --write-passes, "
+			"checkpoints or distributed rendering\n";
+		return 1;
+	}
 
-bool write_ppm(const char* filename, int32_t width, int32_t height, const std::vector<vector3>& data)
-{
-	std::ofstream stream;
-	stream.open(filename);
-	if (!stream.is_open())
-		return false; 
+	if (session_path && (frames > 1 || progressive || coordinate || wavefront || stream_tiles || denoise_output)) {
+		std::cerr << "A session renders single full frames, --session doesn't mix with animations, progressive or "
+			"distributed rendering, --wavefront, --stream or --denoise\n";
+		return 1;
+	}
 
-	auto start = std::chrono::high_resolution_clock::now();
+	World world; 
+	SceneSettings settings;
+	Animation animation;
+
+	// load scene data to the world, the built in random scene layouts are driven by the frame seed as well
+	Rng scene_rng(seed);
+	bool scene_from_file = false;
+	if (!build_builtin_scene(scene_name, world, scene_rng, settings)) {
+		scene_from_file = true;
+		// scene, camera and render settings all come from the file
+		SceneFile file;
+		std::string error;
+		if (!file.load(scene_name, error)) {
+			std::cerr << "Failed to load scene: " << error << "\n";
+			return 1;
+		}
+		if (save_scene_path && !file.save(save_scene_path, error)) {
+			std::cerr << "Failed to save scene: " << error << "\n";
+			return 1;
+		}
+		if (save_scene_path && scene_path_is_binary(save_scene_path) && !file._animation.empty())
+			std::cerr << "Binary scenes are static, the keys of " << scene_name << " were not saved\n";
+		settings = file._settings;
+		animation = file._animation;
+		file.build_world(world);
+	}
+	else if (save_scene_path) {
+		std::cerr << "Only scenes loaded from a file can be saved\n";
+		return 1;
+	}
 
-	stream << "P3\n" << width << " " << height << "\n255\n";
-	for (auto itr = data.begin(); itr != data.end(); itr++)
+	// command line values win over the scene
+	if (width > 0)
+		settings._width = width;
+	if (height > 0)
+		settings._height = height;
+	if (samples > 0)
+		settings._samples = samples;
+	if (max_depth >= 0)
+		settings._max_depth = max_depth;
 	{
-		auto& col = *itr;
-
-		int ir = (int)(255.99 * col.r());
-		int ig = (int)(255.99 * col.g());
-		int ib = (int)(255.99 * col.b());
-
-		stream << ir << " " << ig << " " << ib << "\n";
+		// the overrides are held to the same limits as scene files
+		std::string error;
+		if (!check_settings(settings, error)) {
+			std::cerr << "Bad render settings: " << error << "\n";
+			return 1;
+		}
 	}
 
-	stream.close();
-
-	auto finish = std::chrono::high_resolution_clock::now();
-	std::cout << "Finished writing file in  " << std::chrono::duration_cast<std::chrono::seconds>(finish - start).count() << " second(s)\n";
+	// the camera path covers the whole sequence, so a full orbit loops
+	if (orbit_degrees != 0.0f)
+		animation.add_orbit(settings._lookfrom, settings._lookat, settings._vup, orbit_degrees, frames / fps, frames);
+	// animated scenes start out in their state at time 0
+	animation.camera_at(0.0f, settings._lookfrom, settings._lookat);
+	animation.apply(0.0f, world);
 
-	return true;
-}
+	// build the acceleration structure once all objects are in
+	world.build();
 
-int main()
-{
-	const int32_t width = 1920;
-	const int32_t height = 1080;
-	const int32_t samples = 10;
+	width = settings._width;
+	height = settings._height;
+	samples = settings._samples;
+	max_depth = settings._max_depth;
 
-	// keep 2 to 1 aspect ratio to keep the rest of the math match the article
+	// setup camera
 	const float nx = width * 1.0f;
 	const float ny = height * 1.0f;
-
-	World world; 
-
-	// load scene data to the world
-	sample_scene(world);
-	book_cover_scene(world);
-
-	// setup camera
-	vector3 lookFrom = vector3(13.0f, 2.0f, 3.0f);
-	vector3 lookAt = vector3(0.0f, 0.0f, 0.0f);
-	//float dist_to_focus = (lookFrom - lookAt).length();
-	float dist_to_focus = 10.f;
-	float aperture = 0.1f;
-	float vfov = 20.0f;
-	Camera cam(lookFrom, lookAt, vector3::UP, vfov, nx/ny, aperture, dist_to_focus );
+	Camera cam(settings._lookfrom, settings._lookat, settings._vup, settings._vfov, nx/ny, settings._aperture, settings._focus_dist);
 
 	auto start = std::chrono::high_resolution_clock::now();
 
-	// create output buffer and pre-allocate all memory so we are not doing bunch of allocations
+	// the film accumulates the linear sums, the frame buffer receives the resolved image
+	Film film(width, height, tile_size);
+	if (resume_path) {
+		uint64_t saved_seed = 0;
+		int32_t saved_pass_samples = 0;
+		SamplerKind saved_sampler = SamplerKind::Random;
+		std::string error;
+		if (!film.load(resume_path, saved_seed, saved_pass_samples, saved_sampler, error)) {
+			std::cerr << "Failed to resume: " << error << "\n";
+			return 1;
+		}
+		// the remaining passes only line up with the saved ones when they sample the same streams
+		if (film.width() != width || film.height() != height || saved_seed != seed
+			|| saved_pass_samples != progressive_settings._pass_samples || saved_sampler != sampler) {
+			std::cerr << "Checkpoint " << resume_path << " was rendered at " << film.width() << "x" << film.height()
+				<< " with seed " << saved_seed << ", " << saved_pass_samples << " sample(s) per pass and the "
+				<< sampler_name(saved_sampler) << " sampler\n";
+			return 1;
+		}
+		int32_t pass_samples = std::max(1, progressive_settings._pass_samples);
+		if (denoise_output && film.passes() * pass_samples >= samples) {
+			std::cerr << "Checkpoint " << resume_path << " has no pass left to render, the denoiser guides come from the first pass that runs\n";
+			return 1;
+		}
+		std::cout << "Resuming after pass " << film.passes() << "\n";
+	}
 	std::vector<vector3> frame_buffer;
 	frame_buffer.resize(width * height);
+	// denoiser guides, only filled when they are needed
+	std::vector<FirstHit> features;
+	if (denoise_output)
+		features.resize(frame_buffer.size());
+	FirstHit* feature_buffer = denoise_output ? features.data() : nullptr;
 	
+	ThreadPool pool(threads, pin_threads);
+	pool.init();
+
+	if (session_path) {
+		SceneInfo scene = { width, height, samples, tile_size, seed, max_depth, rr_depth, sampler, packet_size, &cam, &world };
+		RenderSession session(pool, world, cam, scene);
+		std::ifstream file;
+		if (strcmp(session_path, "-") != 0) {
+			file.open(session_path);
+			if (!file.is_open()) {
+				std::cerr << "Failed to open " << session_path << "\n";
+				return 1;
+			}
+		}
+		if (!run_session(session, world, settings, file.is_open() ? file : std::cin, output_path, format))
+			return 1;
+		return report_profile(trace_path) ? 0 : 1;
+	}
+
+	if (frames > 1) {
+		// one pool, world and film for the whole sequence. frame f is written on its own thread from
+		// one of two buffers while frame f + 1 renders into the film
+		std::vector<vector3> buffers[2];
+		buffers[0].swap(frame_buffer);
+		buffers[1].resize(buffers[0].size());
+		std::future<bool> writes[2];
+		int32_t rebuilds = 0;
+		int32_t refits = 0;
+		uint64_t total_rays = 0;
+
+		for (int32_t f = 0; f < frames; f++)
+		{
+			auto frame_start = std::chrono::high_resolution_clock::now();
+			float time = f / fps;
+			SceneSettings frame_settings = settings;
+			animation.camera_at(time, frame_settings._lookfrom, frame_settings._lookat);
+			animation.apply(time, world);
+			WorldUpdate update = world.update();
+			rebuilds += update == WorldUpdate::Rebuild ? 1 : 0;
+			refits += update == WorldUpdate::Refit ? 1 : 0;
+			Camera frame_cam(frame_settings._lookfrom, frame_settings._lookat, frame_settings._vup, frame_settings._vfov,
+				nx / ny, frame_settings._aperture, frame_settings._focus_dist);
+			auto render_start = std::chrono::high_resolution_clock::now();
+
+			SceneInfo scene = { width, height, samples, tile_size, seed, max_depth, rr_depth, sampler, packet_size, &frame_cam, &world };
+			film.clear();
+			ray_total() = 0;
+			if (progressive)
+				progressive_process(pool, scene, progressive_settings, film, nullptr, feature_buffer);
+			else if (wavefront)
+				wavefront_process(pool, scene, film, nullptr, feature_buffer);
+			else
+				thread_process(pool, scene, film, nullptr, feature_buffer);
+			auto render_end = std::chrono::high_resolution_clock::now();
+
+			// the buffer is free again once the write of two frames ago is done
+			std::vector<vector3>& buffer = buffers[f % 2];
+			if (writes[f % 2].valid() && !writes[f % 2].get())
+				return 1;
+			film.resolve(buffer.data());
+			if (denoise_output)
+				denoise(pool, width, height, feature_buffer, denoise_settings, buffer.data());
+
+			std::string path = frame_path(output_path, f);
+			const vector3* pixels = buffer.data();
+			writes[f % 2] = std::async(std::launch::async, [path, format, width, height, pixels]() {
+				if (write_image(path.c_str(), format, width, height, pixels))
+					return true;
+				std::cerr << "Failed to write " << path << "\n";
+				return false;
+			});
+
+			uint64_t rays = ray_total().load();
+			total_rays += rays;
+			std::chrono::duration<double> update_time = render_start - frame_start;
+			std::chrono::duration<double> render_time = render_end - render_start;
+			std::chrono::duration<double> frame_time = std::chrono::high_resolution_clock::now() - frame_start;
+			std::cout << "Frame " << f << ": " << update_name(update) << " " << update_time.count() * 1000.0 << " ms, render "
+				<< render_time.count() * 1000.0 << " ms, " << rays / render_time.count() / 1e6 << " Mrays/s, total "
+				<< frame_time.count() * 1000.0 << " ms\n";
+		}
+
+		bool written = true;
+		for (std::future<bool>& write : writes)
+			if (write.valid() && !write.get())
+				written = false;
+		if (!written)
+			return 1;
+
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		std::cout << "Rendered " << frames << " frame(s) in " << elapsed.count() << " second(s), "
+			<< frames / elapsed.count() << " frame(s)/s, " << total_rays / elapsed.count() / 1e6 << " Mrays/s, "
+			<< rebuilds << " rebuild(s), " << refits << " refit(s)\n";
+		return report_profile(trace_path) ? 0 : 1;
+	}
+
+	// finished tiles go straight to disk while the rest of the frame renders
+	TileImageWriter writer;
+	std::function<void(const Tile&)> on_tile;
+	if (stream_tiles) {
+		if (!writer.open(output_path, format, width, height)) {
+			std::cerr << "Failed to open " << output_path << "\n";
+			return 1;
+		}
+		vector3* frame = frame_buffer.data();
+		on_tile = [&writer, &film, frame](const Tile& tile) {
+			film.resolve_tile(tile, frame);
+			writer.write_tile(tile, frame);
+		};
+	}
+
 	// process all ray-tracing and generate a color buffer
-	SceneInfo scene = { width, height, samples, &cam, &world };
-	thread_process(scene, frame_buffer.data());
+	SceneInfo scene = { width, height, samples, tile_size, seed, max_depth, rr_depth, sampler, packet_size, &cam, &world };
+	if (progressive) {
+		bool checkpoint_failed = false;
+		int64_t total = progressive_process(pool, scene, progressive_settings, film, [&](int32_t pass, int64_t active) {
+			std::cout << "Pass " << pass + 1 << ": " << active << " active pixel(s)\n";
+			if (write_passes) {
+				film.resolve(frame_buffer.data());
+				write_image(output_path, format, width, height, frame_buffer.data());
+			}
+			std::string error;
+			if (checkpoint_path && !film.save(checkpoint_path, seed, progressive_settings._pass_samples, sampler, error)) {
+				std::cerr << "Failed to checkpoint: " << error << "\n";
+				checkpoint_failed = true;
+			}
+		}, feature_buffer);
+		if (checkpoint_failed)
+			return 1;
+		std::cout << "Average " << (double)total / ((double)width * height) << " sample(s) per pixel\n";
+	}
+	else if (coordinate) {
+		// the workers render, this process only hands out tiles and merges them
+		RenderJob job = { settings, tile_size, seed, rr_depth, sampler, wavefront, scene_name, {} };
+		std::string error;
+		if (scene_from_file && !job.read_scene(scene_name, error)) {
+			std::cerr << "Failed to read scene: " << error << "\n";
+			return 1;
+		}
+		RenderCoordinator coordinator(job);
+		coordinator.set_worker_timeout(worker_timeout);
+		// the job carries the whole scene, without --listen only this machine gets to see it
+		if (!coordinator.listen((uint16_t)std::max(0, listen_port), listen_port < 0, error)) {
+			std::cerr << "Failed to coordinate: " << error << "\n";
+			return 1;
+		}
+		std::cout << "Waiting for workers on port " << coordinator.port() << "\n" << std::flush;
+
+		std::vector<std::thread> local_workers;
+		int32_t worker_threads = threads > 0 ? threads : std::max(1, ThreadPool::default_thread_count() / std::max(1, spawn_workers));
+		for (int32_t w = 0; w < spawn_workers; w++) {
+			coordinator.add_local_worker();
+			local_workers.push_back(spawn_local_worker(argv[0], coordinator.port(), worker_threads,
+				[&coordinator]() { coordinator.local_worker_exited(); }));
+		}
+		bool finished = coordinator.run(film, on_tile, error);
+		for (std::thread& t : local_workers)
+			t.join();
+		if (!finished) {
+			std::cerr << "Failed to coordinate: " << error << "\n";
+			return 1;
+		}
+	}
+	else if (wavefront) {
+		wavefront_process(pool, scene, film, on_tile, feature_buffer);
+	}
+	else {
+		thread_process(pool, scene, film, on_tile, feature_buffer);
+	}
+	if (stream_tiles && !writer.close()) {
+		std::cerr << "Failed to write " << output_path << "\n";
+		return 1;
+	}
+	film.resolve(frame_buffer.data());
 
 	auto finish = std::chrono::high_resolution_clock::now();
-	std::cout << "Finished image processing in  " << std::chrono::duration_cast<std::chrono::seconds>(finish - start).count() << " second(s)\n";
+	std::cout << "Finished image processing in  " << std::chrono::duration<double>(finish - start).count() << " second(s)\n";
 
-	// dump image data to ppm file
-	write_ppm("output.ppm", width, height, frame_buffer); 
+	if (denoise_output) {
+		start = std::chrono::high_resolution_clock::now();
+		denoise(pool, width, height, feature_buffer, denoise_settings, frame_buffer.data());
+		finish = std::chrono::high_resolution_clock::now();
+		std::cout << "Finished denoising in  " << std::chrono::duration<double>(finish - start).count() << " second(s)\n";
+	}
 
-	//std::thread t(&thread_process, params);   // t starts running
-	//t.join();
+	if (!report_profile(trace_path))
+		return 1;
 
-	
+	if (!stream_tiles) {
+		// dump image data in one write
+		start = std::chrono::high_resolution_clock::now();
+		if (!write_image(output_path, format, width, height, frame_buffer.data())) {
+			std::cerr << "Failed to write " << output_path << "\n";
+			return 1;
+		}
+		finish = std::chrono::high_resolution_clock::now();
+		std::cout << "Finished writing file in  " << std::chrono::duration<double>(finish - start).count() << " second(s)\n";
+	}
 }
\ No newline at end of file
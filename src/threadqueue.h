@@ -2,53 +2,144 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <utility>
 #include <vector>
 
-#include "SafeQueue.h"
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
+#include "safequeue.h"
+
+// Work stealing thread pool. Every worker owns a queue, tasks submitted from a worker go to its
+// own queue and tasks submitted from outside are spread round robin. Idle workers steal from the
+// front of the other queues before going to sleep.
 class ThreadPool {
 private:
+	using Task = std::function<void()>;
+
+	struct WorkerInfo {
+		ThreadPool* pool = nullptr;
+		int id = -1;
+	};
+
+	// identifies the pool and queue of the calling thread, so nested submits stay local
+	static WorkerInfo& current_worker() {
+		static thread_local WorkerInfo info;
+		return info;
+	}
+
 	class ThreadWorker {
 	private:
 		int m_id;
 		ThreadPool* m_pool;
 	public:
 		ThreadWorker(ThreadPool* pool, const int id)
-			: m_pool(pool), m_id(id) {
+			: m_id(id), m_pool(pool) {
 		}
 
 		void operator()() {
-			std::function<void()> func;
-			bool dequeued;
-			while (!m_pool->m_shutdown) {
-				{
-					std::unique_lock<std::mutex> lock(m_pool->m_conditional_mutex);
-					if (m_pool->m_queue.empty()) {
-						m_pool->m_conditional_lock.wait(lock);
-					}
-					dequeued = m_pool->m_queue.dequeue(func);
-				}
-				if (dequeued) {
+			current_worker().pool = m_pool;
+			current_worker().id = m_id;
+
+			Task func;
+			while (true) {
+				if (m_pool->pop_task(m_id, func)) {
 					func();
+					func = nullptr;
+					continue;
+				}
+
+				std::unique_lock<std::mutex> lock(m_pool->m_conditional_mutex);
+				m_pool->m_conditional_lock.wait(lock, [this]() {
+					return m_pool->m_pending.load() > 0 || m_pool->m_shutdown.load();
+				});
+				// drain whatever is still queued before leaving
+				if (m_pool->m_shutdown.load() && m_pool->m_pending.load() == 0) {
+					break;
 				}
 			}
 		}
 	};
 
-	bool m_shutdown;
-	SafeQueue<std::function<void()>> m_queue;
+	std::atomic<bool> m_shutdown;
+	std::atomic<int> m_pending;
+	std::atomic<unsigned> m_next_queue;
+	bool m_pin_threads;
+	std::vector<std::unique_ptr<SafeQueue<Task>>> m_queues;
 	std::vector<std::thread> m_threads;
 	std::mutex m_conditional_mutex;
 	std::condition_variable m_conditional_lock;
+
+	bool pop_task(int id, Task& func) {
+		int n = (int)m_queues.size();
+		if (m_queues[id]->dequeue_back(func)) {
+			m_pending--;
+			return true;
+		}
+		for (int i = 1; i < n; ++i) {
+			if (m_queues[(id + i) % n]->dequeue(func)) {
+				m_pending--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void push_task(Task&& func) {
+		WorkerInfo& info = current_worker();
+		unsigned index = info.pool == this ? (unsigned)info.id : m_next_queue++ % (unsigned)m_queues.size();
+
+		// bump the counter under the lock so a worker can not miss the wake up between its check and wait
+		{
+			std::unique_lock<std::mutex> lock(m_conditional_mutex);
+			m_pending++;
+		}
+		m_queues[index]->enqueue(std::move(func));
+		m_conditional_lock.notify_one();
+	}
+
+	static void pin_to_core(std::thread& thread, int core) {
+#if defined(_WIN32)
+		SetThreadAffinityMask((HANDLE)thread.native_handle(), (DWORD_PTR)1 << (core % (8 * sizeof(DWORD_PTR))));
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(core % CPU_SETSIZE, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &set);
+#else
+		(void)thread;
+		(void)core;
+#endif
+	}
+
 public:
-	ThreadPool(const int n_threads)
-		: m_threads(std::vector<std::thread>(n_threads)), m_shutdown(false) {
+	// n_threads <= 0 sizes the pool to the hardware concurrency
+	ThreadPool(int n_threads = 0, bool pin_threads = false)
+		: m_shutdown(false), m_pending(0), m_next_queue(0), m_pin_threads(pin_threads) {
+		if (n_threads <= 0) {
+			n_threads = default_thread_count();
+		}
+		m_threads.resize(n_threads);
+		for (int i = 0; i < n_threads; ++i) {
+			m_queues.emplace_back(new SafeQueue<Task>());
+		}
+	}
+
+	~ThreadPool() {
+		shutdown();
 	}
 
 	ThreadPool(const ThreadPool&) = delete;
@@ -57,19 +148,34 @@ public:
 	ThreadPool& operator=(const ThreadPool&) = delete;
 	ThreadPool& operator=(ThreadPool&&) = delete;
 
+	static int default_thread_count() {
+		unsigned n = std::thread::hardware_concurrency();
+		return n > 0 ? (int)n : 1;
+	}
+
+	int size() const {
+		return (int)m_threads.size();
+	}
+
 	// Inits thread pool
 	void init() {
-		for (int i = 0; i < m_threads.size(); ++i) {
+		for (int i = 0; i < (int)m_threads.size(); ++i) {
 			m_threads[i] = std::thread(ThreadWorker(this, i));
+			if (m_pin_threads) {
+				pin_to_core(m_threads[i], i);
+			}
 		}
 	}
 
-	// Waits until threads finish their current task and shutdowns the pool
+	// Waits until threads finish the queued tasks and shutdowns the pool
 	void shutdown() {
-		m_shutdown = true;
+		{
+			std::unique_lock<std::mutex> lock(m_conditional_mutex);
+			m_shutdown = true;
+		}
 		m_conditional_lock.notify_all();
 
-		for (int i = 0; i < m_threads.size(); ++i) {
+		for (int i = 0; i < (int)m_threads.size(); ++i) {
 			if (m_threads[i].joinable()) {
 				m_threads[i].join();
 			}
@@ -85,15 +191,9 @@ public:
 		auto task_ptr = std::make_shared<std::packaged_task<decltype(f(args...))()>>(func);
 
 		// Wrap packaged task into void function
-		std::function<void()> wrapper_func = [task_ptr]() {
+		push_task([task_ptr]() {
 			(*task_ptr)();
-		};
-
-		// Enqueue generic wrapper function
-		m_queue.enqueue(wrapper_func);
-
-		// Wake up one thread if its waiting
-		m_conditional_lock.notify_one();
+		});
 
 		// Return future from promise
 		return task_ptr->get_future();
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+#include "threadqueue.h"
+#include "profile.h"
+
+// rectangle of pixels in image space, y grows downwards like the rows of the output buffer
+struct Tile
+{
+	int32_t _x0;
+	int32_t _y0;
+	int32_t _x1;	// exclusive
+	int32_t _y1;	// exclusive
+};
+
+// hands out tiles of the frame (or of a region of it) to any number of workers through a single atomic counter
+// and lets the caller wait for all of them with one barrier instead of a future per job.
+// workers register with join() and call leave() when they run out of tiles, wait() only returns
+// once every worker has left, so the scheduler can't go out of scope under a late next()
+class TileScheduler
+{
+public:
+	TileScheduler(int32_t width, int32_t height, int32_t tile_size)
+		: TileScheduler(Tile{ 0, 0, width, height }, tile_size)
+	{
+	}
+
+	TileScheduler(const Tile& region, int32_t tile_size)
+		: _region(region), _tile_size(std::max(1, tile_size)), _next(0), _workers(0)
+	{
+		_tiles_x = (_region._x1 - _region._x0 + _tile_size - 1) / _tile_size;
+		_tiles_y = (_region._y1 - _region._y0 + _tile_size - 1) / _tile_size;
+	}
+
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+
+	inline int32_t tile_count() const { return _tiles_x * _tiles_y; }
+
+	Tile tile(int32_t index) const {
+		int32_t tx = index % _tiles_x;
+		int32_t ty = index / _tiles_x;
+		Tile t;
+		t._x0 = _region._x0 + tx * _tile_size;
+		t._y0 = _region._y0 + ty * _tile_size;
+		t._x1 = std::min(t._x0 + _tile_size, _region._x1);
+		t._y1 = std::min(t._y0 + _tile_size, _region._y1);
+		return t;
+	}
+
+	// grabs the next unprocessed tile, returns false once the frame is exhausted
+	bool next(Tile& t) {
+		int32_t index = _next.fetch_add(1, std::memory_order_relaxed);
+		if (index >= tile_count())
+			return false;
+		t = tile(index);
+		return true;
+	}
+
+	// call before the worker is started
+	void join() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_workers++;
+	}
+
+	// the last thing a worker does with the scheduler, the count drops under the lock so wait()
+	// can't see it before the worker is done touching the scheduler
+	void leave() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (--_workers == 0)
+			_done.notify_all();
+	}
+
+	void wait() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_done.wait(lock, [this]() { return _workers == 0; });
+	}
+
+private:
+	Tile _region;
+	int32_t _tile_size;
+	int32_t _tiles_x;
+	int32_t _tiles_y;
+	std::atomic<int32_t> _next;
+	int32_t _workers;	// guarded by _mutex
+	std::mutex _mutex;
+	std::condition_variable _done;
+};
+
+// runs fn(tile) over every tile of region on the pool and returns once all of them are done
+void for_each_tile(ThreadPool& pool, const Tile& region, int32_t tile_size, const std::function<void(const Tile&)>& fn)
+{
+	const int32_t n_threads = pool.size();
+
+	// one long running job per worker, each pulls tiles until the region is done
+	TileScheduler scheduler(region, tile_size);
+	for (int32_t t = 0; t < n_threads; t++)
+	{
+		scheduler.join();
+		pool.submit([&scheduler, &fn]() {
+			Tile tile;
+			while (scheduler.next(tile)) {
+				SPUD_TRACE_TILE(tile);
+				fn(tile);
+			}
+			scheduler.leave();
+		});
+	}
+
+	scheduler.wait();
+}
+
+inline void for_each_tile(ThreadPool& pool, int32_t width, int32_t height, int32_t tile_size,
+	const std::function<void(const Tile&)>& fn)
+{
+	for_each_tile(pool, Tile{ 0, 0, width, height }, tile_size, fn);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <math.h>
+
+#include "vector3.h"
+#include "aabb.h"
+#include "math_utils.h"
+
+// affine transform as the top three rows of a 4x4 matrix, the last column is the translation
+class Transform
+{
+public:
+	Transform() : Transform(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0) {}
+
+	Transform(float m00, float m01, float m02, float m03,
+		float m10, float m11, float m12, float m13,
+		float m20, float m21, float m22, float m23)
+	{
+		_m[0][0] = m00; _m[0][1] = m01; _m[0][2] = m02; _m[0][3] = m03;
+		_m[1][0] = m10; _m[1][1] = m11; _m[1][2] = m12; _m[1][3] = m13;
+		_m[2][0] = m20; _m[2][1] = m21; _m[2][2] = m22; _m[2][3] = m23;
+	}
+
+	static Transform translate(const vector3& t) {
+		return Transform(1, 0, 0, t.x(), 0, 1, 0, t.y(), 0, 0, 1, t.z());
+	}
+
+	static Transform scale(const vector3& s) {
+		return Transform(s.x(), 0, 0, 0, 0, s.y(), 0, 0, 0, 0, s.z(), 0);
+	}
+
+	// right handed rotation about axis
+	static Transform rotate(const vector3& axis, float degrees);
+
+	// the transform that applies b first and this second
+	Transform operator*(const Transform& b) const;
+
+	inline vector3 point(const vector3& p) const {
+		return vector3(_m[0][0] * p.x() + _m[0][1] * p.y() + _m[0][2] * p.z() + _m[0][3],
+			_m[1][0] * p.x() + _m[1][1] * p.y() + _m[1][2] * p.z() + _m[1][3],
+			_m[2][0] * p.x() + _m[2][1] * p.y() + _m[2][2] * p.z() + _m[2][3]);
+	}
+
+	inline vector3 vector(const vector3& v) const {
+		return vector3(_m[0][0] * v.x() + _m[0][1] * v.y() + _m[0][2] * v.z(),
+			_m[1][0] * v.x() + _m[1][1] * v.y() + _m[1][2] * v.z(),
+			_m[2][0] * v.x() + _m[2][1] * v.y() + _m[2][2] * v.z());
+	}
+
+	// v times the linear part, i.e. the transposed linear part applied to v. called on a world to
+	// object transform it takes object space normals to world space, non uniform scales included
+	inline vector3 transposed_vector(const vector3& v) const {
+		return vector3(_m[0][0] * v.x() + _m[1][0] * v.y() + _m[2][0] * v.z(),
+			_m[0][1] * v.x() + _m[1][1] * v.y() + _m[2][1] * v.z(),
+			_m[0][2] * v.x() + _m[1][2] * v.y() + _m[2][2] * v.z());
+	}
+
+	Transform inverse() const;
+
+	// box around the transformed corners of box
+	AABB bounds(const AABB& box) const;
+
+private:
+	float _m[3][4];
+};
+
+Transform Transform::rotate(const vector3& axis, float degrees)
+{
+	vector3 a = unit_vector(axis);
+	float angle = degrees * (float)M_PI / 180.0f;
+	float c = cosf(angle);
+	float s = sinf(angle);
+	float t = 1.0f - c;
+	return Transform(
+		t * a.x() * a.x() + c, t * a.x() * a.y() - s * a.z(), t * a.x() * a.z() + s * a.y(), 0,
+		t * a.x() * a.y() + s * a.z(), t * a.y() * a.y() + c, t * a.y() * a.z() - s * a.x(), 0,
+		t * a.x() * a.z() - s * a.y(), t * a.y() * a.z() + s * a.x(), t * a.z() * a.z() + c, 0);
+}
+
+Transform Transform::operator*(const Transform& b) const
+{
+	Transform r;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 4; j++) {
+			r._m[i][j] = _m[i][0] * b._m[0][j] + _m[i][1] * b._m[1][j] + _m[i][2] * b._m[2][j];
+		}
+		r._m[i][3] += _m[i][3];
+	}
+	return r;
+}
+
+Transform Transform::inverse() const
+{
+	// inverse of the linear part through the adjugate, the translation follows from it
+	const float (*m)[4] = _m;
+	float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+	float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+	float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+	float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+	float inv_det = 1.0f / det;
+
+	Transform r(
+		c00 * inv_det, (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det, (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det, 0,
+		c01 * inv_det, (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det, (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det, 0,
+		c02 * inv_det, (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det, (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det, 0);
+	vector3 t = r.vector(vector3(m[0][3], m[1][3], m[2][3]));
+	r._m[0][3] = -t.x();
+	r._m[1][3] = -t.y();
+	r._m[2][3] = -t.z();
+	return r;
+}
+
+AABB Transform::bounds(const AABB& box) const
+{
+	AABB result;
+	for (int corner = 0; corner < 8; corner++) {
+		vector3 p((corner & 1) ? box.max().x() : box.min().x(),
+			(corner & 2) ? box.max().y() : box.min().y(),
+			(corner & 4) ? box.max().z() : box.min().z());
+		result.expand(point(p));
+	}
+	return result;
+}
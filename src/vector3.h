@@ -1,8 +1,99 @@
 #pragma once
 
 #include <stdlib.h>
+#include <math.h>
 #include <iostream>
 
+#include "fast_math.h"
+
+#if defined(SPUD_SSE_VECTOR3) && !defined(SPUD_SIMD_SSE)
+#error "SPUD_SSE_VECTOR3 needs SSE2"
+#endif
+
+#if defined(SPUD_SSE_VECTOR3)
+// one __m128 per vector, padded to 16 bytes. the fourth lane is never read. every operation
+// rounds the same way as the scalar class below, so both builds render identical images
+class alignas(16) vector3
+{
+public:
+	vector3() : _v(_mm_setzero_ps()) {}
+	vector3(float x, float y, float z) : _v(_mm_set_ps(0.0f, z, y, x)) {}
+	explicit vector3(__m128 v) : _v(v) {}
+
+	inline float x() const { return _mm_cvtss_f32(_v); }
+	inline float y() const { return _mm_cvtss_f32(_mm_shuffle_ps(_v, _v, _MM_SHUFFLE(1, 1, 1, 1))); }
+	inline float z() const { return _mm_cvtss_f32(_mm_shuffle_ps(_v, _v, _MM_SHUFFLE(2, 2, 2, 2))); }
+
+	inline float r() const { return x(); }
+	inline float g() const { return y(); }
+	inline float b() const { return z(); }
+
+	inline float operator[](int i) const {
+		alignas(16) float f[4];
+		_mm_store_ps(f, _v);
+		return f[i];
+	}
+
+	inline __m128 m128() const { return _v; }
+
+	inline const vector3& operator+() const { return *this; }
+	inline vector3 operator-() const {
+		return vector3(_mm_xor_ps(_v, _mm_set1_ps(-0.0f)));
+	}
+
+	inline vector3 operator+(const vector3& vec) const { return vector3(_mm_add_ps(_v, vec._v)); }
+	inline vector3 operator-(const vector3& vec) const { return vector3(_mm_sub_ps(_v, vec._v)); }
+	inline vector3 operator*(const vector3& vec) const { return vector3(_mm_mul_ps(_v, vec._v)); }
+	inline vector3 operator/(const vector3& vec) const { return vector3(_mm_div_ps(_v, vec._v)); }
+
+	inline const vector3& operator+=(const vector3& vec) { _v = _mm_add_ps(_v, vec._v); return *this; }
+	inline const vector3& operator-=(const vector3& vec) { _v = _mm_sub_ps(_v, vec._v); return *this; }
+	inline const vector3& operator*=(const vector3& vec) { _v = _mm_mul_ps(_v, vec._v); return *this; }
+	inline const vector3& operator/=(const vector3& vec) { _v = _mm_div_ps(_v, vec._v); return *this; }
+	inline const vector3& operator*=(float t) { _v = _mm_mul_ps(_v, _mm_set1_ps(t)); return *this; }
+	inline const vector3& operator/=(float t) { _v = _mm_div_ps(_v, _mm_set1_ps(t)); return *this; }
+
+	inline float length() const {
+		return math_sqrt(squared_length());
+	}
+
+	inline float squared_length() const {
+#if defined(SPUD_FMA)
+		return fmaf(x(), x(), fmaf(y(), y(), z() * z()));
+#else
+		// (x * x + y * y) + z * z, the order of the scalar sum
+		__m128 m = _mm_mul_ps(_v, _v);
+		__m128 s = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+		return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2))));
+#endif
+	}
+
+	inline void make_unit_vector() {
+		*this *= math_rsqrt(squared_length());
+	}
+
+	inline std::istream& operator >>(std::istream& stream)
+	{
+		float x, y, z;
+		stream >> x >> y >> z;
+		*this = vector3(x, y, z);
+		return stream;
+	}
+
+	inline std::ostream& operator <<(std::ostream& stream)
+	{
+		stream << x() << " " << y() << " " << z();
+		return stream;
+	}
+
+	static vector3 ONE;
+	static vector3 ZERO;
+	static vector3 UP;
+private:
+
+	__m128 _v;
+};
+#else
 class vector3
 {
 public: 
@@ -17,6 +108,8 @@ public:
 	inline float g() const { return _y; }
 	inline float b() const { return _z; }
 
+	inline float operator[](int i) const { return i == 0 ? _x : (i == 1 ? _y : _z); }
+
 	inline const vector3& operator+() const { return *this; }
 	inline vector3 operator-() const {
 		return vector3(-_x, -_y, -_z);
@@ -81,15 +174,19 @@ public:
 	}
 
 	inline float length() const {
-		return sqrt((_x * _x) + (_y * _y) + (_z * _z));
+		return math_sqrt(squared_length());
 	}
 
 	inline float squared_length() const {
+#if defined(SPUD_FMA)
+		return fmaf(_x, _x, fmaf(_y, _y, _z * _z));
+#else
 		return (_x * _x) + (_y * _y) + (_z * _z);
+#endif
 	}
 
 	inline void make_unit_vector() {
-		float k = 1.0f / length();
+		float k = math_rsqrt(squared_length());
 		_x *= k; 
 		_y *= k;
 		_z *= k;
@@ -114,31 +211,89 @@ private:
 
 	float _x = 0.0f, _y = 0.0f, _z = 0.0f;
 };
+#endif
 
 inline float dot(const vector3& v1, const vector3& v2) {
+#if defined(SPUD_SSE_VECTOR3) && !defined(SPUD_FMA)
+	__m128 m = _mm_mul_ps(v1.m128(), v2.m128());
+	__m128 s = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2))));
+#elif defined(SPUD_FMA)
+	return fmaf(v1.x(), v2.x(), fmaf(v1.y(), v2.y(), v1.z() * v2.z()));
+#else
 	return (v1.x() * v2.x()) + (v1.y() * v2.y()) + (v1.z() * v2.z());
+#endif
 }
 
 inline vector3 cross(const vector3& v1, const vector3& v2) {
+#if defined(SPUD_SSE_VECTOR3) && !defined(SPUD_FMA)
+	// lanes (y z' - z y', x z' - z x', x y' - y x'), then the middle one negated like the scalar code
+	__m128 a = v1.m128();
+	__m128 b = v2.m128();
+	__m128 l = _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 0, 1)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 2, 2)));
+	__m128 r = _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 2, 2)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 0, 1)));
+	return vector3(_mm_xor_ps(_mm_sub_ps(l, r), _mm_set_ps(0.0f, 0.0f, -0.0f, 0.0f)));
+#elif defined(SPUD_FMA)
+	return vector3(
+		fmaf(v1.y(), v2.z(), -v1.z() * v2.y()),
+		fmaf(v1.z(), v2.x(), -v1.x() * v2.z()),
+		fmaf(v1.x(), v2.y(), -v1.y() * v2.x()));
+#else
 	return vector3(
 		(v1.y() * v2.z() - v1.z() * v2.y()),
 		(-(v1.x() * v2.z() - v1.z() * v2.x())),
 		(v1.x() * v2.y() - v1.y() * v2.x()));
+#endif
 }
 
 inline vector3 operator*(const vector3& v, float t) {
+#if defined(SPUD_SSE_VECTOR3)
+	return vector3(_mm_mul_ps(v.m128(), _mm_set1_ps(t)));
+#else
 	return vector3(v.x() * t, v.y() * t, v.z() * t);
+#endif
 }
 
 inline vector3 operator*(float t, const vector3& v) {
+#if defined(SPUD_SSE_VECTOR3)
+	return vector3(_mm_mul_ps(_mm_set1_ps(t), v.m128()));
+#else
 	return vector3(t*v.x(), t * v.y(), t * v.z());
+#endif
 }
 
 
 inline vector3 operator/(const vector3& v, float t) {
+#if defined(SPUD_FAST_MATH)
+	return v * math_rcp(t);
+#elif defined(SPUD_SSE_VECTOR3)
+	return vector3(_mm_div_ps(v.m128(), _mm_set1_ps(t)));
+#else
 	return vector3(v.x() / t, v.y() / t, v.z() / t);
+#endif
 }
 
 inline vector3 unit_vector(vector3 vec) {
+#if defined(SPUD_FAST_MATH)
+	return vec * math_rsqrt(vec.squared_length());
+#else
 	return vec / vec.length();
+#endif
+}
+
+// the SSE min and max return v2 where either lane is NaN, fminf / fmaxf only where v1 is
+inline vector3 vmin(const vector3& v1, const vector3& v2) {
+#if defined(SPUD_SSE_VECTOR3)
+	return vector3(_mm_min_ps(v1.m128(), v2.m128()));
+#else
+	return vector3(fminf(v1.x(), v2.x()), fminf(v1.y(), v2.y()), fminf(v1.z(), v2.z()));
+#endif
+}
+
+inline vector3 vmax(const vector3& v1, const vector3& v2) {
+#if defined(SPUD_SSE_VECTOR3)
+	return vector3(_mm_max_ps(v1.m128(), v2.m128()));
+#else
+	return vector3(fmaxf(v1.x(), v2.x()), fmaxf(v1.y(), v2.y()), fmaxf(v1.z(), v2.z()));
+#endif
 }
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "vector3.h"
+#include "simd.h"
+
+// 4 and 8 wide float types and vector3xN, a batch of N vectors stored as three columns (x, y, z),
+// so one operator works on N vectors at once. they are the building blocks of ray packets.
+// comparisons return masks of the same type with all bits set in the true lanes, for select()
+// and movemask(). without SSE (or with SPUD_NO_SIMD) everything falls back to plain loops, and
+// float8 without AVX is two float4 halves
+
+inline uint32_t float_bits(float f)
+{
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	return u;
+}
+
+inline float bits_float(uint32_t u)
+{
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+#if defined(SPUD_SIMD_SSE)
+
+class float4
+{
+public:
+	static const int WIDTH = 4;
+
+	float4() : _v(_mm_setzero_ps()) {}
+	float4(float s) : _v(_mm_set1_ps(s)) {}
+	float4(float a, float b, float c, float d) : _v(_mm_setr_ps(a, b, c, d)) {}
+	explicit float4(__m128 v) : _v(v) {}
+
+	static inline float4 load(const float* p) { return float4(_mm_loadu_ps(p)); }
+	inline void store(float* p) const { _mm_storeu_ps(p, _v); }
+
+	inline float operator[](int i) const {
+		alignas(16) float f[4];
+		_mm_store_ps(f, _v);
+		return f[i];
+	}
+
+	inline float4 operator-() const { return float4(_mm_xor_ps(_v, _mm_set1_ps(-0.0f))); }
+
+	friend inline float4 operator+(const float4& a, const float4& b) { return float4(_mm_add_ps(a._v, b._v)); }
+	friend inline float4 operator-(const float4& a, const float4& b) { return float4(_mm_sub_ps(a._v, b._v)); }
+	friend inline float4 operator*(const float4& a, const float4& b) { return float4(_mm_mul_ps(a._v, b._v)); }
+	friend inline float4 operator/(const float4& a, const float4& b) { return float4(_mm_div_ps(a._v, b._v)); }
+
+	friend inline float4 operator<(const float4& a, const float4& b) { return float4(_mm_cmplt_ps(a._v, b._v)); }
+	friend inline float4 operator<=(const float4& a, const float4& b) { return float4(_mm_cmple_ps(a._v, b._v)); }
+	friend inline float4 operator>(const float4& a, const float4& b) { return float4(_mm_cmpgt_ps(a._v, b._v)); }
+	friend inline float4 operator>=(const float4& a, const float4& b) { return float4(_mm_cmpge_ps(a._v, b._v)); }
+	friend inline float4 operator&(const float4& a, const float4& b) { return float4(_mm_and_ps(a._v, b._v)); }
+	friend inline float4 operator|(const float4& a, const float4& b) { return float4(_mm_or_ps(a._v, b._v)); }
+
+	friend inline float4 sqrt(const float4& a) { return float4(_mm_sqrt_ps(a._v)); }
+	friend inline float4 vmin(const float4& a, const float4& b) { return float4(_mm_min_ps(a._v, b._v)); }
+	friend inline float4 vmax(const float4& a, const float4& b) { return float4(_mm_max_ps(a._v, b._v)); }
+	friend inline float4 abs(const float4& a) { return float4(_mm_andnot_ps(_mm_set1_ps(-0.0f), a._v)); }
+
+	friend inline float4 rsqrt(const float4& a) {
+#if defined(SPUD_FAST_MATH)
+		// estimate plus one newton step, as math_rsqrt
+		__m128 y = _mm_rsqrt_ps(a._v);
+		__m128 yyx = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), a._v), y), y);
+		return float4(_mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), yyx)));
+#else
+		return float4(_mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(a._v)));
+#endif
+	}
+
+	// mask ? a : b, lane by lane
+	friend inline float4 select(const float4& mask, const float4& a, const float4& b) {
+		return float4(_mm_or_ps(_mm_and_ps(mask._v, a._v), _mm_andnot_ps(mask._v, b._v)));
+	}
+
+	// bit i set where lane i of the mask is true
+	friend inline int movemask(const float4& mask) { return _mm_movemask_ps(mask._v); }
+
+private:
+	__m128 _v;
+};
+
+#else
+
+class float4
+{
+public:
+	static const int WIDTH = 4;
+
+	float4() : float4(0.0f) {}
+	float4(float s) : float4(s, s, s, s) {}
+	float4(float a, float b, float c, float d) : _f{ a, b, c, d } {}
+
+	static inline float4 load(const float* p) { return float4(p[0], p[1], p[2], p[3]); }
+	inline void store(float* p) const { memcpy(p, _f, sizeof(_f)); }
+
+	inline float operator[](int i) const { return _f[i]; }
+
+	inline float4 operator-() const { return float4(-_f[0], -_f[1], -_f[2], -_f[3]); }
+
+	template <typename Op>
+	static inline float4 map(const float4& a, const float4& b, Op op) {
+		return float4(op(a._f[0], b._f[0]), op(a._f[1], b._f[1]), op(a._f[2], b._f[2]), op(a._f[3], b._f[3]));
+	}
+
+	friend inline float4 operator+(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x + y; }); }
+	friend inline float4 operator-(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x - y; }); }
+	friend inline float4 operator*(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x * y; }); }
+	friend inline float4 operator/(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x / y; }); }
+
+	friend inline float4 operator<(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return mask_lane(x < y); }); }
+	friend inline float4 operator<=(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return mask_lane(x <= y); }); }
+	friend inline float4 operator>(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return mask_lane(x > y); }); }
+	friend inline float4 operator>=(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return mask_lane(x >= y); }); }
+	friend inline float4 operator&(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return bits_float(float_bits(x) & float_bits(y)); }); }
+	friend inline float4 operator|(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return bits_float(float_bits(x) | float_bits(y)); }); }
+
+	friend inline float4 sqrt(const float4& a) { return float4(sqrtf(a._f[0]), sqrtf(a._f[1]), sqrtf(a._f[2]), sqrtf(a._f[3])); }
+	// same NaN handling as _mm_min_ps / _mm_max_ps: b unless the comparison holds
+	friend inline float4 vmin(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x < y ? x : y; }); }
+	friend inline float4 vmax(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x > y ? x : y; }); }
+	friend inline float4 abs(const float4& a) { return float4(fabsf(a._f[0]), fabsf(a._f[1]), fabsf(a._f[2]), fabsf(a._f[3])); }
+	friend inline float4 rsqrt(const float4& a) { return map(a, a, [](float x, float) { return math_rsqrt(x); }); }
+
+	friend inline float4 select(const float4& mask, const float4& a, const float4& b) {
+		float4 r;
+		for (int i = 0; i < 4; i++)
+			r._f[i] = float_bits(mask._f[i]) ? a._f[i] : b._f[i];
+		return r;
+	}
+
+	friend inline int movemask(const float4& mask) {
+		int bits = 0;
+		for (int i = 0; i < 4; i++)
+			bits |= (int)(float_bits(mask._f[i]) >> 31) << i;
+		return bits;
+	}
+
+private:
+	static inline float mask_lane(bool b) { return bits_float(b ? 0xffffffffu : 0u); }
+
+	float _f[4];
+};
+
+#endif
+
+#if defined(SPUD_SIMD_AVX)
+
+class float8
+{
+public:
+	static const int WIDTH = 8;
+
+	float8() : _v(_mm256_setzero_ps()) {}
+	float8(float s) : _v(_mm256_set1_ps(s)) {}
+	explicit float8(__m256 v) : _v(v) {}
+
+	static inline float8 load(const float* p) { return float8(_mm256_loadu_ps(p)); }
+	inline void store(float* p) const { _mm256_storeu_ps(p, _v); }
+
+	inline float operator[](int i) const {
+		alignas(32) float f[8];
+		_mm256_store_ps(f, _v);
+		return f[i];
+	}
+
+	inline float8 operator-() const { return float8(_mm256_xor_ps(_v, _mm256_set1_ps(-0.0f))); }
+
+	friend inline float8 operator+(const float8& a, const float8& b) { return float8(_mm256_add_ps(a._v, b._v)); }
+	friend inline float8 operator-(const float8& a, const float8& b) { return float8(_mm256_sub_ps(a._v, b._v)); }
+	friend inline float8 operator*(const float8& a, const float8& b) { return float8(_mm256_mul_ps(a._v, b._v)); }
+	friend inline float8 operator/(const float8& a, const float8& b) { return float8(_mm256_div_ps(a._v, b._v)); }
+
+	friend inline float8 operator<(const float8& a, const float8& b) { return float8(_mm256_cmp_ps(a._v, b._v, _CMP_LT_OQ)); }
+	friend inline float8 operator<=(const float8& a, const float8& b) { return float8(_mm256_cmp_ps(a._v, b._v, _CMP_LE_OQ)); }
+	friend inline float8 operator>(const float8& a, const float8& b) { return float8(_mm256_cmp_ps(a._v, b._v, _CMP_GT_OQ)); }
+	friend inline float8 operator>=(const float8& a, const float8& b) { return float8(_mm256_cmp_ps(a._v, b._v, _CMP_GE_OQ)); }
+	friend inline float8 operator&(const float8& a, const float8& b) { return float8(_mm256_and_ps(a._v, b._v)); }
+	friend inline float8 operator|(const float8& a, const float8& b) { return float8(_mm256_or_ps(a._v, b._v)); }
+
+	friend inline float8 sqrt(const float8& a) { return float8(_mm256_sqrt_ps(a._v)); }
+	friend inline float8 vmin(const float8& a, const float8& b) { return float8(_mm256_min_ps(a._v, b._v)); }
+	friend inline float8 vmax(const float8& a, const float8& b) { return float8(_mm256_max_ps(a._v, b._v)); }
+	friend inline float8 abs(const float8& a) { return float8(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a._v)); }
+
+	friend inline float8 rsqrt(const float8& a) {
+#if defined(SPUD_FAST_MATH)
+		__m256 y = _mm256_rsqrt_ps(a._v);
+		__m256 yyx = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), a._v), y), y);
+		return float8(_mm256_mul_ps(y, _mm256_sub_ps(_mm256_set1_ps(1.5f), yyx)));
+#else
+		return float8(_mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(a._v)));
+#endif
+	}
+
+	friend inline float8 select(const float8& mask, const float8& a, const float8& b) {
+		return float8(_mm256_blendv_ps(b._v, a._v, mask._v));
+	}
+
+	friend inline int movemask(const float8& mask) { return _mm256_movemask_ps(mask._v); }
+
+private:
+	__m256 _v;
+};
+
+#else
+
+class float8
+{
+public:
+	static const int WIDTH = 8;
+
+	float8() = default;
+	float8(float s) : _lo(s), _hi(s) {}
+	float8(const float4& lo, const float4& hi) : _lo(lo), _hi(hi) {}
+
+	static inline float8 load(const float* p) { return float8(float4::load(p), float4::load(p + 4)); }
+	inline void store(float* p) const { _lo.store(p); _hi.store(p + 4); }
+
+	inline float operator[](int i) const { return i < 4 ? _lo[i] : _hi[i - 4]; }
+
+	inline float8 operator-() const { return float8(-_lo, -_hi); }
+
+	friend inline float8 operator+(const float8& a, const float8& b) { return float8(a._lo + b._lo, a._hi + b._hi); }
+	friend inline float8 operator-(const float8& a, const float8& b) { return float8(a._lo - b._lo, a._hi - b._hi); }
+	friend inline float8 operator*(const float8& a, const float8& b) { return float8(a._lo * b._lo, a._hi * b._hi); }
+	friend inline float8 operator/(const float8& a, const float8& b) { return float8(a._lo / b._lo, a._hi / b._hi); }
+
+	friend inline float8 operator<(const float8& a, const float8& b) { return float8(a._lo < b._lo, a._hi < b._hi); }
+	friend inline float8 operator<=(const float8& a, const float8& b) { return float8(a._lo <= b._lo, a._hi <= b._hi); }
+	friend inline float8 operator>(const float8& a, const float8& b) { return float8(a._lo > b._lo, a._hi > b._hi); }
+	friend inline float8 operator>=(const float8& a, const float8& b) { return float8(a._lo >= b._lo, a._hi >= b._hi); }
+	friend inline float8 operator&(const float8& a, const float8& b) { return float8(a._lo & b._lo, a._hi & b._hi); }
+	friend inline float8 operator|(const float8& a, const float8& b) { return float8(a._lo | b._lo, a._hi | b._hi); }
+
+	friend inline float8 sqrt(const float8& a) { return float8(sqrt(a._lo), sqrt(a._hi)); }
+	friend inline float8 vmin(const float8& a, const float8& b) { return float8(vmin(a._lo, b._lo), vmin(a._hi, b._hi)); }
+	friend inline float8 vmax(const float8& a, const float8& b) { return float8(vmax(a._lo, b._lo), vmax(a._hi, b._hi)); }
+	friend inline float8 abs(const float8& a) { return float8(abs(a._lo), abs(a._hi)); }
+	friend inline float8 rsqrt(const float8& a) { return float8(rsqrt(a._lo), rsqrt(a._hi)); }
+
+	friend inline float8 select(const float8& mask, const float8& a, const float8& b) {
+		return float8(select(mask._lo, a._lo, b._lo), select(mask._hi, a._hi, b._hi));
+	}
+
+	friend inline int movemask(const float8& mask) { return movemask(mask._lo) | (movemask(mask._hi) << 4); }
+
+private:
+	float4 _lo;
+	float4 _hi;
+};
+
+#endif
+
+// N vectors as three columns, F is float4 or float8. the operators mirror vector3 and round the
+// same way, so outside the FMA build lane i of a result is bit for bit what vector3 computes for
+// the i-th inputs
+template <typename F>
+class vector3xN
+{
+public:
+	static const int WIDTH = F::WIDTH;
+
+	vector3xN() = default;
+	vector3xN(const F& x, const F& y, const F& z) : _x(x), _y(y), _z(z) {}
+	// v in every lane
+	explicit vector3xN(const vector3& v) : _x(v.x()), _y(v.y()), _z(v.z()) {}
+
+	// WIDTH vectors from consecutive entries of three column arrays
+	static inline vector3xN load(const float* x, const float* y, const float* z) {
+		return vector3xN(F::load(x), F::load(y), F::load(z));
+	}
+
+	inline void store(float* x, float* y, float* z) const {
+		_x.store(x);
+		_y.store(y);
+		_z.store(z);
+	}
+
+	// WIDTH vectors from an array of vector3
+	static inline vector3xN gather(const vector3* v) {
+		float x[WIDTH], y[WIDTH], z[WIDTH];
+		for (int i = 0; i < WIDTH; i++) {
+			x[i] = v[i].x();
+			y[i] = v[i].y();
+			z[i] = v[i].z();
+		}
+		return load(x, y, z);
+	}
+
+	inline void scatter(vector3* v) const {
+		float x[WIDTH], y[WIDTH], z[WIDTH];
+		store(x, y, z);
+		for (int i = 0; i < WIDTH; i++)
+			v[i] = vector3(x[i], y[i], z[i]);
+	}
+
+	inline F x() const { return _x; }
+	inline F y() const { return _y; }
+	inline F z() const { return _z; }
+
+	inline vector3 lane(int i) const { return vector3(_x[i], _y[i], _z[i]); }
+
+	inline const vector3xN& operator+() const { return *this; }
+	inline vector3xN operator-() const { return vector3xN(-_x, -_y, -_z); }
+
+	inline vector3xN operator+(const vector3xN& v) const { return vector3xN(_x + v._x, _y + v._y, _z + v._z); }
+	inline vector3xN operator-(const vector3xN& v) const { return vector3xN(_x - v._x, _y - v._y, _z - v._z); }
+	inline vector3xN operator*(const vector3xN& v) const { return vector3xN(_x * v._x, _y * v._y, _z * v._z); }
+	inline vector3xN operator/(const vector3xN& v) const { return vector3xN(_x / v._x, _y / v._y, _z / v._z); }
+
+	inline const vector3xN& operator+=(const vector3xN& v) { return *this = *this + v; }
+	inline const vector3xN& operator-=(const vector3xN& v) { return *this = *this - v; }
+	inline const vector3xN& operator*=(const vector3xN& v) { return *this = *this * v; }
+	inline const vector3xN& operator/=(const vector3xN& v) { return *this = *this / v; }
+	inline const vector3xN& operator*=(const F& t) { return *this = *this * t; }
+	inline const vector3xN& operator/=(const F& t) { return *this = *this / t; }
+
+	// per lane scalars, a float is broadcast
+	friend inline vector3xN operator*(const vector3xN& v, const F& t) { return vector3xN(v._x * t, v._y * t, v._z * t); }
+	friend inline vector3xN operator*(const F& t, const vector3xN& v) { return vector3xN(t * v._x, t * v._y, t * v._z); }
+	friend inline vector3xN operator/(const vector3xN& v, const F& t) { return vector3xN(v._x / t, v._y / t, v._z / t); }
+
+	inline F squared_length() const { return (_x * _x) + (_y * _y) + (_z * _z); }
+	inline F length() const { return sqrt(squared_length()); }
+
+	inline void make_unit_vector() { *this *= rsqrt(squared_length()); }
+
+	friend inline F dot(const vector3xN& a, const vector3xN& b) {
+		return (a._x * b._x) + (a._y * b._y) + (a._z * b._z);
+	}
+
+	friend inline vector3xN cross(const vector3xN& a, const vector3xN& b) {
+		return vector3xN(
+			(a._y * b._z - a._z * b._y),
+			(-(a._x * b._z - a._z * b._x)),
+			(a._x * b._y - a._y * b._x));
+	}
+
+	friend inline vector3xN unit_vector(const vector3xN& v) {
+#if defined(SPUD_FAST_MATH)
+		return v * rsqrt(v.squared_length());
+#else
+		return v / v.length();
+#endif
+	}
+
+	friend inline vector3xN vmin(const vector3xN& a, const vector3xN& b) {
+		return vector3xN(vmin(a._x, b._x), vmin(a._y, b._y), vmin(a._z, b._z));
+	}
+
+	friend inline vector3xN vmax(const vector3xN& a, const vector3xN& b) {
+		return vector3xN(vmax(a._x, b._x), vmax(a._y, b._y), vmax(a._z, b._z));
+	}
+
+	friend inline vector3xN select(const F& mask, const vector3xN& a, const vector3xN& b) {
+		return vector3xN(select(mask, a._x, b._x), select(mask, a._y, b._y), select(mask, a._z, b._z));
+	}
+
+private:
+	F _x;
+	F _y;
+	F _z;
+};
+
+typedef vector3xN<float4> vector3x4;
+typedef vector3xN<float8> vector3x8;
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "integrator.h"
+#include "film.h"
+#include "materials.h"
+#include "tiles.h"
+#include "threadqueue.h"
+
+// the qualified call is not virtual for the built in types and can be inlined
+template <typename M>
+inline bool scatter_as(const MaterialPool& pool, const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered, Sampler& sampler)
+{
+	return pool.get<M>(rec.mat_id).M::scatter(in, rec, attenuation, scattered, sampler);
+}
+
+// custom materials stay on the virtual path
+template <>
+inline bool scatter_as<Material>(const MaterialPool& pool, const ray& in, const HitRecord& rec, vector3& attenuation, ray& scattered, Sampler& sampler)
+{
+	return pool.material(rec.mat_id).scatter(in, rec, attenuation, scattered, sampler);
+}
+
+// stream (wavefront) path tracer. instead of following one path to the end it keeps a batch of
+// paths in flight and advances all of them one bounce at a time: intersect the whole batch, bucket
+// the hits by material type, run each material's scatter over its own contiguous bucket with the
+// concrete type known at compile time, then compact the survivors into the next batch.
+// one instance per worker, the buffers are reused from tile to tile
+class WavefrontRenderer
+{
+public:
+	explicit WavefrontRenderer(size_t max_batch = 1 << 16) : _max_batch(std::max<size_t>(1, max_batch)) {}
+
+	// adds the tile's samples to film. features, when set, is a frame sized buffer that receives the
+	// first hit guides of the tile
+	void render_tile(const SceneInfo& scene, const Tile& tile, Film& film, FirstHit* features = nullptr);
+
+private:
+	struct Path
+	{
+		ray		_ray;
+		vector3	_throughput;
+		Sampler	_sampler;
+		uint32_t	_pixel;		// index into the tile accumulator
+	};
+
+	void trace_batch(const SceneInfo& scene);
+
+	template <typename M>
+	void scatter_bucket(const SceneInfo& scene, int32_t depth, const std::vector<uint32_t>& bucket);
+
+	size_t _max_batch;
+	std::vector<Path> _paths;
+	std::vector<Path> _next;
+	std::vector<HitRecord> _hits;
+	std::vector<uint32_t> _buckets[(int)MaterialKind::Count];
+	std::vector<vector3> _accum;
+	std::vector<FirstHit> _features;	// per tile pixel sums, empty when not capturing
+};
+
+void WavefrontRenderer::render_tile(const SceneInfo& scene, const Tile& tile, Film& film, FirstHit* features)
+{
+	int32_t tile_width = tile._x1 - tile._x0;
+	int32_t tile_height = tile._y1 - tile._y0;
+	size_t pixels = (size_t)tile_width * tile_height;
+	float nx = scene._width * 1.0f;
+	float ny = scene._height * 1.0f;
+
+	_accum.assign(pixels, vector3::ZERO);
+	if (features)
+		_features.assign(pixels, FirstHit{ vector3::ZERO, vector3::ZERO, 0.0f });
+	else
+		_features.clear();
+
+	// split the tile's pixels into runs of at most _max_batch and the samples into chunks, so a
+	// batch never holds more than _max_batch paths however large the tile is
+	for (size_t p0 = 0; p0 < pixels; p0 += _max_batch)
+	{
+		size_t p1 = std::min(pixels, p0 + _max_batch);
+		int32_t chunk = (int32_t)std::max<size_t>(1, std::min<size_t>(scene._samples, _max_batch / (p1 - p0)));
+		for (int32_t s0 = 0; s0 < scene._samples; s0 += chunk)
+		{
+			int32_t s1 = std::min(scene._samples, s0 + chunk);
+
+			// camera rays for the whole chunk, every path carries its own sampler so the batching
+			// doesn't change the result
+			_paths.clear();
+			for (size_t pixel = p0; pixel < p1; pixel++)
+			{
+				int32_t y = tile._y0 + (int32_t)(pixel / tile_width);
+				int32_t i = tile._x0 + (int32_t)(pixel % tile_width);
+				int32_t j = scene._height - 1 - y;
+				for (int32_t s = s0; s < s1; s++)
+				{
+					Path path;
+					path._sampler = Sampler(scene._sampler, scene._seed, (uint32_t)i, (uint32_t)j, (uint32_t)scene._samples);
+					path._sampler.start_sample((uint32_t)s);
+					float du, dv;
+					path._sampler.get_2d(du, dv);
+					float u = (i + du) / nx;
+					float v = (j + dv) / ny;
+					path._ray = scene._camera->getRay(u, v, path._sampler);
+					path._throughput = vector3::ONE;
+					path._pixel = (uint32_t)pixel;
+					_paths.push_back(path);
+				}
+			}
+
+			trace_batch(scene);
+		}
+	}
+
+	float ns = scene._samples * 1.0f;
+	for (int32_t y = tile._y0; y < tile._y1; y++)
+	{
+		for (int32_t i = tile._x0; i < tile._x1; i++)
+		{
+			size_t pixel = (size_t)(y - tile._y0) * tile_width + (i - tile._x0);
+			// per sample luminances aren't kept apart in the batch, the sum is enough for the film's mean
+			film.add(i, y, _accum[pixel], luminance(_accum[pixel]), 0.0f, (uint32_t)scene._samples);
+			if (features) {
+				FirstHit f = _features[pixel];
+				f.scale(1.0f / ns);
+				features[(size_t)y * scene._width + i] = f;
+			}
+		}
+	}
+}
+
+void WavefrontRenderer::trace_batch(const SceneInfo& scene)
+{
+	for (int32_t depth = 0; !_paths.empty(); depth++)
+	{
+		size_t n = _paths.size();
+		_hits.resize(n);
+		thread_ray_count() += n;
+		SPUD_COUNT_RAYS(depth, n);
+		for (auto& bucket : _buckets)
+			bucket.clear();
+
+		// intersect the whole batch, escaped paths pick up the sky and leave
+		for (size_t p = 0; p < n; p++)
+		{
+			Path& path = _paths[p];
+			if (!scene._world->hit(path._ray, 0.001f, FLT_MAX, _hits[p])) {
+				_accum[path._pixel] += path._throughput * sky_color(path._ray.direction());
+				if (depth == 0 && !_features.empty())
+					_features[path._pixel].add(FirstHit::miss(path._ray.direction()));
+				continue;
+			}
+			if (depth == 0 && !_features.empty()) {
+				const HitRecord& rec = _hits[p];
+				_features[path._pixel].add(FirstHit{ scene._world->materials().albedo(rec.mat_id),
+					unit_vector(rec.normal), rec.t * path._ray.direction().length() });
+			}
+			if (depth >= scene._max_depth)
+				continue;
+			_buckets[(int)_hits[p].mat_id.kind()].push_back((uint32_t)p);
+		}
+
+		for (int k = 0; k < (int)MaterialKind::Count; k++)
+			SPUD_COUNT_SCATTER(k, _buckets[k].size());
+
+		// shade one material type at a time, survivors come out grouped by material
+		_next.clear();
+		scatter_bucket<Lambertian>(scene, depth, _buckets[(int)MaterialKind::Lambertian]);
+		scatter_bucket<Metal>(scene, depth, _buckets[(int)MaterialKind::Metal]);
+		scatter_bucket<Dielectric>(scene, depth, _buckets[(int)MaterialKind::Dielectric]);
+		scatter_bucket<Material>(scene, depth, _buckets[(int)MaterialKind::Custom]);
+		_paths.swap(_next);
+	}
+}
+
+template <typename M>
+void WavefrontRenderer::scatter_bucket(const SceneInfo& scene, int32_t depth, const std::vector<uint32_t>& bucket)
+{
+	const MaterialPool& materials = scene._world->materials();
+	for (uint32_t p : bucket)
+	{
+		Path& path = _paths[p];
+		const HitRecord& rec = _hits[p];
+
+		ray scattered;
+		vector3 attenuation;
+		path._sampler.start_dimension(Sampler::bounce_dimension(depth));
+		if (!scatter_as<M>(materials, path._ray, rec, attenuation, scattered, path._sampler))
+			continue;
+
+		path._throughput *= attenuation;
+		if (depth >= scene._rr_depth && !russian_roulette(path._throughput, depth, path._sampler))
+			continue;
+
+		path._ray = scattered;
+		_next.push_back(path);
+	}
+}
+
+// renders region into film tile by tile with a WavefrontRenderer per worker thread
+void wavefront_process(ThreadPool& pool, const SceneInfo& scene, const Tile& region, Film& film,
+	const std::function<void(const Tile&)>& on_tile = nullptr, FirstHit* features = nullptr)
+{
+	for_each_tile(pool, region, scene._tile_size, [&](const Tile& tile) {
+		static thread_local WavefrontRenderer renderer;
+		renderer.render_tile(scene, tile, film, features);
+		flush_ray_count();
+		if (on_tile)
+			on_tile(tile);
+	});
+}
+
+inline void wavefront_process(ThreadPool& pool, const SceneInfo& scene, Film& film,
+	const std::function<void(const Tile&)>& on_tile = nullptr, FirstHit* features = nullptr)
+{
+	wavefront_process(pool, scene, Tile{ 0, 0, scene._width, scene._height }, film, on_tile, features);
+}